@@ -1,24 +1,39 @@
 #include <SoapySDR/Logger.hpp>
 #include <spyserver_client.h>
-#include <volk/volk.h>
+#include "Tracing.hpp"
 #include <chrono>
 #include <cstring>
 
 namespace spyserver {
-    SpyServerClientClass::SpyServerClientClass(net::Conn conn, DSPComplexBufferQueue& out): outputQueue(out) {
+    SpyServerClientClass::SpyServerClientClass(net::Conn conn, MessageHandler* handler) : handler(handler) {
         readBuf = new uint8_t[SPYSERVER_MAX_MESSAGE_BODY_SIZE];
-        writeBuf = new uint8_t[SPYSERVER_MAX_MESSAGE_BODY_SIZE];
         client = std::move(conn);
+        networked = true;
 
+        // Settings that don't depend on the device go out with the handshake.
+        // The ping tells us early whether the server answers them: its pong
+        // arrives before the response to anything sent afterwards.
+        beginBatch();
         sendHandshake("SoapySDR");
+        setSetting(SPYSERVER_SETTING_STREAMING_MODE, SPYSERVER_STREAM_MODE_IQ_ONLY);
+        sendPing();
+        endBatch();
 
         client->readAsync(sizeof(SpyServerMessageHeader), (uint8_t*)&receivedHeader, dataHandler, this);
     }
 
+    SpyServerClientClass::SpyServerClientClass(MessageHandler* handler) : handler(handler) {
+        readBuf = nullptr;
+    }
+
     SpyServerClientClass::~SpyServerClientClass() {
         close();
         delete[] readBuf;
-        delete[] writeBuf;
+    }
+
+    void SpyServerClientClass::setMessageHandler(MessageHandler* handler) {
+        std::lock_guard<std::mutex> lck(handlerMtx);
+        this->handler = handler;
     }
 
     void SpyServerClientClass::startStream() {
@@ -29,11 +44,126 @@ namespace spyserver {
         setSetting(SPYSERVER_SETTING_STREAMING_ENABLED, false);
     }
 
-    void SpyServerClientClass::close() {
+    static void configureThread(const ThreadConfig& config, const char* role) {
+        try {
+            configureCurrentThread(config);
+        }
+        catch (const std::exception& ex) {
+            SoapySDR::logf(SOAPY_SDR_WARNING, "SpyServer %s thread: %s", role, ex.what());
+        }
+    }
+
+    void SpyServerClientClass::configureThreads(const ThreadConfig& readConfig, const ThreadConfig& writeConfig) {
+        if (!networked) { return; }
+
+        std::lock_guard<std::recursive_mutex> lck(commandMtx);
+        readThreadConfig.reset(new ThreadConfig(readConfig));
+        writeThreadConfig.reset(new ThreadConfig(writeConfig));
+        client->runOnReadWorker([readConfig]() { configureThread(readConfig, "read"); });
+        client->runOnWriteWorker([writeConfig]() { configureThread(writeConfig, "write"); });
+    }
+
+    void SpyServerClientClass::forEachStatusMessage(const std::function<void(const SpyServerMessageHeader&, const uint8_t*)>& func) {
+        SpyServerMessageHeader header;
+        header.ProtocolID = SPYSERVER_PROTOCOL_VERSION;
+        header.StreamType = SPYSERVER_STREAM_TYPE_STATUS;
+
+        // Repeating the last sequence number keeps these out of the gap count.
+        header.SequenceNumber = lastSequenceNumber.load(std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> infoLck(deviceInfoMtx);
+            if (deviceInfoAvailable) {
+                header.MessageType = SPYSERVER_MSG_TYPE_DEVICE_INFO;
+                header.BodySize = sizeof(devInfo);
+                func(header, (const uint8_t*)&devInfo);
+            }
+        }
+        {
+            // The last one received, even if it's waiting on an acknowledgement.
+            std::lock_guard<std::mutex> syncLck(clientSyncMtx);
+            if (clientSyncCount > 0) {
+                header.MessageType = SPYSERVER_MSG_TYPE_CLIENT_SYNC;
+                header.BodySize = sizeof(clientSync);
+                func(header, (const uint8_t*)&clientSync);
+            }
+        }
+    }
+
+    bool SpyServerClientClass::reconnect(const std::string& host, uint16_t port, const std::function<void(const Acknowledgement&)>& resent) {
+        if (!networked) { return false; }
+
+        // Connecting throws while the server is down, which is when this is needed.
+        net::Conn conn;
+        try {
+            conn = net::connect(host, port, client->pollEngine());
+        }
+        catch (const std::exception& ex) {
+            SoapySDR::logf(SOAPY_SDR_DEBUG, "SpyServer reconnect: %s", ex.what());
+            return false;
+        }
+        if (!conn) { return false; }
+
+        // With the old connection's read thread stopped, nothing else touches
+        // the receive state until the new one starts.
         client->close();
+        {
+            // The handshake sends it again.
+            std::lock_guard<std::mutex> lck(deviceInfoMtx);
+            deviceInfoAvailable = false;
+        }
+        {
+            // Pings on the old connection will never be answered.
+            std::lock_guard<std::mutex> lck(clientSyncMtx);
+            pongsReceived = pingsSent.load();
+        }
+        clientSyncCnd.notify_all();
+
+        {
+            std::lock_guard<std::recursive_mutex> lck(commandMtx);
+            client = std::move(conn);
+
+            // Anything queued in an open batch goes after the settings it changes.
+            std::vector<uint8_t> pending;
+            pending.swap(commandBuf);
+            auto settings = sentSettings;
+
+            beginBatch();
+            sendHandshake("SoapySDR");
+            for (const auto& setting : settings) {
+                if (setting.first != SPYSERVER_SETTING_STREAMING_ENABLED) {
+                    setSetting(setting.first, setting.second);
+                }
+            }
+            if (settings.count(SPYSERVER_SETTING_STREAMING_ENABLED)) {
+                setSetting(SPYSERVER_SETTING_STREAMING_ENABLED, settings.at(SPYSERVER_SETTING_STREAMING_ENABLED));
+            }
+
+            resent(requestAcknowledgement());
+            commandBuf.insert(commandBuf.end(), pending.begin(), pending.end());
+            endBatch();
+
+            if (readThreadConfig) {
+                ThreadConfig readConfig = *readThreadConfig;
+                ThreadConfig writeConfig = *writeThreadConfig;
+                client->runOnReadWorker([readConfig]() { configureThread(readConfig, "read"); });
+                client->runOnWriteWorker([writeConfig]() { configureThread(writeConfig, "write"); });
+            }
+        }
+
+        client->readAsync(sizeof(SpyServerMessageHeader), (uint8_t*)&receivedHeader, dataHandler, this);
+        return true;
+    }
+
+    void SpyServerClientClass::close() {
+        closed = true;
+        if (client) {
+            client->close();
+        }
     }
 
     bool SpyServerClientClass::isOpen() {
+        if (!networked) { return !closed; }
+        std::lock_guard<std::recursive_mutex> lck(commandMtx);
         return client->isOpen();
     }
 
@@ -54,25 +184,75 @@ namespace spyserver {
     }
 
     bool SpyServerClientClass::waitForDevInfo(int timeoutMS) {
+        return waitForDevInfoUntil(std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMS));
+    }
+
+    bool SpyServerClientClass::waitForClientSync(int timeoutMS) {
+        return waitForClientSyncUntil(std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMS));
+    }
+
+    bool SpyServerClientClass::waitForHandshake(int timeoutMS) {
+        // Both usually arrive together, so this is rarely more than one wait.
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMS);
+        return waitForDevInfoUntil(deadline) && waitForClientSyncUntil(deadline);
+    }
+
+    bool SpyServerClientClass::waitForDevInfoUntil(std::chrono::steady_clock::time_point deadline) {
         std::unique_lock<std::mutex> lck(deviceInfoMtx);
-        auto now = std::chrono::system_clock::now();
-        deviceInfoCnd.wait_until(lck, now + std::chrono::milliseconds(timeoutMS), [this]() { return deviceInfoAvailable; });
+        deviceInfoCnd.wait_until(lck, deadline, [this]() { return deviceInfoAvailable; });
         return deviceInfoAvailable;
     }
 
-    bool SpyServerClientClass::waitForClientSync(int timeoutMS) {
+    bool SpyServerClientClass::waitForClientSyncUntil(std::chrono::steady_clock::time_point deadline) {
         std::unique_lock<std::mutex> lck(clientSyncMtx);
-        auto now = std::chrono::system_clock::now();
-        clientSyncCnd.wait_until(lck, now + std::chrono::milliseconds(timeoutMS), [this]() { return clientSyncAvailable; });
+        clientSyncCnd.wait_until(lck, deadline, [this]() { return clientSyncAvailable; });
         return clientSyncAvailable;
     }
 
+    void SpyServerClientClass::beginBatch() {
+        std::lock_guard<std::recursive_mutex> lck(commandMtx);
+        batchDepth++;
+    }
+
+    void SpyServerClientClass::endBatch() {
+        std::lock_guard<std::recursive_mutex> lck(commandMtx);
+        if (batchDepth > 0 && --batchDepth == 0) {
+            flushCommands();
+        }
+    }
+
     void SpyServerClientClass::sendCommand(uint32_t command, void* data, int len) {
-        SpyServerCommandHeader* hdr = (SpyServerCommandHeader*)writeBuf;
-        hdr->CommandType = command;
-        hdr->BodySize = len;
-        memcpy(&writeBuf[sizeof(SpyServerCommandHeader)], data, len);
-        client->write(sizeof(SpyServerCommandHeader) + len, writeBuf);
+        // Nobody to command without a server.
+        if (!networked) { return; }
+
+        SpyServerCommandHeader hdr;
+        hdr.CommandType = command;
+        hdr.BodySize = len;
+
+        std::lock_guard<std::recursive_mutex> lck(commandMtx);
+        commandBuf.insert(commandBuf.end(), (uint8_t*)&hdr, (uint8_t*)&hdr + sizeof(hdr));
+        commandBuf.insert(commandBuf.end(), (uint8_t*)data, (uint8_t*)data + len);
+        if (batchDepth == 0) {
+            flushCommands();
+        }
+    }
+
+    void SpyServerClientClass::flushCommands() {
+        if (commandBuf.empty()) { return; }
+
+        // Until the server answers, the client sync may predate what's being
+        // sent, so waits for it wait for the pongs instead. This happens
+        // before the write, so the pongs can't beat it.
+        if (pingQueued) {
+            {
+                std::lock_guard<std::mutex> lck(clientSyncMtx);
+                pingsWritten = pingsSent;
+                clientSyncAvailable = false;
+            }
+            pingQueued = false;
+        }
+        client->write((int)commandBuf.size(), commandBuf.data());
+        commandBuf.clear();
     }
 
     void SpyServerClientClass::sendHandshake(std::string appName) {
@@ -88,10 +268,43 @@ namespace spyserver {
         delete[] buf;
     }
 
+    uint64_t SpyServerClientClass::sendPing() {
+        std::lock_guard<std::recursive_mutex> lck(commandMtx);
+        uint8_t dummy = 0;
+        uint64_t ping = ++pingsSent;
+        pingQueued = true;
+        sendCommand(SPYSERVER_CMD_PING, &dummy, 0);
+        return ping;
+    }
+
+    SpyServerClientClass::Acknowledgement SpyServerClientClass::requestAcknowledgement() {
+        Acknowledgement ack;
+        ack.syncCount = clientSyncCount;
+        ack.ping = networked ? sendPing() : 0;
+        return ack;
+    }
+
+    bool SpyServerClientClass::acknowledged(const Acknowledgement& ack) {
+        if (!networked) { return true; }
+        if (pongsReceived >= ack.ping) { return true; }
+
+        // Fall back on client sync messages for servers that never answer pings.
+        return (pongsReceived == 0) && (clientSyncCount > ack.syncCount);
+    }
+
+    bool SpyServerClientClass::waitForAcknowledgement(const Acknowledgement& ack, int timeoutMS) {
+        std::unique_lock<std::mutex> lck(clientSyncMtx);
+        return clientSyncCnd.wait_for(lck, std::chrono::milliseconds(timeoutMS), [&]() { return acknowledged(ack); });
+    }
+
     void SpyServerClientClass::setSetting(uint32_t setting, uint32_t arg) {
         SpyServerSettingTarget target;
         target.Setting = setting;
         target.Value = arg;
+
+        // Recorded under the same lock, so it matches what was sent last.
+        std::lock_guard<std::recursive_mutex> lck(commandMtx);
+        sentSettings[setting] = arg;
         sendCommand(SPYSERVER_CMD_SET_SETTING, &target, sizeof(SpyServerSettingTarget));
     }
 
@@ -113,72 +326,93 @@ namespace spyserver {
             _this->readSize(sizeof(SpyServerMessageHeader) - count, &buf[count]);
         }
 
-        int size = _this->readSize(_this->receivedHeader.BodySize, _this->readBuf);
-        if (size <= 0) {
-            SoapySDR::log(SOAPY_SDR_INFO, "SpyServer device disconnected");
+        SPYSERVER_TRACE3(message_header, _this->receivedHeader.MessageType, _this->receivedHeader.SequenceNumber, _this->receivedHeader.BodySize);
+
+        if (_this->receivedHeader.BodySize > SPYSERVER_MAX_MESSAGE_BODY_SIZE) {
+            SoapySDR::logf(SOAPY_SDR_ERROR, "SpyServer message body too large (%u bytes)", _this->receivedHeader.BodySize);
+            _this->client->close();
+            return;
+        }
+
+        // Some messages (e.g. PONG) have no body.
+        if (_this->receivedHeader.BodySize == 0) {
+            bodyHandler(0, _this->readBuf, _this);
             return;
         }
+        _this->client->readAsync(_this->receivedHeader.BodySize, _this->readBuf, bodyHandler, _this);
+    }
 
-        int mtype = _this->receivedHeader.MessageType & 0xFFFF;
-        int mflags = (_this->receivedHeader.MessageType & 0xFFFF0000) >> 16;
+    void SpyServerClientClass::bodyHandler(int count, uint8_t* buf, void* ctx) {
+        SpyServerClientClass* _this = (SpyServerClientClass*)ctx;
+        (void)count;
+        (void)buf;
+
+        auto receivedTime = std::chrono::steady_clock::now();
+        SPYSERVER_TRACE3(message_body, _this->receivedHeader.MessageType, _this->receivedHeader.SequenceNumber, _this->receivedHeader.BodySize);
+
+        if (!_this->receive(_this->receivedHeader, _this->readBuf, receivedTime)) {
+            return;
+        }
+
+        _this->client->readAsync(sizeof(SpyServerMessageHeader), (uint8_t*)&_this->receivedHeader, dataHandler, _this);
+    }
+
+    bool SpyServerClientClass::receive(const SpyServerMessageHeader& header, const uint8_t* body, std::chrono::steady_clock::time_point receivedTime) {
+        lastSequenceNumber.store(header.SequenceNumber, std::memory_order_relaxed);
+
+        int mtype = header.MessageType & 0xFFFF;
 
         if (mtype == SPYSERVER_MSG_TYPE_DEVICE_INFO) {
             {
-                std::lock_guard<std::mutex> lck(_this->deviceInfoMtx);
-                SpyServerDeviceInfo* _devInfo = (SpyServerDeviceInfo*)_this->readBuf;
-                _this->devInfo = *_devInfo;
-                _this->deviceInfoAvailable = true;
+                std::lock_guard<std::mutex> lck(deviceInfoMtx);
+                SpyServerDeviceInfo* _devInfo = (SpyServerDeviceInfo*)body;
+                devInfo = *_devInfo;
+                deviceInfoAvailable = true;
             }
-            _this->deviceInfoCnd.notify_all();
+            deviceInfoCnd.notify_all();
         }
         else if (mtype == SPYSERVER_MSG_TYPE_CLIENT_SYNC) {
             {
-                std::lock_guard<std::mutex> lck(_this->clientSyncMtx);
-                SpyServerClientSync* _clientSync = (SpyServerClientSync*)_this->readBuf;
-                _this->clientSync = *_clientSync;
-                _this->clientSyncAvailable = true;
+                std::lock_guard<std::mutex> lck(clientSyncMtx);
+                SpyServerClientSync* _clientSync = (SpyServerClientSync*)body;
+                clientSync = *_clientSync;
+                clientSyncCount++;
+
+                // Servers that never answer pings only have this to go on.
+                if (pongsReceived == 0 || pongsReceived >= pingsWritten) {
+                    clientSyncAvailable = true;
+                }
             }
-            _this->clientSyncCnd.notify_all();
-        }
-        else if (mtype == SPYSERVER_MSG_TYPE_UINT8_IQ) {
-            int sampCount = _this->receivedHeader.BodySize / (sizeof(uint8_t) * 2);
-            volk::vector<dsp::complex_t> output(sampCount);
-            float gain = pow(10, (double)mflags / 20.0);
-            float scale = 1.0f / (gain * 128.0f);
-            for (int i = 0; i < sampCount; i++) {
-                output[i].re = ((float)_this->readBuf[(2 * i)] - 128.0f) * scale;
-                output[i].im = ((float)_this->readBuf[(2 * i) + 1] - 128.0f) * scale;
+            clientSyncCnd.notify_all();
+        }
+        else if (mtype == SPYSERVER_MSG_TYPE_PONG) {
+            {
+                std::lock_guard<std::mutex> lck(clientSyncMtx);
+                pongsReceived++;
+
+                // Any sync sent in response to what was pinged came before this.
+                if (clientSyncCount > 0 && pongsReceived >= pingsWritten) {
+                    clientSyncAvailable = true;
+                }
             }
-            _this->outputQueue.enqueue(std::move(output));
-        }
-        else if (mtype == SPYSERVER_MSG_TYPE_INT16_IQ) {
-            int sampCount = _this->receivedHeader.BodySize / (sizeof(int16_t) * 2);
-            volk::vector<dsp::complex_t> output(sampCount);
-            float gain = pow(10, (double)mflags / 20.0);
-            volk_16i_s32f_convert_32f((float*)output.data(), (int16_t*)_this->readBuf, 32768.0 * gain, sampCount * 2);
-            _this->outputQueue.enqueue(std::move(output));
-        }
-        else if (mtype == SPYSERVER_MSG_TYPE_FLOAT_IQ) {
-            int sampCount = _this->receivedHeader.BodySize / sizeof(dsp::complex_t);
-            volk::vector<dsp::complex_t> output(sampCount);
-            float gain = pow(10, (double)mflags / 20.0);
-            volk_32f_s32f_multiply_32f((float*)output.data(), (float*)_this->readBuf, gain, sampCount * 2);
-            _this->outputQueue.enqueue(std::move(output));
-        } else if (mtype == SPYSERVER_MSG_TYPE_INT24_IQ) {
+            clientSyncCnd.notify_all();
+        }
+        else if (mtype == SPYSERVER_MSG_TYPE_INT24_IQ) {
             SoapySDR::log(
                 SOAPY_SDR_FATAL,
                 "SpyServer returned unsupported stream format INT24. We should have caught this.");
-            return;
+            return false;
         }
 
-        _this->client->readAsync(sizeof(SpyServerMessageHeader), (uint8_t*)&_this->receivedHeader, dataHandler, _this);
+        std::lock_guard<std::mutex> lck(handlerMtx);
+        return !handler || handler->handleMessage(header, body, receivedTime);
     }
 
-    SpyServerClient connect(std::string host, uint16_t port, DSPComplexBufferQueue& out) {
-        net::Conn conn = net::connect(host, port);
+    SpyServerClient connect(std::string host, uint16_t port, MessageHandler* handler, net::PollEngine engine) {
+        net::Conn conn = net::connect(host, port, engine);
         if (!conn) {
             return NULL;
         }
-        return SpyServerClient(new SpyServerClientClass(std::move(conn), out));
+        return SpyServerClient(new SpyServerClientClass(std::move(conn), handler));
     }
 }
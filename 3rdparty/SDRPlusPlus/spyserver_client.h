@@ -1,36 +1,101 @@
 #pragma once
 #include <utils/networking.h>
 #include <spyserver_protocol.h>
-#include <dsp/types.h>
 
-#include "CappedSizeQueue.hpp"
-#include <volk/volk_alloc.hh>
-
-using DSPComplexBufferQueue = CappedSizeQueue<volk::vector<dsp::complex_t>>;
+#include "ThreadUtils.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 /*
  * Originally written by Alexandre Rouma:
  *  * https://github.com/AlexandreRouma/SDRPlusPlus/tree/master/source_modules/spyserver_source
  *
  * Adapted by Nicholas Corgan:
- *  * Move samples into queue for caller instead of SDR++-specific stream class
+ *  * Hand every message to the caller instead of SDR++-specific DSP
  *  * Convert prints to SoapySDR logging
  *  * Compatibility with earlier C++ standard
+ *  * Accept messages with no body, and reject oversized ones
+ *  * Batch commands into single writes, and wait for the server to acknowledge them
+ *  * Replace the connection, resending every setting
+ *  * Read asynchronously, optionally on a poll engine shared between connections
+ *  * Take messages from the caller when there's no connection
+ *  * Only report the client sync as available once pings sent since are answered
  */
 namespace spyserver {
+    // Gets every message, after the client has taken what it needs from it,
+    // on whichever thread received it.
+    class MessageHandler {
+    public:
+        virtual ~MessageHandler() {}
+
+        // Returns false if the stream can't continue.
+        virtual bool handleMessage(const SpyServerMessageHeader& header, const uint8_t* body, std::chrono::steady_clock::time_point receivedTime) = 0;
+    };
+
     class SpyServerClientClass {
     public:
-        SpyServerClientClass(net::Conn conn, DSPComplexBufferQueue& out);
+        SpyServerClientClass(net::Conn conn, MessageHandler* handler = nullptr);
+
+        // Without a connection, commands go nowhere, and messages only come
+        // from receive().
+        explicit SpyServerClientClass(MessageHandler* handler);
         ~SpyServerClientClass();
 
+        // Waits for any message being handled to finish first.
+        void setMessageHandler(MessageHandler* handler);
+
+        // Handles a message as if it had been received. Returns false if the
+        // stream can't continue.
+        bool receive(const SpyServerMessageHeader& header, const uint8_t* body, std::chrono::steady_clock::time_point receivedTime);
+
+        // Once a ping has been written, the client sync is only available
+        // again when the server has answered it, so it reflects everything
+        // sent before the ping.
         bool waitForDevInfo(int timeoutMS);
         bool waitForClientSync(int timeoutMS);
 
+        // Waits for both, within a single timeout.
+        bool waitForHandshake(int timeoutMS);
+
+        // Commands sent in between are written together, in one call, when
+        // the outermost batch ends.
+        void beginBatch();
+        void endBatch();
+
+        struct Acknowledgement {
+            uint64_t ping;
+            uint64_t syncCount;
+        };
+
+        // Queues a ping behind everything sent so far. Once it's answered, the
+        // client sync reflects all of it. Without a connection, everything is
+        // acknowledged already.
+        Acknowledgement requestAcknowledgement();
+        bool acknowledged(const Acknowledgement& ack);
+        bool waitForAcknowledgement(const Acknowledgement& ack, int timeoutMS);
+
         void startStream();
         void stopStream();
 
         void setSetting(uint32_t setting, uint32_t arg);
 
+        // Applied from the threads themselves, so failures are only logged.
+        void configureThreads(const ThreadConfig& readConfig, const ThreadConfig& writeConfig);
+
+        // Synthesizes the current DEVICE_INFO and CLIENT_SYNC messages.
+        void forEachStatusMessage(const std::function<void(const SpyServerMessageHeader&, const uint8_t*)>& func);
+
+        // Replaces the connection, resending the handshake and every setting
+        // sent so far. The callback gets an acknowledgement of all of it, before
+        // anything is read from the new connection.
+        bool reconnect(const std::string& host, uint16_t port, const std::function<void(const Acknowledgement&)>& resent);
+
         void close();
         bool isOpen();
 
@@ -41,16 +106,48 @@ namespace spyserver {
 
     private:
         void sendCommand(uint32_t command, void* data, int len);
+        void flushCommands();
         void sendHandshake(std::string appName);
+        uint64_t sendPing();
+
+        bool waitForDevInfoUntil(std::chrono::steady_clock::time_point deadline);
+        bool waitForClientSyncUntil(std::chrono::steady_clock::time_point deadline);
 
         int readSize(int count, uint8_t* buffer);
 
+        // The body is read asynchronously too, so a poll engine shared with
+        // other connections never waits on this one.
         static void dataHandler(int count, uint8_t* buf, void* ctx);
+        static void bodyHandler(int count, uint8_t* buf, void* ctx);
 
+        // Replaced on reconnecting, under commandMtx.
         net::Conn client;
 
+        // Whether there's a server, as opposed to messages from receive().
+        bool networked = false;
+
         uint8_t* readBuf;
-        uint8_t* writeBuf;
+
+        // Without a connection, whether close() has been called.
+        std::atomic<bool> closed{false};
+
+        // Guards the handler, and is held while it runs.
+        std::mutex handlerMtx;
+        MessageHandler* handler = nullptr;
+
+        // Commands waiting to be written, guarded by commandMtx. Recursive so
+        // reconnecting can resend everything as a single batch.
+        std::recursive_mutex commandMtx;
+        std::vector<uint8_t> commandBuf;
+        int batchDepth = 0;
+        bool pingQueued = false;
+
+        // The last value sent for each setting, for a new connection.
+        std::map<uint32_t, uint32_t> sentSettings;
+
+        // Also reapplied to a new connection.
+        std::unique_ptr<ThreadConfig> readThreadConfig;
+        std::unique_ptr<ThreadConfig> writeThreadConfig;
 
         bool deviceInfoAvailable = false;
         std::mutex deviceInfoMtx;
@@ -59,14 +156,46 @@ namespace spyserver {
         bool clientSyncAvailable = false;
         std::mutex clientSyncMtx;
         std::condition_variable clientSyncCnd;
+        std::atomic<uint64_t> clientSyncCount{0};
+
+        std::atomic<uint64_t> pingsSent{0};
+
+        // Pings flushed to the server, guarded by clientSyncMtx.
+        uint64_t pingsWritten = 0;
+
+        // Updated under clientSyncMtx, which clientSyncCnd also signals.
+        std::atomic<uint64_t> pongsReceived{0};
 
         SpyServerMessageHeader receivedHeader;
 
-        DSPComplexBufferQueue& outputQueue;
+        // For synthesized status messages.
+        std::atomic<uint32_t> lastSequenceNumber{0};
+    };
+
+    // Begins a batch, and ends it on leaving scope if nothing else did.
+    class CommandBatch {
+    public:
+        explicit CommandBatch(SpyServerClientClass& client) : client(client) { client.beginBatch(); }
+        ~CommandBatch() { end(); }
+
+        CommandBatch(const CommandBatch&) = delete;
+        CommandBatch& operator=(const CommandBatch&) = delete;
+
+        void end() {
+            if (open) {
+                open = false;
+                client.endBatch();
+            }
+        }
+
+    private:
+        SpyServerClientClass& client;
+        bool open = true;
     };
 
     typedef std::unique_ptr<SpyServerClientClass> SpyServerClient;
 
-    SpyServerClient connect(std::string host, uint16_t port, DSPComplexBufferQueue& out);
+    // With a poll engine, the connection has no threads of its own.
+    SpyServerClient connect(std::string host, uint16_t port, MessageHandler* handler = nullptr, net::PollEngine engine = nullptr);
 
 }
@@ -1,5 +1,9 @@
 #include <utils/networking.h>
+#include "Tracing.hpp"
 #include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
 
 namespace net {
 
@@ -7,11 +11,204 @@ namespace net {
     extern bool winsock_init = false;
 #endif
 
-    ConnClass::ConnClass(Socket sock, struct sockaddr_in raddr, bool udp) {
+    static int pollSockets(struct pollfd* fds, size_t count, int timeoutMs) {
+#ifdef _WIN32
+        return WSAPoll(fds, (ULONG)count, timeoutMs);
+#else
+        return poll(fds, (nfds_t)count, timeoutMs);
+#endif
+    }
+
+    // Writes are already whole messages or batches of commands, so don't hold
+    // one back until the other side acknowledges the last. When the other
+    // side has nothing to send, nothing carries that acknowledgement back
+    // quickly.
+    static void setNoDelay(Socket sock) {
+        int noDelay = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&noDelay, sizeof(noDelay));
+    }
+
+    static void setNonBlocking(Socket sock) {
+#ifdef _WIN32
+        u_long mode = 1;
+        ioctlsocket(sock, FIONBIO, &mode);
+#else
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+#endif
+    }
+
+    static bool wouldBlock() {
+#ifdef _WIN32
+        return (WSAGetLastError() == WSAEWOULDBLOCK);
+#else
+        return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+#endif
+    }
+
+    static void closeSocket(Socket sock) {
+#ifdef _WIN32
+        closesocket(sock);
+#else
+        ::close(sock);
+#endif
+    }
+
+    PollEngineClass::PollEngineClass() {
+#ifdef _WIN32
+        // Initialize WinSock2
+        if (!winsock_init) {
+            WSADATA wsa;
+            if (WSAStartup(MAKEWORD(2, 2), &wsa)) {
+                throw std::runtime_error("Could not initialize WinSock2");
+            }
+            winsock_init = true;
+        }
+        assert(winsock_init);
+#endif
+
+        wakeSock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (wakeSock < 0) {
+            throw std::runtime_error("Could not create socket");
+        }
+
+        // Bind to any free loopback port, then connect to it
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        socklen_t addrLen = sizeof(addr);
+        if (bind(wakeSock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+            getsockname(wakeSock, (struct sockaddr*)&addr, &addrLen) < 0 ||
+            ::connect(wakeSock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            closeSocket(wakeSock);
+            throw std::runtime_error("Could not create wake socket");
+        }
+        setNonBlocking(wakeSock);
+
+        workerThread = std::thread(&PollEngineClass::worker, this);
+    }
+
+    PollEngineClass::~PollEngineClass() {
+        {
+            std::lock_guard<std::mutex> lck(mtx);
+            stopWorker = true;
+        }
+        wake();
+
+        if (workerThread.joinable()) { workerThread.join(); }
+        closeSocket(wakeSock);
+    }
+
+    void PollEngineClass::runOnWorker(std::function<void()> func) {
+        {
+            std::lock_guard<std::mutex> lck(mtx);
+            tasks.push_back(std::move(func));
+        }
+        wake();
+    }
+
+    void PollEngineClass::add(ConnClass* conn) {
+        {
+            std::lock_guard<std::mutex> lck(mtx);
+            conns.push_back(conn);
+        }
+        wake();
+    }
+
+    void PollEngineClass::remove(ConnClass* conn) {
+        // The engine's own thread is already servicing, and is the only one
+        // that could be using the connection.
+        std::unique_lock<std::mutex> serviceLck(serviceMtx, std::defer_lock);
+        if (!onWorker()) { serviceLck.lock(); }
+
+        {
+            std::lock_guard<std::mutex> lck(mtx);
+            conns.erase(std::remove(conns.begin(), conns.end(), conn), conns.end());
+        }
+        wake();
+    }
+
+    void PollEngineClass::wake() {
+        char dummy = 0;
+        send(wakeSock, &dummy, 1, 0);
+    }
+
+    bool PollEngineClass::onWorker() {
+        return (std::this_thread::get_id() == workerThread.get_id());
+    }
+
+    void PollEngineClass::worker() {
+        std::vector<struct pollfd> fds;
+        std::vector<ConnClass*> polled;
+
+        while (true) {
+            // Run queued tasks first, since reads they start don't wake us
+            std::vector<std::function<void()>> pendingTasks;
+            {
+                std::lock_guard<std::mutex> lck(mtx);
+                if (stopWorker) { return; }
+                pendingTasks.swap(tasks);
+            }
+            for (auto& task : pendingTasks) { task(); }
+
+            // Poll every connection waiting on a read, and the wake socket.
+            // The sockets are copied while the connections are certain to
+            // exist, since any may be removed and freed once this unlocks.
+            polled.clear();
+            fds.resize(1);
+            fds[0].fd = wakeSock;
+            fds[0].events = POLLIN;
+            fds[0].revents = 0;
+            {
+                std::lock_guard<std::mutex> lck(mtx);
+                for (ConnClass* conn : conns) {
+                    if (!conn->hasPendingRead()) { continue; }
+
+                    struct pollfd fd;
+                    fd.fd = conn->_sock;
+                    fd.events = POLLIN;
+                    fd.revents = 0;
+                    fds.push_back(fd);
+                    polled.push_back(conn);
+                }
+            }
+
+            if (pollSockets(fds.data(), fds.size(), -1) < 0) { continue; }
+
+            if (fds[0].revents & POLLIN) {
+                char buf[64];
+                while (recv(wakeSock, buf, sizeof(buf), 0) > 0) {}
+            }
+
+            // Only connections still registered are touched. Holding the
+            // service lock keeps remove() from returning, and the connection
+            // from being freed, until servicing is done.
+            std::lock_guard<std::mutex> serviceLck(serviceMtx);
+            for (size_t i = 0; i < polled.size(); i++) {
+                if (!(fds[i + 1].revents & (POLLIN | POLLERR | POLLHUP))) { continue; }
+                {
+                    std::lock_guard<std::mutex> lck(mtx);
+                    if (std::find(conns.begin(), conns.end(), polled[i]) == conns.end()) { continue; }
+                }
+                polled[i]->serviceRead();
+            }
+        }
+    }
+
+    ConnClass::ConnClass(Socket sock, struct sockaddr_in raddr, bool udp, PollEngine engine) {
         _sock = sock;
         _udp = udp;
         remoteAddr = raddr;
         connectionOpen = true;
+        this->engine = engine;
+
+        if (engine) {
+            setNonBlocking(_sock);
+            engine->add(this);
+            return;
+        }
+
         readWorkerThread = std::thread(&ConnClass::readWorker, this);
         writeWorkerThread = std::thread(&ConnClass::writeWorker, this);
     }
@@ -33,6 +230,9 @@ namespace net {
         readQueueCnd.notify_all();
         writeQueueCnd.notify_all();
 
+        // The engine has to be done with the socket before it's closed
+        if (engine) { engine->remove(this); }
+
         if (connectionOpen) {
 #ifdef _WIN32
             closesocket(_sock);
@@ -85,6 +285,9 @@ namespace net {
         while (beenRead < count) {
             ret = recv(_sock, (char*)&buf[beenRead], count - beenRead, 0);
 
+            // Non-blocking with a poll engine
+            if (ret < 0 && engine && wouldBlock() && waitForSocket(POLLIN)) { continue; }
+
             if (ret <= 0) {
                 {
                     std::lock_guard<std::mutex> lck(connectionOpenMtx);
@@ -94,11 +297,15 @@ namespace net {
                 return -1;
             }
 
-            if (!enforceSize) { return ret; }
+            if (!enforceSize) {
+                SPYSERVER_TRACE2(conn_read, count, ret);
+                return ret;
+            }
 
             beenRead += ret;
         }
 
+        SPYSERVER_TRACE2(conn_read, count, beenRead);
         return beenRead;
     }
 
@@ -121,7 +328,11 @@ namespace net {
 
         int beenWritten = 0;
         while (beenWritten < count) {
-            ret = send(_sock, (char*)buf, count, 0);
+            ret = send(_sock, (char*)&buf[beenWritten], count - beenWritten, 0);
+
+            // Non-blocking with a poll engine
+            if (ret < 0 && engine && wouldBlock() && waitForSocket(POLLOUT)) { continue; }
+
             if (ret <= 0) {
                 {
                     std::lock_guard<std::mutex> lck(connectionOpenMtx);
@@ -152,12 +363,23 @@ namespace net {
             readQueue.push_back(entry);
         }
 
-        // Notify read worker
+        // Notify read worker, or the engine, unless this is from its handler
+        if (engine) {
+            if (!engine->onWorker()) { engine->wake(); }
+            return;
+        }
         readQueueCnd.notify_all();
     }
 
     void ConnClass::writeAsync(int count, uint8_t* buf) {
         if (!connectionOpen) { return; }
+
+        // No write worker with a poll engine
+        if (engine) {
+            write(count, buf);
+            return;
+        }
+
         // Create entry
         ConnWriteEntry entry;
         entry.count = count;
@@ -173,13 +395,45 @@ namespace net {
         writeQueueCnd.notify_all();
     }
 
+    void ConnClass::runOnReadWorker(std::function<void()> func) {
+        if (engine) {
+            engine->runOnWorker(std::move(func));
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lck(readQueueMtx);
+            readWorkerTasks.push_back(std::move(func));
+        }
+        readQueueCnd.notify_all();
+    }
+
+    void ConnClass::runOnWriteWorker(std::function<void()> func) {
+        if (engine) { return; }
+
+        {
+            std::lock_guard<std::mutex> lck(writeQueueMtx);
+            writeWorkerTasks.push_back(std::move(func));
+        }
+        writeQueueCnd.notify_all();
+    }
+
     void ConnClass::readWorker() {
         while (true) {
             // Wait for wakeup and exit if it's for terminating the thread
             std::unique_lock<std::mutex> lck(readQueueMtx);
-            readQueueCnd.wait(lck, [this]() { return (readQueue.size() > 0 || stopWorkers); });
+            readQueueCnd.wait(lck, [this]() { return (readQueue.size() > 0 || readWorkerTasks.size() > 0 || stopWorkers); });
             if (stopWorkers || !connectionOpen) { return; }
 
+            // Run any tasks outside the lock
+            if (readWorkerTasks.size() > 0) {
+                std::vector<std::function<void()>> tasks;
+                tasks.swap(readWorkerTasks);
+                lck.unlock();
+                for (auto& task : tasks) { task(); }
+                continue;
+            }
+
             // Pop first element off the list
             ConnReadEntry entry = readQueue[0];
             readQueue.erase(readQueue.begin());
@@ -203,9 +457,18 @@ namespace net {
         while (true) {
             // Wait for wakeup and exit if it's for terminating the thread
             std::unique_lock<std::mutex> lck(writeQueueMtx);
-            writeQueueCnd.wait(lck, [this]() { return (writeQueue.size() > 0 || stopWorkers); });
+            writeQueueCnd.wait(lck, [this]() { return (writeQueue.size() > 0 || writeWorkerTasks.size() > 0 || stopWorkers); });
             if (stopWorkers || !connectionOpen) { return; }
 
+            // Run any tasks outside the lock
+            if (writeWorkerTasks.size() > 0) {
+                std::vector<std::function<void()>> tasks;
+                tasks.swap(writeWorkerTasks);
+                lck.unlock();
+                for (auto& task : tasks) { task(); }
+                continue;
+            }
+
             // Pop first element off the list
             ConnWriteEntry entry = writeQueue[0];
             writeQueue.erase(writeQueue.begin());
@@ -224,6 +487,63 @@ namespace net {
     }
 
 
+    bool ConnClass::hasPendingRead() {
+        std::lock_guard<std::mutex> lck(readQueueMtx);
+        return connectionOpen && !stopWorkers && !readQueue.empty();
+    }
+
+    void ConnClass::serviceRead() {
+        // Keep going while the socket has data, within reason, so every
+        // message doesn't take another poll
+        for (int i = 0; i < 64; i++) {
+            ConnReadEntry entry;
+            {
+                std::lock_guard<std::mutex> lck(readQueueMtx);
+                if (stopWorkers || !connectionOpen || readQueue.empty()) { return; }
+                entry = readQueue[0];
+            }
+
+            int ret = recv(_sock, (char*)&entry.buf[engineReadProgress], entry.count - engineReadProgress, 0);
+            if (ret < 0 && wouldBlock()) { return; }
+            if (ret <= 0) {
+                {
+                    std::lock_guard<std::mutex> lck(connectionOpenMtx);
+                    connectionOpen = false;
+                }
+                connectionOpenCnd.notify_all();
+                return;
+            }
+
+            engineReadProgress += ret;
+            if (entry.enforceSize && engineReadProgress < entry.count) { continue; }
+
+            {
+                std::lock_guard<std::mutex> lck(readQueueMtx);
+                readQueue.erase(readQueue.begin());
+            }
+            int count = engineReadProgress;
+            engineReadProgress = 0;
+
+            SPYSERVER_TRACE2(conn_read, entry.count, count);
+            entry.handler(count, entry.buf, entry.ctx);
+        }
+    }
+
+    bool ConnClass::waitForSocket(short events) {
+        struct pollfd fd;
+        fd.fd = _sock;
+        fd.events = events;
+        fd.revents = 0;
+
+        // Wake now and then to notice the connection closing
+        while (connectionOpen && !stopWorkers) {
+            int ret = pollSockets(&fd, 1, 100);
+            if (ret < 0) { return false; }
+            if (ret > 0) { return !(fd.revents & POLLNVAL); }
+        }
+        return false;
+    }
+
     ListenerClass::ListenerClass(Socket listenSock) {
         sock = listenSock;
         listening = true;
@@ -251,6 +571,8 @@ namespace net {
             return NULL;
         }
 
+        setNoDelay(_sock);
+
         return Conn(new ConnClass(_sock));
     }
 
@@ -326,7 +648,7 @@ namespace net {
     }
 
 
-    Conn connect(std::string host, uint16_t port) {
+    Conn connect(std::string host, uint16_t port, PollEngine engine) {
         Socket sock;
 
 #ifdef _WIN32
@@ -371,7 +693,9 @@ namespace net {
             return NULL;
         }
 
-        return Conn(new ConnClass(sock));
+        setNoDelay(sock);
+
+        return Conn(new ConnClass(sock, {}, false, engine));
     }
 
     Listener listen(std::string host, uint16_t port) {
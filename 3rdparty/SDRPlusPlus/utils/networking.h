@@ -7,16 +7,20 @@
 #include <memory>
 #include <thread>
 #include <condition_variable>
+#include <functional>
 
 #ifdef _WIN32
 #include <WinSock2.h>
 #include <WS2tcpip.h>
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <strings.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <signal.h>
 #endif
@@ -41,9 +45,57 @@ namespace net {
         uint8_t* buf;
     };
 
+    class ConnClass;
+
+    // Services the async reads of any number of connections from one thread,
+    // polling their sockets, instead of a read worker per connection.
+    class PollEngineClass {
+    public:
+        PollEngineClass();
+        ~PollEngineClass();
+
+        // Runs a function once on the engine's thread.
+        void runOnWorker(std::function<void()> func);
+
+    private:
+        friend class ConnClass;
+
+        void add(ConnClass* conn);
+
+        // Once this returns, the engine is done with the connection. From the
+        // engine's own thread, i.e. a read handler, this never waits.
+        void remove(ConnClass* conn);
+
+        // Rebuilds the poll set, e.g. for a newly queued read.
+        void wake();
+        bool onWorker();
+
+        void worker();
+
+        bool stopWorker = false;
+
+        std::mutex mtx;
+        std::vector<ConnClass*> conns;
+        std::vector<std::function<void()>> tasks;
+
+        // Held while servicing connections, so remove() can wait it out.
+        std::mutex serviceMtx;
+
+        // A UDP socket connected to itself, so a write wakes a poll on any
+        // platform.
+        Socket wakeSock;
+
+        std::thread workerThread;
+    };
+
+    typedef std::shared_ptr<PollEngineClass> PollEngine;
+
     class ConnClass {
     public:
-        ConnClass(Socket sock, struct sockaddr_in raddr = {}, bool udp = false);
+        // With a poll engine, the socket is non-blocking, and the connection
+        // has no worker threads. The engine services async reads, while
+        // writes, async or not, happen on the caller's thread.
+        ConnClass(Socket sock, struct sockaddr_in raddr = {}, bool udp = false, PollEngine engine = nullptr);
         ~ConnClass();
 
         void close();
@@ -55,10 +107,28 @@ namespace net {
         void readAsync(int count, uint8_t* buf, void (*handler)(int count, uint8_t* buf, void* ctx), void* ctx, bool enforceSize = true);
         void writeAsync(int count, uint8_t* buf);
 
+        // Runs a function once on the worker thread, e.g. to set its scheduling. The
+        // read worker runs it before its next read, so after any read in progress.
+        // With a poll engine, reads run on the engine's thread, and there's no
+        // write worker to run anything on.
+        void runOnReadWorker(std::function<void()> func);
+        void runOnWriteWorker(std::function<void()> func);
+
+        inline PollEngine pollEngine() {
+            return engine;
+        }
+
     private:
+        friend class PollEngineClass;
+
         void readWorker();
         void writeWorker();
 
+        // For the poll engine
+        bool hasPendingRead();
+        void serviceRead();
+        bool waitForSocket(short events);
+
         bool stopWorkers = false;
         bool connectionOpen = false;
 
@@ -73,12 +143,20 @@ namespace net {
         std::condition_variable connectionOpenCnd;
         std::vector<ConnReadEntry> readQueue;
         std::vector<ConnWriteEntry> writeQueue;
+        std::vector<std::function<void()>> readWorkerTasks;
+        std::vector<std::function<void()>> writeWorkerTasks;
         std::thread readWorkerThread;
         std::thread writeWorkerThread;
 
         Socket _sock;
         bool _udp;
         struct sockaddr_in remoteAddr;
+
+        PollEngine engine;
+
+        // Bytes of the first queued read received so far. Only touched by
+        // the engine's thread.
+        int engineReadProgress = 0;
     };
 
     typedef std::unique_ptr<ConnClass> Conn;
@@ -116,7 +194,7 @@ namespace net {
 
     typedef std::unique_ptr<ListenerClass> Listener;
 
-    Conn connect(std::string host, uint16_t port);
+    Conn connect(std::string host, uint16_t port, PollEngine engine = nullptr);
     Listener listen(std::string host, uint16_t port);
     Conn openUDP(std::string host, uint16_t port, std::string remoteHost, uint16_t remotePort, bool bindSocket = true);
 
@@ -21,6 +21,7 @@
 #include <queue>
 #include <stack>
 #include <mutex>
+#include <chrono>
 #include <condition_variable>
 
 namespace codepi{
@@ -48,13 +49,13 @@ public:
     return rVal;
   }
 
-  // dequeue with timeout in seconds
+  // dequeue with timeout in seconds, returning false early if interrupted
   virtual bool dequeue(double timeout_sec, T& rVal){
     std::unique_lock<std::mutex> lock(m);
 
-    // wait for timeout or value available
-    auto maxTime = std::chrono::milliseconds(int(timeout_sec*1000));
-    if(c.wait_for(lock, maxTime, [&](){return !this->empty();} )){
+    // wait for timeout, interruption or value available
+    auto maxTime = std::chrono::microseconds(static_cast<long long>(timeout_sec*1e6));
+    if(c.wait_for(lock, maxTime, [&](){return interrupted || !this->empty();} ) && !interrupted){
       rVal = std::move(next(q));
       q.pop();
       return true;
@@ -63,6 +64,19 @@ public:
     }
   }
 
+  // wakes anyone waiting in dequeue with a timeout, and makes further
+  // calls return false immediately until resumed
+  void interrupt(){
+    std::lock_guard<std::mutex> lock(m);
+    interrupted = true;
+    c.notify_all();
+  }
+
+  void resume(){
+    std::lock_guard<std::mutex> lock(m);
+    interrupted = false;
+  }
+
   size_t size() const { return q.size(); }
   bool  empty() const { return q.empty(); }
   void  clear() {
@@ -74,6 +88,7 @@ private:
   Container q;
   mutable std::mutex m;
   std::condition_variable c;
+  bool interrupted = false;
 
   static T& next(std::stack<T>& s) { return s.top();   }
   static T& next(std::queue<T>& q) { return q.front(); }
@@ -0,0 +1,321 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "AsyncFileWriter.hpp"
+
+#include <SoapySDR/Logger.hpp>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <malloc.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+//
+// Non-class utility
+//
+
+static uint8_t *allocateAligned(const size_t size)
+{
+#ifdef _WIN32
+    void *ptr = _aligned_malloc(size, AsyncFileWriter::Alignment);
+#else
+    void *ptr = nullptr;
+    if(posix_memalign(&ptr, AsyncFileWriter::Alignment, size) != 0)
+        ptr = nullptr;
+#endif
+    if(not ptr)
+        throw std::bad_alloc();
+
+    return static_cast<uint8_t*>(ptr);
+}
+
+static void freeAligned(uint8_t *ptr)
+{
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    std::free(ptr);
+#endif
+}
+
+static size_t roundUp(const size_t size, const size_t multiple)
+{
+    return ((size + multiple - 1) / multiple) * multiple;
+}
+
+//
+// Construction
+//
+
+AsyncFileWriter::AsyncFileWriter(
+    const std::string &path,
+    const bool direct,
+    const size_t chunkSize,
+    const size_t numChunks):
+    _path(path),
+    _direct(direct),
+    _chunkSize(roundUp(chunkSize, Alignment))
+{
+    if((_chunkSize == 0) or (numChunks < 2))
+        throw std::invalid_argument("AsyncFileWriter needs at least two non-empty chunks");
+
+#ifdef _WIN32
+    if(_direct)
+        throw std::invalid_argument("Direct I/O is unsupported on this platform");
+
+    _fd = _open(_path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#if defined(O_DIRECT)
+    if(_direct)
+        flags |= O_DIRECT;
+#elif !defined(__APPLE__)
+    if(_direct)
+        throw std::invalid_argument("Direct I/O is unsupported on this platform");
+#endif
+
+    _fd = ::open(_path.c_str(), flags, 0644);
+#if defined(__APPLE__)
+    if((_fd >= 0) and _direct)
+        fcntl(_fd, F_NOCACHE, 1);
+#endif
+#endif
+    if(_fd < 0)
+        throw std::runtime_error("Failed to open "+_path+": "+std::string(strerror(errno)));
+
+    try
+    {
+        for(size_t i = 0; i < numChunks; ++i)
+            _allocations.emplace_back(allocateAligned(_chunkSize));
+    }
+    catch(...)
+    {
+        for(auto *allocation: _allocations)
+            freeAligned(allocation);
+#ifdef _WIN32
+        _close(_fd);
+#else
+        ::close(_fd);
+#endif
+        throw;
+    }
+
+    _current.data = _allocations.front();
+    _freeChunks.assign(_allocations.begin() + 1, _allocations.end());
+
+    _thread = std::thread(&AsyncFileWriter::worker, this);
+}
+
+AsyncFileWriter::~AsyncFileWriter(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(_current.data and (_current.size > 0))
+            _fullChunks.push_back(_current);
+
+        _current = Chunk{nullptr, 0};
+        _stop = true;
+    }
+    _cond.notify_all();
+    _thread.join();
+
+#ifdef _WIN32
+    _close(_fd);
+#else
+    ::close(_fd);
+#endif
+
+    for(auto *allocation: _allocations)
+        freeAligned(allocation);
+}
+
+//
+// Producer
+//
+
+bool AsyncFileWriter::write(std::initializer_list<Span> record)
+{
+    size_t recordSize = 0;
+    for(const auto &span: record)
+        recordSize += span.size;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        if(not _current.data and not _freeChunks.empty())
+        {
+            _current = Chunk{_freeChunks.back(), 0};
+            _freeChunks.pop_back();
+        }
+
+        // Only accept records that fit in full, so the file stays parseable.
+        const size_t room = _current.data ? (_chunkSize - _current.size) : 0;
+        const size_t chunksNeeded = (recordSize > room) ? ((recordSize - room + _chunkSize - 1) / _chunkSize) : 0;
+        if(_failed or (chunksNeeded > _freeChunks.size()))
+        {
+            _recordsDropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        for(const auto &span: record)
+        {
+            const auto *data = static_cast<const uint8_t*>(span.data);
+            size_t remaining = span.size;
+
+            while(remaining > 0)
+            {
+                if(not _current.data)
+                {
+                    assert(not _freeChunks.empty());
+                    _current = Chunk{_freeChunks.back(), 0};
+                    _freeChunks.pop_back();
+                }
+
+                const size_t count = std::min(remaining, _chunkSize - _current.size);
+                std::memcpy(_current.data + _current.size, data, count);
+                _current.size += count;
+                data += count;
+                remaining -= count;
+
+                if(_current.size == _chunkSize)
+                {
+                    _fullChunks.push_back(_current);
+                    _current = Chunk{nullptr, 0};
+                }
+            }
+        }
+
+        _backlog.fetch_add(recordSize, std::memory_order_relaxed);
+    }
+
+    // writeAll() callers wait on the same condition.
+    _cond.notify_all();
+
+    return true;
+}
+
+bool AsyncFileWriter::writeAll(const void *data, const size_t size)
+{
+    const auto *bytes = static_cast<const uint8_t*>(data);
+    size_t remaining = size;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    while(remaining > 0)
+    {
+        if(not _current.data)
+        {
+            _cond.wait(lock, [this]{ return _failed or not _freeChunks.empty(); });
+            if(_failed)
+                return false;
+
+            _current = Chunk{_freeChunks.back(), 0};
+            _freeChunks.pop_back();
+        }
+
+        const size_t count = std::min(remaining, _chunkSize - _current.size);
+        std::memcpy(_current.data + _current.size, bytes, count);
+        _current.size += count;
+        bytes += count;
+        remaining -= count;
+        _backlog.fetch_add(count, std::memory_order_relaxed);
+
+        if(_current.size == _chunkSize)
+        {
+            _fullChunks.push_back(_current);
+            _current = Chunk{nullptr, 0};
+            _cond.notify_all();
+        }
+    }
+
+    return not _failed;
+}
+
+//
+// Writer thread
+//
+
+void AsyncFileWriter::worker(void)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while(true)
+    {
+        _cond.wait(lock, [this]{ return _stop or not _fullChunks.empty(); });
+        if(_fullChunks.empty())
+            break;
+
+        const auto chunk = _fullChunks.front();
+        _fullChunks.pop_front();
+
+        lock.unlock();
+        this->writeChunk(chunk);
+        lock.lock();
+
+        _freeChunks.push_back(chunk.data);
+        _cond.notify_all();
+    }
+}
+
+void AsyncFileWriter::writeChunk(const Chunk &chunk)
+{
+    _backlog.fetch_sub(chunk.size, std::memory_order_relaxed);
+    if(_failed)
+        return;
+
+    // Direct I/O only takes whole blocks, so pad the last partial chunk
+    // and trim the file afterwards.
+    const bool partial = (chunk.size < _chunkSize);
+    const size_t writeSize = (_direct and partial) ? roundUp(chunk.size, Alignment) : chunk.size;
+    if(writeSize > chunk.size)
+        std::memset(chunk.data + chunk.size, 0, writeSize - chunk.size);
+
+    size_t written = 0;
+    while(written < writeSize)
+    {
+#ifdef _WIN32
+        const auto ret = _write(_fd, chunk.data + written, static_cast<unsigned int>(writeSize - written));
+#else
+        const auto ret = ::write(_fd, chunk.data + written, writeSize - written);
+#endif
+        if((ret < 0) and (errno == EINTR))
+            continue;
+        if(ret <= 0)
+        {
+            SoapySDR::logf(
+                SOAPY_SDR_ERROR,
+                "Failed to write %s: %s. Recording stopped.",
+                _path.c_str(),
+                strerror(errno));
+            _failed = true;
+            return;
+        }
+
+        written += static_cast<size_t>(ret);
+    }
+
+    _fileSize += chunk.size;
+    _bytesWritten.fetch_add(chunk.size, std::memory_order_relaxed);
+
+    if(writeSize > chunk.size)
+    {
+#ifdef _WIN32
+        _chsize_s(_fd, static_cast<long long>(_fileSize));
+#else
+        if(ftruncate(_fd, static_cast<off_t>(_fileSize)) != 0)
+            SoapySDR::logf(SOAPY_SDR_WARNING, "Failed to trim padding from %s", _path.c_str());
+#endif
+    }
+}
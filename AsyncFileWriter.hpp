@@ -0,0 +1,117 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <initializer_list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//
+// Writes a file from a dedicated thread, so callers never wait on the
+// disk. Records are gathered into large aligned chunks, each written with
+// a single call. With a bounded number of chunks, a writer that falls
+// behind drops whole records rather than blocking the caller.
+//
+// Direct I/O (O_DIRECT, or F_NOCACHE on macOS) bypasses the page cache,
+// so long recordings don't evict everything else.
+//
+class AsyncFileWriter
+{
+public:
+    struct Span
+    {
+        const void *data;
+        size_t size;
+    };
+
+    static constexpr size_t Alignment = 4096;
+    static constexpr size_t DefaultChunkSize = 4 << 20;
+    static constexpr size_t DefaultNumChunks = 16;
+
+    AsyncFileWriter(
+        const std::string &path,
+        const bool direct = false,
+        const size_t chunkSize = DefaultChunkSize,
+        const size_t numChunks = DefaultNumChunks);
+
+    // Writes anything buffered before returning.
+    ~AsyncFileWriter(void);
+
+    // Copies the spans, back to back, as one record. Returns false if it
+    // was dropped for lack of buffer space or an earlier write error.
+    bool write(std::initializer_list<Span> record);
+
+    // Waits for buffer space instead of dropping anything, so writes of any
+    // size go through. Only for threads that can afford to wait. Returns
+    // false after a write error.
+    bool writeAll(const void *data, const size_t size);
+
+    inline const std::string &path(void) const noexcept
+    {
+        return _path;
+    }
+
+    // Bytes accepted but not yet written.
+    inline size_t backlog(void) const noexcept
+    {
+        return _backlog.load(std::memory_order_relaxed);
+    }
+
+    inline uint64_t bytesWritten(void) const noexcept
+    {
+        return _bytesWritten.load(std::memory_order_relaxed);
+    }
+
+    inline uint64_t recordsDropped(void) const noexcept
+    {
+        return _recordsDropped.load(std::memory_order_relaxed);
+    }
+
+    inline bool failed(void) const noexcept
+    {
+        return _failed.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Chunk
+    {
+        uint8_t *data;
+        size_t size;
+    };
+
+    void worker(void);
+    void writeChunk(const Chunk &chunk);
+
+    std::string _path;
+    bool _direct{false};
+    int _fd{-1};
+    size_t _chunkSize{0};
+
+    std::vector<uint8_t*> _allocations;
+
+    // Everything below, except the statistics, is guarded by the mutex.
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    Chunk _current{nullptr, 0};
+    std::vector<uint8_t*> _freeChunks;
+    std::deque<Chunk> _fullChunks;
+    bool _stop{false};
+
+    // Only touched by the writer thread.
+    uint64_t _fileSize{0};
+
+    std::atomic<size_t> _backlog{0};
+    std::atomic<uint64_t> _bytesWritten{0};
+    std::atomic<uint64_t> _recordsDropped{0};
+    std::atomic_bool _failed{false};
+
+    std::thread _thread;
+};
@@ -3,6 +3,8 @@
 
 #pragma once
 
+#include "Tracing.hpp"
+
 #include <ThreadSafeQueue.h>
 
 #include <atomic>
@@ -29,9 +31,15 @@ public:
         {
             (void)Base::dequeue();
             _overflow = true;
+            _numDropped.fetch_add(1, std::memory_order_relaxed);
+            SPYSERVER_TRACE2(queue_overflow, _maxSize, _numDropped.load(std::memory_order_relaxed));
         }
 
         Base::enqueue(std::forward<T>(t));
+
+        const auto depth = Base::size();
+        if(depth > _highWater.load(std::memory_order_relaxed))
+            _highWater.store(depth, std::memory_order_relaxed);
     }
 
     inline bool dequeue(double timeout_sec, T &rVal) override
@@ -51,7 +59,28 @@ public:
         _overflow = false;
     }
 
+    inline size_t maxSize(void) const noexcept
+    {
+        return _maxSize;
+    }
+
+    // Entries discarded to make room, over the queue's lifetime.
+    inline size_t numDropped(void) const noexcept
+    {
+        return _numDropped.load(std::memory_order_relaxed);
+    }
+
+    // Deepest the queue has been.
+    inline size_t highWater(void) const noexcept
+    {
+        return _highWater.load(std::memory_order_relaxed);
+    }
+
 private:
     size_t _maxSize{0};
     std::atomic_bool _overflow{false};
+
+    // Only one thread enqueues.
+    std::atomic<size_t> _numDropped{0};
+    std::atomic<size_t> _highWater{0};
 };
@@ -0,0 +1,169 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "Channelizer.hpp"
+#include "FilterDesign.hpp"
+
+#include <dsp/utils/math.h>
+
+#include <volk/volk.h>
+
+#include <cassert>
+#include <cmath>
+#include <stdexcept>
+#include <utility>
+
+//
+// Construction
+//
+
+PolyphaseChannelizer::PolyphaseChannelizer(const size_t numChannels):
+    _numChannels(numChannels)
+{
+    if((_numChannels < 2) or (_numChannels > MaxChannels) or (_numChannels & (_numChannels - 1)))
+        throw std::invalid_argument("Channel count must be a power of two between 2 and "+std::to_string(MaxChannels));
+
+    // Prototype with its transition band just inside the channel edge and
+    // unity passband gain.
+    const double cutoff = 0.5 - (BlackmanTransitionWidth / (2.0 * TapsPerBranch));
+    const auto prototype = designLowpassTaps(
+        _numChannels * TapsPerBranch,
+        cutoff / static_cast<double>(_numChannels));
+
+    _branchTaps.resize(_numChannels);
+    for(size_t branch = 0; branch < _numChannels; ++branch)
+    {
+        auto &taps = _branchTaps[branch];
+        taps.resize(TapsPerBranch);
+
+        for(size_t j = 0; j < TapsPerBranch; ++j)
+            taps[j] = prototype[((TapsPerBranch - 1 - j) * _numChannels) + branch];
+    }
+
+    _fftBuffer.resize(_numChannels);
+
+    _twiddles.resize(_numChannels / 2);
+    for(size_t i = 0; i < _twiddles.size(); ++i)
+    {
+        const double phase = (2.0 * FL_M_PI * i) / _numChannels;
+        _twiddles[i] = dsp::complex_t{
+            static_cast<float>(std::cos(phase)),
+            static_cast<float>(std::sin(phase))};
+    }
+
+    size_t numBits = 0;
+    while((size_t(1) << numBits) < _numChannels) ++numBits;
+
+    _bitReversed.resize(_numChannels);
+    for(size_t i = 0; i < _numChannels; ++i)
+    {
+        size_t reversed = 0;
+        for(size_t bit = 0; bit < numBits; ++bit)
+            if(i & (size_t(1) << bit)) reversed |= (size_t(1) << (numBits - 1 - bit));
+
+        _bitReversed[i] = reversed;
+    }
+
+    this->reset();
+}
+
+//
+// DSP
+//
+
+void PolyphaseChannelizer::process(
+    const dsp::complex_t *input,
+    const size_t numInput,
+    std::vector<volk::vector<dsp::complex_t>> &outputs)
+{
+    assert(input or (numInput == 0));
+
+    const size_t numPending = _pending.size();
+    const size_t numBlocks = (numPending + numInput) / _numChannels;
+
+    const auto sampleAt = [&](const size_t index)
+    {
+        return (index < numPending) ? _pending[index] : input[index - numPending];
+    };
+
+    outputs.resize(_numChannels);
+    for(auto &output: outputs) output.resize(numBlocks);
+
+    for(size_t block = 0; block < numBlocks; ++block)
+    {
+        // The newest sample of the block feeds branch 0.
+        const size_t blockEnd = ((block + 1) * _numChannels) - 1;
+
+        for(size_t branch = 0; branch < _numChannels; ++branch)
+        {
+            auto &history = _branchHistory[branch];
+            const auto sample = sampleAt(blockEnd - branch);
+
+            history[_historyIndex] = sample;
+            history[_historyIndex + TapsPerBranch] = sample;
+
+            volk_32fc_32f_dot_prod_32fc(
+                reinterpret_cast<lv_32fc_t*>(&_fftBuffer[branch]),
+                reinterpret_cast<const lv_32fc_t*>(&history[_historyIndex + 1]),
+                _branchTaps[branch].data(),
+                static_cast<unsigned int>(TapsPerBranch));
+        }
+        _historyIndex = (_historyIndex + 1) % TapsPerBranch;
+
+        this->inverseFFT();
+
+        // FFT bins are ordered DC first, so rotate by half to ascend in frequency.
+        for(size_t channel = 0; channel < _numChannels; ++channel)
+            outputs[channel][block] = _fftBuffer[(channel + (_numChannels / 2)) % _numChannels];
+    }
+
+    volk::vector<dsp::complex_t> remaining;
+    for(size_t index = numBlocks * _numChannels; index < (numPending + numInput); ++index)
+        remaining.push_back(sampleAt(index));
+
+    _pending = std::move(remaining);
+}
+
+void PolyphaseChannelizer::reset(void)
+{
+    _branchHistory.assign(
+        _numChannels,
+        volk::vector<dsp::complex_t>(2 * TapsPerBranch, dsp::complex_t{0.0f, 0.0f}));
+    _historyIndex = 0;
+    _pending.clear();
+}
+
+// In-place radix-2 decimation-in-time, unscaled.
+void PolyphaseChannelizer::inverseFFT(void)
+{
+    auto &data = _fftBuffer;
+
+    for(size_t i = 0; i < _numChannels; ++i)
+    {
+        if(i < _bitReversed[i])
+            std::swap(data[i], data[_bitReversed[i]]);
+    }
+
+    for(size_t size = 2; size <= _numChannels; size *= 2)
+    {
+        const size_t half = size / 2;
+        const size_t twiddleStep = _numChannels / size;
+
+        for(size_t start = 0; start < _numChannels; start += size)
+        {
+            for(size_t i = 0; i < half; ++i)
+            {
+                const auto &twiddle = _twiddles[i * twiddleStep];
+                auto &even = data[start + i];
+                auto &odd = data[start + i + half];
+
+                const dsp::complex_t product{
+                    (odd.re * twiddle.re) - (odd.im * twiddle.im),
+                    (odd.re * twiddle.im) + (odd.im * twiddle.re)};
+
+                odd = dsp::complex_t{even.re - product.re, even.im - product.im};
+                even = dsp::complex_t{even.re + product.re, even.im + product.im};
+            }
+        }
+    }
+}
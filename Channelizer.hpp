@@ -0,0 +1,76 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <dsp/types.h>
+
+#include <volk/volk_alloc.hh>
+
+#include <cstddef>
+#include <vector>
+
+//
+// Critically sampled polyphase filter bank splitting one wideband stream
+// into N equally spaced channels, each decimated by N. Each block of N
+// inputs costs N short VOLK dot products and one N-point FFT, rather than
+// N independent mix-and-filter chains.
+//
+// Outputs are in ascending frequency order, so channel i is centered at
+// (i - N/2) times the channel spacing. Being critically sampled, anything
+// past a channel's edge would alias into it, so the prototype's stopband
+// starts at the edge, and the passband is flat over about two thirds of
+// the spacing.
+//
+// N must be a power of two, for the radix-2 FFT. VOLK has no FFT, and
+// FFTW would be a new dependency for transforms of at most MaxChannels
+// points, which cost log2(N)/2 complex multiplies per output against
+// TapsPerBranch for the branch filters.
+//
+class PolyphaseChannelizer
+{
+public:
+    static constexpr size_t MaxChannels = 1024;
+    static constexpr size_t TapsPerBranch = 32;
+
+    PolyphaseChannelizer(const size_t numChannels);
+    ~PolyphaseChannelizer(void) = default;
+
+    inline size_t numChannels(void) const noexcept
+    {
+        return _numChannels;
+    }
+
+    // Offset from the input's center, in units of the channel spacing.
+    inline double channelOffset(const size_t channel) const noexcept
+    {
+        return static_cast<double>(channel) - static_cast<double>(_numChannels / 2);
+    }
+
+    void process(
+        const dsp::complex_t *input,
+        const size_t numInput,
+        std::vector<volk::vector<dsp::complex_t>> &outputs);
+
+    void reset(void);
+
+private:
+    void inverseFFT(void);
+
+    size_t _numChannels{0};
+
+    // One time-reversed set of taps per branch.
+    std::vector<volk::vector<float>> _branchTaps;
+
+    // Each branch's delay line is stored twice back to back, so the
+    // latest TapsPerBranch samples are always contiguous.
+    std::vector<volk::vector<dsp::complex_t>> _branchHistory;
+    size_t _historyIndex{0};
+
+    // Input left over from the last call, less than one block.
+    volk::vector<dsp::complex_t> _pending;
+
+    volk::vector<dsp::complex_t> _fftBuffer;
+    std::vector<dsp::complex_t> _twiddles;
+    std::vector<size_t> _bitReversed;
+};
@@ -0,0 +1,209 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "ConnectionCache.hpp"
+
+#include <algorithm>
+#include <vector>
+
+//
+// Non-class utility
+//
+
+// Long enough to cover an enumerate-then-open, short enough that a
+// parked connection doesn't hold a server slot for long.
+static constexpr std::chrono::seconds CacheTTL{5};
+
+//
+// Construction
+//
+
+ConnectionCache &ConnectionCache::instance(void)
+{
+    static ConnectionCache cache;
+    return cache;
+}
+
+ConnectionCache::~ConnectionCache(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cond.notify_all();
+
+    if(_reaperThread.joinable())
+        _reaperThread.join();
+}
+
+//
+// Device info
+//
+
+bool ConnectionCache::getDeviceInfo(const std::string &url, SpyServerDeviceInfo &devInfo)
+{
+    spyserver::SpyServerClient closed;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        const auto iter = _deviceInfo.find(url);
+        if(iter == _deviceInfo.end())
+            return false;
+
+        if(iter->second.expiry <= Clock::now())
+        {
+            _deviceInfo.erase(iter);
+            return false;
+        }
+
+        // The server hanging up on a parked connection may mean it's gone,
+        // so have the caller connect again to find out.
+        const auto parkedIter = _parked.find(url);
+        if((parkedIter == _parked.end()) or parkedIter->second.client->isOpen())
+        {
+            devInfo = iter->second.devInfo;
+            return true;
+        }
+
+        closed = std::move(parkedIter->second.client);
+        _parked.erase(parkedIter);
+        _deviceInfo.erase(iter);
+    }
+
+    // Closing a connection joins its threads, so do it outside the lock.
+    return false;
+}
+
+void ConnectionCache::storeDeviceInfo(const std::string &url, const SpyServerDeviceInfo &devInfo)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _deviceInfo[url] = DeviceInfoEntry{devInfo, Clock::now() + CacheTTL};
+}
+
+//
+// Parked connections
+//
+
+void ConnectionCache::park(const std::string &url, spyserver::SpyServerClient &&client)
+{
+    // Closing a connection joins its threads, so do it outside the lock.
+    spyserver::SpyServerClient replaced;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        auto &entry = _parked[url];
+        replaced = std::move(entry.client);
+        entry.client = std::move(client);
+        entry.expiry = Clock::now() + CacheTTL;
+
+        if(not _reaperRunning)
+        {
+            // One that has run out of work has already left the loop.
+            if(_reaperThread.joinable())
+                _reaperThread.join();
+
+            _reaperThread = std::thread(&ConnectionCache::reaper, this);
+            _reaperRunning = true;
+        }
+    }
+    _cond.notify_all();
+}
+
+spyserver::SpyServerClient ConnectionCache::take(const std::string &url)
+{
+    spyserver::SpyServerClient client;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        const auto iter = _parked.find(url);
+        if(iter == _parked.end())
+            return nullptr;
+
+        const bool expired = (iter->second.expiry <= Clock::now());
+        client = std::move(iter->second.client);
+        _parked.erase(iter);
+
+        if(expired)
+            return nullptr;
+    }
+
+    // The server may have hung up since.
+    if(not client->isOpen())
+        return nullptr;
+
+    return client;
+}
+
+void ConnectionCache::addDevice(void)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    ++_numDevices;
+}
+
+void ConnectionCache::removeDevice(void)
+{
+    std::vector<spyserver::SpyServerClient> parked;
+    std::thread reaperThread;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        if(--_numDevices > 0)
+            return;
+
+        for(auto &entry: _parked)
+            parked.emplace_back(std::move(entry.second.client));
+        _parked.clear();
+
+        // With nothing parked, it's on its way out. A park() from here on
+        // starts another.
+        reaperThread = std::move(_reaperThread);
+        _reaperRunning = false;
+    }
+    _cond.notify_all();
+
+    if(reaperThread.joinable())
+        reaperThread.join();
+}
+
+void ConnectionCache::reaper(void)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while(not _stop and not _parked.empty())
+    {
+        const auto now = Clock::now();
+        auto nextExpiry = Clock::time_point::max();
+
+        std::vector<spyserver::SpyServerClient> expired;
+        for(auto iter = _parked.begin(); iter != _parked.end();)
+        {
+            if(iter->second.expiry <= now)
+            {
+                expired.emplace_back(std::move(iter->second.client));
+                iter = _parked.erase(iter);
+            }
+            else
+            {
+                nextExpiry = std::min(nextExpiry, iter->second.expiry);
+                ++iter;
+            }
+        }
+
+        if(not expired.empty())
+        {
+            lock.unlock();
+            expired.clear();
+            lock.lock();
+            continue;
+        }
+
+        if(nextExpiry == Clock::time_point::max())
+            _cond.wait(lock);
+        else
+            _cond.wait_until(lock, nextExpiry);
+    }
+
+    // Anything left is closed as the cache is destroyed.
+    if(_reaperThread.get_id() == std::this_thread::get_id())
+        _reaperRunning = false;
+}
@@ -0,0 +1,81 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include "spyserver_client.h"
+
+#include <spyserver_protocol.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+//
+// Process-wide cache of what find() learns about each server, keyed by
+// URL, so opening a device right after enumerating it doesn't repeat the
+// whole connection setup.
+//
+// find() leaves its connection parked here, and the next make() for the
+// same server takes it over. Parked connections still hold one of the
+// server's client slots, so they're closed once they expire.
+//
+// Nothing is left to static destruction in the usual case: the reaper
+// thread only runs while something is parked, and closing the last open
+// device closes whatever is parked and joins it.
+//
+class ConnectionCache
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static ConnectionCache &instance(void);
+
+    ~ConnectionCache(void);
+
+    // Returns false if nothing has been stored in the TTL, or if the server
+    // has since closed the connection parked with it.
+    bool getDeviceInfo(const std::string &url, SpyServerDeviceInfo &devInfo);
+    void storeDeviceInfo(const std::string &url, const SpyServerDeviceInfo &devInfo);
+
+    // Replaces any connection already parked for the URL.
+    void park(const std::string &url, spyserver::SpyServerClient &&client);
+
+    // Returns null if nothing usable is parked.
+    spyserver::SpyServerClient take(const std::string &url);
+
+    // Called as each device is opened and closed.
+    void addDevice(void);
+    void removeDevice(void);
+
+private:
+    ConnectionCache(void) = default;
+
+    struct DeviceInfoEntry
+    {
+        SpyServerDeviceInfo devInfo;
+        Clock::time_point expiry;
+    };
+
+    struct ParkedEntry
+    {
+        spyserver::SpyServerClient client;
+        Clock::time_point expiry;
+    };
+
+    void reaper(void);
+
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::unordered_map<std::string, DeviceInfoEntry> _deviceInfo;
+    std::unordered_map<std::string, ParkedEntry> _parked;
+    bool _stop{false};
+    size_t _numDevices{0};
+
+    // Started by park(), and exits once nothing is parked.
+    std::thread _reaperThread;
+    bool _reaperRunning{false};
+};
@@ -0,0 +1,40 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "FilterDesign.hpp"
+
+#include <dsp/utils/math.h>
+
+#include <cassert>
+#include <cmath>
+
+std::vector<float> designLowpassTaps(
+    const size_t numTaps,
+    const double cutoff,
+    const double gain)
+{
+    assert(numTaps > 1);
+    assert((cutoff > 0.0) and (cutoff < 0.5));
+
+    const double center = (static_cast<double>(numTaps) - 1.0) / 2.0;
+
+    std::vector<float> taps(numTaps);
+    double sum = 0.0;
+    for(size_t i = 0; i < numTaps; ++i)
+    {
+        const double x = static_cast<double>(i) - center;
+        const double sinc = (x == 0.0) ? (2.0 * cutoff)
+                                       : (std::sin(2.0 * FL_M_PI * cutoff * x) / (FL_M_PI * x));
+        const double window = 0.42
+                            - (0.5 * std::cos((2.0 * FL_M_PI * i) / (numTaps - 1)))
+                            + (0.08 * std::cos((4.0 * FL_M_PI * i) / (numTaps - 1)));
+
+        taps[i] = static_cast<float>(sinc * window);
+        sum += taps[i];
+    }
+
+    const auto scale = static_cast<float>(gain / sum);
+    for(auto &tap: taps) tap *= scale;
+
+    return taps;
+}
@@ -0,0 +1,18 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Transition band of the filters below, in units of the sample rate over
+// the number of taps.
+constexpr double BlackmanTransitionWidth = 5.5;
+
+// Blackman-windowed sinc lowpass. The cutoff is normalized to the sample
+// rate, and the taps are scaled to sum to the given gain.
+std::vector<float> designLowpassTaps(
+    const size_t numTaps,
+    const double cutoff,
+    const double gain = 1.0);
@@ -0,0 +1,165 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "IQCorrection.hpp"
+
+#include <volk/volk.h>
+
+#include <algorithm>
+
+// Automatic estimates converge over roughly this many samples, regardless
+// of how the server sizes its messages.
+static constexpr double AdaptationSamples = double(1 << 20);
+
+bool IQCorrection::enabled(void) const
+{
+    return _enabled.load(std::memory_order_acquire);
+}
+
+bool IQCorrection::adaptive(void) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    return _dcOffsetAutomatic or _iqBalanceAutomatic;
+}
+
+void IQCorrection::setDCOffsetMode(const bool automatic)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _dcOffsetAutomatic = automatic;
+    if(not automatic)
+        _dcOffset = std::complex<double>();
+
+    this->updateEnabled();
+}
+
+bool IQCorrection::getDCOffsetMode(void) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    return _dcOffsetAutomatic;
+}
+
+void IQCorrection::setDCOffset(const std::complex<double> &offset)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _dcOffset = offset;
+
+    this->updateEnabled();
+}
+
+std::complex<double> IQCorrection::getDCOffset(void) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    return _dcOffset;
+}
+
+void IQCorrection::setIQBalanceMode(const bool automatic)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _iqBalanceAutomatic = automatic;
+    if(not automatic)
+        _iqBalance = std::complex<double>();
+
+    this->updateEnabled();
+}
+
+bool IQCorrection::getIQBalanceMode(void) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    return _iqBalanceAutomatic;
+}
+
+void IQCorrection::setIQBalance(const std::complex<double> &balance)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _iqBalance = balance;
+
+    this->updateEnabled();
+}
+
+std::complex<double> IQCorrection::getIQBalance(void) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    return _iqBalance;
+}
+
+IQCorrection::Snapshot IQCorrection::snapshot(const float scale, const float offset) const
+{
+    Snapshot snapshot;
+    if(not this->enabled())
+        return snapshot;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    snapshot.enabled = true;
+    snapshot.adaptive = _dcOffsetAutomatic or _iqBalanceAutomatic;
+
+    // u + w*conj(u) as a real 2x2 matrix.
+    const double a00 = 1.0 + _iqBalance.real();
+    const double a01 = _iqBalance.imag();
+    const double a10 = _iqBalance.imag();
+    const double a11 = 1.0 - _iqBalance.real();
+
+    const double u0 = offset - _dcOffset.real();
+    const double u1 = offset - _dcOffset.imag();
+
+    snapshot.coefficients = AffineCoefficients{
+        static_cast<float>(a00 * scale),
+        static_cast<float>(a01 * scale),
+        static_cast<float>(a10 * scale),
+        static_cast<float>(a11 * scale),
+        static_cast<float>((a00 * u0) + (a01 * u1)),
+        static_cast<float>((a10 * u0) + (a11 * u1))};
+
+    return snapshot;
+}
+
+void IQCorrection::update(const dsp::complex_t *samples, const size_t numSamples)
+{
+    if(numSamples == 0)
+        return;
+
+    const auto *complexSamples = reinterpret_cast<const lv_32fc_t*>(samples);
+    const auto count = static_cast<unsigned int>(numSamples);
+
+    // E[y^2] is zero for a balanced signal, E[|y|^2] is its power.
+    lv_32fc_t squaredSum, powerSum;
+    volk_32fc_x2_dot_prod_32fc(&squaredSum, complexSamples, complexSamples, count);
+    volk_32fc_x2_conjugate_dot_prod_32fc(&powerSum, complexSamples, complexSamples, count);
+
+    double realSum = 0.0, imagSum = 0.0;
+    for(size_t i = 0; i < numSamples; ++i)
+    {
+        realSum += samples[i].re;
+        imagSum += samples[i].im;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const double alpha = std::min(1.0, numSamples / AdaptationSamples);
+
+    if(_dcOffsetAutomatic)
+        _dcOffset += alpha * std::complex<double>(realSum / numSamples, imagSum / numSamples);
+
+    if(_iqBalanceAutomatic and (powerSum.real() > 0.0f))
+    {
+        const std::complex<double> squared(squaredSum.real(), squaredSum.imag());
+        _iqBalance -= alpha * (squared / (2.0 * powerSum.real()));
+    }
+}
+
+void IQCorrection::updateEnabled(void)
+{
+    _enabled.store(
+        _dcOffsetAutomatic or _iqBalanceAutomatic
+            or (_dcOffset != std::complex<double>()) or (_iqBalance != std::complex<double>()),
+        std::memory_order_release);
+}
@@ -0,0 +1,88 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <dsp/types.h>
+
+#include <atomic>
+#include <complex>
+#include <cstddef>
+#include <mutex>
+
+// y = (a00*i + a01*q + b0) + j(a10*i + a11*q + b1), applied to raw wire samples.
+struct AffineCoefficients
+{
+    float a00, a01, a10, a11;
+    float b0, b1;
+};
+
+//
+// DC offset removal and IQ imbalance correction, expressed as a single
+// affine transform so decoders can apply it in the same loop that
+// converts wire samples to floats:
+//
+//   u = x - dcOffset
+//   y = u + iqBalance*conj(u)
+//
+// Automatic modes adapt the offset and balance from the corrected output.
+// All functions are thread-safe.
+//
+class IQCorrection
+{
+public:
+    IQCorrection(void) = default;
+    ~IQCorrection(void) = default;
+
+    bool enabled(void) const;
+
+    bool adaptive(void) const;
+
+    void setDCOffsetMode(const bool automatic);
+
+    bool getDCOffsetMode(void) const;
+
+    void setDCOffset(const std::complex<double> &offset);
+
+    std::complex<double> getDCOffset(void) const;
+
+    void setIQBalanceMode(const bool automatic);
+
+    bool getIQBalanceMode(void) const;
+
+    void setIQBalance(const std::complex<double> &balance);
+
+    std::complex<double> getIQBalance(void) const;
+
+    // Everything one message needs, taken together so a setter can't land
+    // halfway through it. The coefficients fold the correction into a
+    // decoder's x = scale*raw + offset.
+    struct Snapshot
+    {
+        bool enabled{false};
+        bool adaptive{false};
+        AffineCoefficients coefficients;
+    };
+
+    // Takes the lock once, and not at all while the correction is off.
+    Snapshot snapshot(const float scale, const float offset) const;
+
+    // Adapts automatic estimates from already corrected samples. Only
+    // worth calling when the snapshot they were corrected with was adaptive.
+    void update(const dsp::complex_t *samples, const size_t numSamples);
+
+private:
+    // Call with _mutex held.
+    void updateEnabled(void);
+
+    mutable std::mutex _mutex;
+
+    // Mirrors enabled() for the decode path, which checks it per message.
+    std::atomic<bool> _enabled{false};
+
+    bool _dcOffsetAutomatic{false};
+    bool _iqBalanceAutomatic{false};
+
+    std::complex<double> _dcOffset{0.0, 0.0};
+    std::complex<double> _iqBalance{0.0, 0.0};
+};
@@ -0,0 +1,264 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "IQDecoder.hpp"
+
+#include <volk/volk.h>
+#include <volk/volk_alloc.hh>
+
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+
+//
+// Non-class utility
+//
+
+// One pass, so each sample is read and written once. It stays scalar
+// code: compilers vectorize it at -O3, while VOLK would take a pass each
+// to convert, multiply by the two complex coefficients, conjugate and add.
+template <typename T>
+static void decodeAffineImpl(
+    const uint8_t *input,
+    const size_t numSamples,
+    const AffineCoefficients &coeffs,
+    dsp::complex_t *output)
+{
+    assert(input or (numSamples == 0));
+    assert(output or (numSamples == 0));
+
+    const auto *samples = reinterpret_cast<const T*>(input);
+
+    for(size_t i = 0; i < numSamples; ++i)
+    {
+        const auto re = static_cast<float>(samples[2*i]);
+        const auto im = static_cast<float>(samples[(2*i)+1]);
+
+        output[i].re = (coeffs.a00 * re) + (coeffs.a01 * im) + coeffs.b0;
+        output[i].im = (coeffs.a10 * re) + (coeffs.a11 * im) + coeffs.b1;
+    }
+}
+
+static std::vector<std::string> implementationNames(const volk_func_desc_t &desc)
+{
+    return std::vector<std::string>(desc.impl_names, desc.impl_names + desc.n_impls);
+}
+
+//
+// Decoders
+//
+
+class UInt8IQDecoder: public IQDecoder
+{
+public:
+    SpyServerStreamFormat format(void) const
+    {
+        return SPYSERVER_STREAM_FORMAT_UINT8;
+    }
+
+    size_t sampleSize(void) const
+    {
+        return 2 * sizeof(uint8_t);
+    }
+
+    float scale(const float gain) const
+    {
+        return 1.0f / (gain * 128.0f);
+    }
+
+    float offset(const float gain) const
+    {
+        return -128.0f * this->scale(gain);
+    }
+
+    // VOLK has no unsigned 8-bit conversion, but flipping the top bit
+    // turns u into the signed u-128, which is the offset. The flip is a
+    // trivial loop compilers vectorize, and the conversion is VOLK's.
+    void decode(
+        const uint8_t *input,
+        const size_t numSamples,
+        const float gain,
+        dsp::complex_t *output) const
+    {
+        assert(input or (numSamples == 0));
+
+        const size_t numValues = numSamples * 2;
+        _signed.resize(numValues);
+
+        // Through a local pointer, since int8_t stores could alias the
+        // vector's own and keep the loop from vectorizing.
+        auto *signedValues = _signed.data();
+        for(size_t i = 0; i < numValues; ++i)
+            signedValues[i] = static_cast<int8_t>(input[i] ^ 0x80);
+
+        auto *outputFloats = reinterpret_cast<float*>(output);
+        if(_implementation.empty())
+            volk_8i_s32f_convert_32f(outputFloats, signedValues, 128.0f * gain, static_cast<unsigned int>(numValues));
+        else
+            volk_8i_s32f_convert_32f_manual(outputFloats, signedValues, 128.0f * gain, static_cast<unsigned int>(numValues), _implementation.c_str());
+    }
+
+    void decodeAffine(
+        const uint8_t *input,
+        const size_t numSamples,
+        const AffineCoefficients &coeffs,
+        dsp::complex_t *output) const
+    {
+        decodeAffineImpl<uint8_t>(input, numSamples, coeffs, output);
+    }
+
+    std::vector<std::string> implementations(void) const
+    {
+        return implementationNames(volk_8i_s32f_convert_32f_get_func_desc());
+    }
+
+private:
+    // Decoders are only used from one thread at a time.
+    mutable volk::vector<int8_t> _signed;
+};
+
+class Int16IQDecoder: public IQDecoder
+{
+public:
+    SpyServerStreamFormat format(void) const
+    {
+        return SPYSERVER_STREAM_FORMAT_INT16;
+    }
+
+    size_t sampleSize(void) const
+    {
+        return 2 * sizeof(int16_t);
+    }
+
+    float scale(const float gain) const
+    {
+        return 1.0f / (gain * 32768.0f);
+    }
+
+    void decode(
+        const uint8_t *input,
+        const size_t numSamples,
+        const float gain,
+        dsp::complex_t *output) const
+    {
+        auto *outputFloats = reinterpret_cast<float*>(output);
+        const auto *inputShorts = reinterpret_cast<const int16_t*>(input);
+        const auto numValues = static_cast<unsigned int>(numSamples * 2);
+
+        if(_implementation.empty())
+            volk_16i_s32f_convert_32f(outputFloats, inputShorts, 32768.0f * gain, numValues);
+        else
+            volk_16i_s32f_convert_32f_manual(outputFloats, inputShorts, 32768.0f * gain, numValues, _implementation.c_str());
+    }
+
+    void decodeAffine(
+        const uint8_t *input,
+        const size_t numSamples,
+        const AffineCoefficients &coeffs,
+        dsp::complex_t *output) const
+    {
+        decodeAffineImpl<int16_t>(input, numSamples, coeffs, output);
+    }
+
+    std::vector<std::string> implementations(void) const
+    {
+        return implementationNames(volk_16i_s32f_convert_32f_get_func_desc());
+    }
+};
+
+class FloatIQDecoder: public IQDecoder
+{
+public:
+    SpyServerStreamFormat format(void) const
+    {
+        return SPYSERVER_STREAM_FORMAT_FLOAT;
+    }
+
+    size_t sampleSize(void) const
+    {
+        return 2 * sizeof(float);
+    }
+
+    float scale(const float gain) const
+    {
+        return gain;
+    }
+
+    void decode(
+        const uint8_t *input,
+        const size_t numSamples,
+        const float gain,
+        dsp::complex_t *output) const
+    {
+        auto *outputFloats = reinterpret_cast<float*>(output);
+        const auto *inputFloats = reinterpret_cast<const float*>(input);
+        const auto numValues = static_cast<unsigned int>(numSamples * 2);
+
+        if(_implementation.empty())
+            volk_32f_s32f_multiply_32f(outputFloats, inputFloats, gain, numValues);
+        else
+            volk_32f_s32f_multiply_32f_manual(outputFloats, inputFloats, gain, numValues, _implementation.c_str());
+    }
+
+    void decodeAffine(
+        const uint8_t *input,
+        const size_t numSamples,
+        const AffineCoefficients &coeffs,
+        dsp::complex_t *output) const
+    {
+        decodeAffineImpl<float>(input, numSamples, coeffs, output);
+    }
+
+    std::vector<std::string> implementations(void) const
+    {
+        return implementationNames(volk_32f_s32f_multiply_32f_get_func_desc());
+    }
+};
+
+//
+// Factory
+//
+
+std::unique_ptr<IQDecoder> IQDecoder::make(const SpyServerStreamFormat format)
+{
+    switch(format)
+    {
+    case SPYSERVER_STREAM_FORMAT_UINT8:
+        return std::unique_ptr<IQDecoder>(new UInt8IQDecoder);
+
+    case SPYSERVER_STREAM_FORMAT_INT16:
+        return std::unique_ptr<IQDecoder>(new Int16IQDecoder);
+
+    case SPYSERVER_STREAM_FORMAT_FLOAT:
+        return std::unique_ptr<IQDecoder>(new FloatIQDecoder);
+
+    default:
+        return nullptr;
+    }
+}
+
+//
+// Base class
+//
+
+float IQDecoder::offset(const float) const
+{
+    return 0.0f;
+}
+
+std::vector<std::string> IQDecoder::implementations(void) const
+{
+    return std::vector<std::string>();
+}
+
+void IQDecoder::setImplementation(const std::string &name)
+{
+    if(not name.empty())
+    {
+        const auto names = this->implementations();
+        if(std::find(names.begin(), names.end(), name) == names.end())
+            throw std::invalid_argument("Invalid VOLK implementation: "+name);
+    }
+
+    _implementation = name;
+}
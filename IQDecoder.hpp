@@ -0,0 +1,68 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include "IQCorrection.hpp"
+
+#include <dsp/types.h>
+#include <spyserver_protocol.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+//
+// Converts one message body of interleaved wire samples to complex floats
+// in [-1, 1), for a single wire format.
+//
+class IQDecoder
+{
+public:
+    virtual ~IQDecoder(void) = default;
+
+    // Returns null for formats we can't decode.
+    static std::unique_ptr<IQDecoder> make(const SpyServerStreamFormat format);
+
+    virtual SpyServerStreamFormat format(void) const = 0;
+
+    // Bytes per complex sample on the wire.
+    virtual size_t sampleSize(void) const = 0;
+
+    // Maps wire values to floats as x = scale*raw + offset, given the
+    // digital gain the server reports in each message.
+    virtual float scale(const float gain) const = 0;
+
+    virtual float offset(const float gain) const;
+
+    virtual void decode(
+        const uint8_t *input,
+        const size_t numSamples,
+        const float gain,
+        dsp::complex_t *output) const = 0;
+
+    // Decodes and applies an affine transform (see IQCorrection) in one
+    // pass. The coefficients include the scale and offset.
+    virtual void decodeAffine(
+        const uint8_t *input,
+        const size_t numSamples,
+        const AffineCoefficients &coeffs,
+        dsp::complex_t *output) const = 0;
+
+    // VOLK implementations decode() can be pinned to, or empty if it
+    // doesn't use VOLK.
+    virtual std::vector<std::string> implementations(void) const;
+
+    // Pass an empty string to let VOLK pick.
+    void setImplementation(const std::string &name);
+
+    inline const std::string &implementation(void) const noexcept
+    {
+        return _implementation;
+    }
+
+protected:
+    std::string _implementation;
+};
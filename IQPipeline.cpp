@@ -0,0 +1,427 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "IQPipeline.hpp"
+
+#include "Tracing.hpp"
+
+#include <volk/volk.h>
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+//
+// Non-class utility
+//
+
+static long long sampleClockTime(const long long baseNs, const uint64_t samples, const double rate)
+{
+    if(rate <= 0.0)
+        return baseNs;
+
+    return baseNs + static_cast<long long>(std::llround(static_cast<double>(samples) * 1e9 / rate));
+}
+
+// Copies part of a frame, with its times narrowed to match.
+static std::shared_ptr<DSPComplexFrame> sliceFrame(const DSPComplexFrame &frame, const size_t offset, const size_t count)
+{
+    const auto frameSize = static_cast<long long>(frame.channels.front().size());
+    const auto duration = frame.endTimeNs - frame.timeNs;
+
+    auto slice = std::make_shared<DSPComplexFrame>(frame);
+    for(auto &channel: slice->channels)
+    {
+        channel.erase(channel.begin(), channel.begin() + offset);
+        channel.resize(count);
+    }
+    slice->timeNs = frame.timeNs + (duration * static_cast<long long>(offset)) / frameSize;
+    slice->endTimeNs = frame.timeNs + (duration * static_cast<long long>(offset + count)) / frameSize;
+
+    return slice;
+}
+
+//
+// Construction
+//
+
+IQPipeline::IQPipeline(StreamStatistics &stats):
+    _stats(stats)
+{
+    _decoders[SPYSERVER_MSG_TYPE_UINT8_IQ] = IQDecoder::make(SPYSERVER_STREAM_FORMAT_UINT8);
+    _decoders[SPYSERVER_MSG_TYPE_INT16_IQ] = IQDecoder::make(SPYSERVER_STREAM_FORMAT_INT16);
+    _decoders[SPYSERVER_MSG_TYPE_FLOAT_IQ] = IQDecoder::make(SPYSERVER_STREAM_FORMAT_FLOAT);
+}
+
+//
+// Processing
+//
+
+void IQPipeline::process(
+    const SpyServerMessageHeader &header,
+    const uint8_t *body,
+    const Clock::time_point &receivedTime)
+{
+    const auto decoderIter = _decoders.find(header.MessageType & 0xFFFF);
+    if(decoderIter == _decoders.end())
+        return;
+
+    const IQDecoder &decoder = *decoderIter->second;
+    const size_t numSamples = header.BodySize / decoder.sampleSize();
+
+    long long startNs = 0;
+    long long endNs = 0;
+    if(not this->advanceSampleClock(numSamples, startNs, endNs))
+        return;
+
+    // The upper half of the message type is the gain in dB.
+    const int flags = (header.MessageType & 0xFFFF0000) >> 16;
+    const auto gain = static_cast<float>(std::pow(10.0, static_cast<double>(flags) / 20.0));
+
+    volk::vector<dsp::complex_t> output(numSamples);
+    const auto correction = iqCorrection.snapshot(decoder.scale(gain), decoder.offset(gain));
+    if(correction.enabled)
+    {
+        decoder.decodeAffine(body, numSamples, correction.coefficients, output.data());
+        if(correction.adaptive)
+            iqCorrection.update(output.data(), numSamples);
+    }
+    else decoder.decode(body, numSamples, gain, output.data());
+
+    const auto decodedTime = Clock::now();
+    const auto decodeTimeNs = StreamStatistics::elapsedNs(receivedTime, decodedTime);
+    StreamStatistics::add(_stats.decodeTimeNs, decodeTimeNs);
+    StreamStatistics::add(_stats.messagesDecoded, 1);
+    _stats.decodeLatency.record(decodeTimeNs);
+    SPYSERVER_TRACE3(decode_done, header.SequenceNumber, numSamples, decodeTimeNs);
+
+    this->processSamples(std::move(output), header.SequenceNumber, startNs, endNs, receivedTime, decodedTime);
+}
+
+bool IQPipeline::advanceSampleClock(const size_t numSamples, long long &startNs, long long &endNs)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    startNs = sampleClockTime(_sampleClockBaseNs, _sampleClockSamples, _sampleClockRate);
+    _sampleClockSamples += numSamples;
+    endNs = sampleClockTime(_sampleClockBaseNs, _sampleClockSamples, _sampleClockRate);
+
+    // Filters need every sample to stay continuous.
+    if(_outputQueues.empty() or _resampler or _channelizer)
+        return true;
+
+    return std::any_of(
+        _outputQueues.begin(),
+        _outputQueues.end(),
+        [endNs](const OutputQueue &output)
+        {
+            return (not output.burst or (output.burstRemaining > 0)) and (not output.timed or (endNs > output.startTimeNs));
+        });
+}
+
+void IQPipeline::processSamples(
+    volk::vector<dsp::complex_t> &&samples,
+    const uint32_t sequenceNumber,
+    const long long startNs,
+    const long long endNs,
+    const Clock::time_point &receivedTime,
+    const Clock::time_point &decodedTime)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    if(_retunePending)
+    {
+        if(not this->retuneAcknowledged())
+        {
+            StreamStatistics::add(_stats.messagesDropped, 1);
+            return;
+        }
+        _retunePending = false;
+        _retuneClient = nullptr;
+        _flagNextFrame = true;
+    }
+
+    DSPComplexFrame frame;
+    frame.sequenceNumber = sequenceNumber;
+    frame.retuneCount = _retuneCount;
+    frame.hasTime = (_sampleClockRate > 0.0);
+    frame.timeNs = startNs;
+    frame.endTimeNs = endNs;
+
+    if(_mixerEnabled)
+        volk_32fc_s32fc_x2_rotator_32fc((lv_32fc_t*)samples.data(), (const lv_32fc_t*)samples.data(), _mixerIncrement, &_mixerPhase, samples.size());
+    if(_resampler)
+    {
+        _resampler->process(samples.data(), samples.size(), _resampled);
+        std::swap(samples, _resampled);
+    }
+    if(_channelizer)
+        _channelizer->process(samples.data(), samples.size(), frame.channels);
+    else
+        frame.channels.emplace_back(std::move(samples));
+
+    // Filters may not have produced anything yet.
+    if(frame.channels.front().empty())
+        return;
+
+    if(_flagNextFrame)
+    {
+        frame.firstAfterRetune = true;
+        _flagNextFrame = false;
+        _retuneLatencyUs = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - _retuneStart).count();
+    }
+
+    frame.receivedTime = receivedTime;
+    frame.enqueuedTime = Clock::now();
+    _stats.dspLatency.record(StreamStatistics::elapsedNs(decodedTime, frame.enqueuedTime));
+
+    // Enqueued under the lock so a retune can't slip in between.
+    SPYSERVER_TRACE3(enqueue, sequenceNumber, frame.channels.front().size(), _outputQueues.size());
+    const auto frameSize = frame.channels.front().size();
+    DSPComplexFramePtr shared = std::make_shared<DSPComplexFrame>(std::move(frame));
+    std::vector<std::pair<const IQBurst*, DSPComplexFramePtr>> lastFrames;
+    for(auto &output: _outputQueues)
+    {
+        if(output.burst and (output.burstRemaining == 0))
+            continue;
+
+        size_t offset = 0;
+        if(output.timed)
+        {
+            if(shared->endTimeNs <= output.startTimeNs)
+                continue;
+
+            if(shared->timeNs < output.startTimeNs)
+            {
+                const auto duration = shared->endTimeNs - shared->timeNs;
+                offset = static_cast<size_t>(((output.startTimeNs - shared->timeNs) * static_cast<long long>(frameSize) + duration - 1) / duration);
+            }
+            output.timed = false;
+            if(offset == frameSize)
+                continue;
+        }
+
+        auto count = frameSize - offset;
+        if(output.burst)
+        {
+            count = std::min(count, output.burstRemaining);
+            output.burstRemaining -= count;
+            if(output.burstRemaining == 0)
+            {
+                auto last = sliceFrame(*shared, offset, count);
+                last->endOfBurst = true;
+                lastFrames.emplace_back(output.burst.get(), std::move(last));
+                continue;
+            }
+        }
+
+        // Only this queue sees a trimmed copy.
+        if(count == frameSize)
+            output.queue->enqueue(shared);
+        else
+            output.queue->enqueue(sliceFrame(*shared, offset, count));
+    }
+
+    if(lastFrames.empty())
+        return;
+
+    // The handler can stop the server before any reader sees its burst end.
+    const uint64_t retuneCount = _retuneCount;
+    if(_burstsQueuedHandler and this->burstsQueuedLocked())
+    {
+        const auto handler = _burstsQueuedHandler;
+        lock.unlock();
+        handler();
+        lock.lock();
+    }
+
+    // A retune in the meantime discarded them, and counts them again.
+    if(_retuneCount != retuneCount)
+        return;
+
+    // Only to bursts still attached, not a queue activated again since.
+    for(auto &last: lastFrames)
+    {
+        const auto outputIter = std::find_if(
+            _outputQueues.begin(),
+            _outputQueues.end(),
+            [&last](const OutputQueue &output)
+            {
+                return (output.burst.get() == last.first);
+            });
+        if(outputIter != _outputQueues.end())
+            outputIter->queue->enqueue(std::move(last.second));
+    }
+}
+
+//
+// Output queues
+//
+
+void IQPipeline::addOutputQueue(
+    std::shared_ptr<DSPComplexBufferQueue> queue,
+    const bool timed,
+    const long long startTimeNs,
+    std::shared_ptr<IQBurst> burst)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const auto burstSize = burst ? burst->size : 0;
+    _outputQueues.push_back(OutputQueue{std::move(queue), timed, startTimeNs, std::move(burst), burstSize});
+}
+
+void IQPipeline::removeOutputQueue(const std::shared_ptr<DSPComplexBufferQueue> &queue)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _outputQueues.erase(
+        std::remove_if(
+            _outputQueues.begin(),
+            _outputQueues.end(),
+            [&queue](const OutputQueue &output)
+            {
+                return (output.queue == queue);
+            }),
+        _outputQueues.end());
+}
+
+bool IQPipeline::outputQueuesFull(void)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return std::any_of(
+        _outputQueues.begin(),
+        _outputQueues.end(),
+        [](const OutputQueue &output)
+        {
+            return (output.queue->size() >= output.queue->maxSize());
+        });
+}
+
+bool IQPipeline::burstsQueued(void)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return this->burstsQueuedLocked();
+}
+
+bool IQPipeline::burstsQueuedLocked(void) const
+{
+    return not _outputQueues.empty() and std::all_of(
+        _outputQueues.begin(),
+        _outputQueues.end(),
+        [](const OutputQueue &output)
+        {
+            return output.burst and (output.burstRemaining == 0);
+        });
+}
+
+void IQPipeline::setBurstsQueuedHandler(std::function<void(void)> handler)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _burstsQueuedHandler = std::move(handler);
+}
+
+//
+// Retunes
+//
+
+void IQPipeline::beginRetune(spyserver::SpyServerClientClass &client, const spyserver::SpyServerClientClass::Acknowledgement &ack)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _retuneClient = &client;
+    _retuneAck = ack;
+    this->beginRetuneLocked();
+}
+
+void IQPipeline::markLocalRetune(void)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    // This doesn't cancel waiting on the server for an earlier retune.
+    if(not _retunePending)
+        _retuneClient = nullptr;
+
+    this->beginRetuneLocked();
+}
+
+void IQPipeline::beginRetuneLocked(void)
+{
+    _retunePending = true;
+    _retuneStart = Clock::now();
+    _retuneCount++;
+    _retuneLatencyUs = -1;
+
+    // Filter state holds samples from the old tuning too.
+    if(_resampler)
+        _resampler->reset();
+    if(_channelizer)
+        _channelizer->reset();
+
+    for(auto &output: _outputQueues)
+    {
+        output.queue->clear();
+        output.queue->resetOverflow();
+
+        // Whatever the reader hasn't got is queued again.
+        if(output.burst)
+            output.burstRemaining = output.burst->size - std::min(output.burst->size, output.burst->numRead.load());
+    }
+}
+
+bool IQPipeline::retuneAcknowledged(void)
+{
+    if(not _retuneClient or _retuneClient->acknowledged(_retuneAck))
+        return true;
+
+    return (Clock::now() - _retuneStart) > std::chrono::milliseconds(_retuneTimeoutMs);
+}
+
+void IQPipeline::setRetuneTimeout(const int timeoutMs)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _retuneTimeoutMs = timeoutMs;
+}
+
+//
+// Sample clock
+//
+
+void IQPipeline::setSampleClockRate(const double rate)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _sampleClockBaseNs = sampleClockTime(_sampleClockBaseNs, _sampleClockSamples, _sampleClockRate);
+    _sampleClockSamples = 0;
+    _sampleClockRate = rate;
+}
+
+long long IQPipeline::sampleClockNs(void)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return sampleClockTime(_sampleClockBaseNs, _sampleClockSamples, _sampleClockRate);
+}
+
+//
+// DSP
+//
+
+void IQPipeline::setMixerFrequency(const double normalizedFrequency)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    // Shift the requested offset down to DC.
+    const double phase = -2.0 * M_PI * normalizedFrequency;
+    _mixerIncrement = lv_cmake(static_cast<float>(std::cos(phase)), static_cast<float>(std::sin(phase)));
+    _mixerEnabled = (normalizedFrequency != 0.0);
+}
+
+void IQPipeline::setResampler(std::unique_ptr<PolyphaseResampler> resampler)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _resampler = std::move(resampler);
+}
+
+void IQPipeline::setChannelizer(std::unique_ptr<PolyphaseChannelizer> channelizer)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _channelizer = std::move(channelizer);
+}
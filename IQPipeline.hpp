@@ -0,0 +1,233 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include "CappedSizeQueue.hpp"
+#include "Channelizer.hpp"
+#include "IQCorrection.hpp"
+#include "IQDecoder.hpp"
+#include "Resampler.hpp"
+#include "StreamStatistics.hpp"
+
+#include "spyserver_client.h"
+
+#include <dsp/types.h>
+#include <spyserver_protocol.h>
+
+#include <volk/volk_alloc.hh>
+#include <volk/volk_complex.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// One decoded message's worth of samples for each output channel.
+struct DSPComplexFrame
+{
+    std::vector<volk::vector<dsp::complex_t>> channels;
+
+    uint32_t sequenceNumber{0};
+
+    // Which retune this frame was decoded under, and whether it's the first.
+    uint64_t retuneCount{0};
+    bool firstAfterRetune{false};
+
+    // On the sample clock, of the first sample and just past the last.
+    // Without an IQ rate to count at, there are no times.
+    bool hasTime{false};
+    long long timeNs{0};
+    long long endTimeNs{0};
+
+    // The last of a finite burst, only in that burst's queue.
+    bool endOfBurst{false};
+
+    // When the message body finished arriving, and when the frame was queued.
+    std::chrono::steady_clock::time_point receivedTime;
+    std::chrono::steady_clock::time_point enqueuedTime;
+};
+
+// Frames are shared, read-only, between every reader's queue.
+using DSPComplexFramePtr = std::shared_ptr<const DSPComplexFrame>;
+using DSPComplexBufferQueue = CappedSizeQueue<DSPComplexFramePtr>;
+
+// A finite burst on an output queue. The pipeline queues that many samples
+// as they arrive, and the reader counts those it's read, so a retune can
+// queue again whatever it discarded.
+struct IQBurst
+{
+    IQBurst(const size_t size):
+        size(size)
+    {}
+
+    const size_t size;
+    std::atomic<size_t> numRead{0};
+};
+
+//
+// Turns a session's IQ messages into frames for every attached queue:
+// decoding with any IQ correction fused in, then optional mixing,
+// resampling and channelization.
+//
+// Across a retune, everything decoded before the server acknowledges it
+// is discarded, and the first frame afterwards is flagged. Every sample
+// received also advances a clock, which timed queues start on.
+//
+// A queue with a burst gets nothing once the burst is queued. When every
+// queue's burst is, the handler is told before the last frames are queued,
+// so the server can be stopped before anyone reads them.
+//
+// Messages come from the receive thread. Everything else is thread-safe.
+//
+class IQPipeline
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    IQPipeline(StreamStatistics &stats);
+    ~IQPipeline(void) = default;
+
+    static inline bool isIQ(const SpyServerMessageHeader &header)
+    {
+        const auto type = header.MessageType & 0xFFFF;
+        return (type >= SPYSERVER_MSG_TYPE_UINT8_IQ) and (type <= SPYSERVER_MSG_TYPE_FLOAT_IQ);
+    }
+
+    // Ignores anything but IQ.
+    void process(
+        const SpyServerMessageHeader &header,
+        const uint8_t *body,
+        const Clock::time_point &receivedTime);
+
+    // Every queue gets each frame decoded while it's attached. A queue that
+    // isn't read quickly enough only overflows itself.
+    //
+    // A timed queue gets nothing before the given time on the sample clock,
+    // and a burst is counted from there.
+    void addOutputQueue(
+        std::shared_ptr<DSPComplexBufferQueue> queue,
+        const bool timed = false,
+        const long long startTimeNs = 0,
+        std::shared_ptr<IQBurst> burst = nullptr);
+    void removeOutputQueue(const std::shared_ptr<DSPComplexBufferQueue> &queue);
+
+    bool outputQueuesFull(void);
+
+    // Whether every attached queue has its whole burst queued, so nothing
+    // more is needed from the server. A retune can change that back.
+    bool burstsQueued(void);
+
+    // Called from the receive thread, without the lock held.
+    void setBurstsQueuedHandler(std::function<void(void)> handler);
+
+    // For a setting sent to the server, which the client will acknowledge.
+    void beginRetune(spyserver::SpyServerClientClass &client, const spyserver::SpyServerClientClass::Acknowledgement &ack);
+
+    // Same, for changes that take effect locally and immediately.
+    void markLocalRetune(void);
+
+    // How long a retune waits on the server before giving up on hearing back.
+    void setRetuneTimeout(const int timeoutMs);
+
+    inline uint64_t retuneCount(void) const
+    {
+        return _retuneCount;
+    }
+
+    // From the last retune to its first valid frame, or negative if still pending.
+    inline int64_t retuneLatencyUs(void) const
+    {
+        return _retuneLatencyUs;
+    }
+
+    // The sample clock counts IQ samples as they arrive, at the IQ sample
+    // rate last given, so it only advances while streaming. A new rate
+    // applies from the next message.
+    void setSampleClockRate(const double rate);
+    long long sampleClockNs(void);
+
+    // Frequency is normalized to the IQ sample rate. Pass zero to disable mixing.
+    void setMixerFrequency(const double normalizedFrequency);
+
+    // Pass null to disable resampling.
+    void setResampler(std::unique_ptr<PolyphaseResampler> resampler);
+
+    // Pass null to output a single channel.
+    void setChannelizer(std::unique_ptr<PolyphaseChannelizer> channelizer);
+
+    IQCorrection iqCorrection;
+
+private:
+    // Call with _mutex held.
+    void beginRetuneLocked(void);
+    bool burstsQueuedLocked(void) const;
+    bool retuneAcknowledged(void);
+
+    // Advances the sample clock past a message. Returns false if every
+    // attached queue is waiting for a later time, so the message needn't
+    // be decoded at all.
+    bool advanceSampleClock(const size_t numSamples, long long &startNs, long long &endNs);
+
+    void processSamples(
+        volk::vector<dsp::complex_t> &&samples,
+        const uint32_t sequenceNumber,
+        const long long startNs,
+        const long long endNs,
+        const Clock::time_point &receivedTime,
+        const Clock::time_point &decodedTime);
+
+    StreamStatistics &_stats;
+
+    // Keyed by IQ message type.
+    std::map<uint32_t, std::unique_ptr<IQDecoder>> _decoders;
+
+    // Guards everything below.
+    std::mutex _mutex;
+
+    bool _mixerEnabled{false};
+    lv_32fc_t _mixerPhase{lv_cmake(1.0f, 0.0f)};
+    lv_32fc_t _mixerIncrement{lv_cmake(1.0f, 0.0f)};
+    std::unique_ptr<PolyphaseResampler> _resampler;
+    volk::vector<dsp::complex_t> _resampled;
+    std::unique_ptr<PolyphaseChannelizer> _channelizer;
+
+    std::function<void(void)> _burstsQueuedHandler;
+
+    int _retuneTimeoutMs{1000};
+    bool _retunePending{false};
+    bool _flagNextFrame{false};
+    Clock::time_point _retuneStart;
+
+    // Null unless waiting on the server.
+    spyserver::SpyServerClientClass *_retuneClient{nullptr};
+    spyserver::SpyServerClientClass::Acknowledgement _retuneAck{0, 0};
+
+    std::atomic<uint64_t> _retuneCount{0};
+    std::atomic<int64_t> _retuneLatencyUs{-1};
+
+    // Times are counted from the last rate change.
+    double _sampleClockRate{0.0};
+    long long _sampleClockBaseNs{0};
+    uint64_t _sampleClockSamples{0};
+
+    struct OutputQueue
+    {
+        std::shared_ptr<DSPComplexBufferQueue> queue;
+
+        // Cleared once the start time is reached.
+        bool timed;
+        long long startTimeNs;
+
+        // Null when unlimited.
+        std::shared_ptr<IQBurst> burst;
+        size_t burstRemaining;
+    };
+
+    std::vector<OutputQueue> _outputQueues;
+};
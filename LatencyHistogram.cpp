@@ -0,0 +1,147 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "LatencyHistogram.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+
+//
+// Construction
+//
+
+LatencyHistogram::LatencyHistogram(void)
+{
+    this->reset();
+}
+
+//
+// Recording
+//
+
+void LatencyHistogram::record(const uint64_t valueNs) noexcept
+{
+    _buckets[bucketIndex(valueNs)].fetch_add(1, std::memory_order_relaxed);
+    _count.fetch_add(1, std::memory_order_relaxed);
+
+    auto maximum = _maximum.load(std::memory_order_relaxed);
+    while((valueNs > maximum) and not _maximum.compare_exchange_weak(maximum, valueNs, std::memory_order_relaxed)) {}
+}
+
+void LatencyHistogram::add(const LatencyHistogram &other) noexcept
+{
+    for(size_t i = 0; i < NumBuckets; ++i)
+        _buckets[i].fetch_add(other._buckets[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    _count.fetch_add(other.count(), std::memory_order_relaxed);
+
+    const auto otherMaximum = other.maximum();
+    auto maximum = _maximum.load(std::memory_order_relaxed);
+    while((otherMaximum > maximum) and not _maximum.compare_exchange_weak(maximum, otherMaximum, std::memory_order_relaxed)) {}
+}
+
+void LatencyHistogram::reset(void) noexcept
+{
+    for(auto &bucket: _buckets) bucket.store(0, std::memory_order_relaxed);
+    _count.store(0, std::memory_order_relaxed);
+    _maximum.store(0, std::memory_order_relaxed);
+}
+
+//
+// Queries
+//
+
+uint64_t LatencyHistogram::count(void) const noexcept
+{
+    return _count.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::maximum(void) const noexcept
+{
+    return _maximum.load(std::memory_order_relaxed);
+}
+
+std::vector<uint64_t> LatencyHistogram::percentiles(const std::vector<double> &fractions) const
+{
+    std::vector<uint64_t> counts(NumBuckets);
+    uint64_t total = 0;
+    for(size_t i = 0; i < NumBuckets; ++i)
+    {
+        counts[i] = _buckets[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+
+    std::vector<uint64_t> values(fractions.size(), 0);
+    if(total == 0)
+        return values;
+
+    for(size_t f = 0; f < fractions.size(); ++f)
+    {
+        const auto target = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(fractions[f] * double(total))));
+
+        uint64_t cumulative = 0;
+        for(size_t i = 0; i < NumBuckets; ++i)
+        {
+            cumulative += counts[i];
+            if(cumulative >= target)
+            {
+                values[f] = bucketValue(i);
+                break;
+            }
+        }
+    }
+
+    return values;
+}
+
+std::string LatencyHistogram::summary(void) const
+{
+    const auto values = this->percentiles({0.5, 0.9, 0.99, 0.999});
+
+    char buffer[256];
+    std::snprintf(
+        buffer,
+        sizeof(buffer),
+        "p50=%.1f, p90=%.1f, p99=%.1f, p99.9=%.1f, max=%.1f, count=%llu",
+        values[0] / 1e3,
+        values[1] / 1e3,
+        values[2] / 1e3,
+        values[3] / 1e3,
+        this->maximum() / 1e3,
+        static_cast<unsigned long long>(this->count()));
+
+    return buffer;
+}
+
+//
+// Buckets
+//
+
+size_t LatencyHistogram::bucketIndex(const uint64_t value) noexcept
+{
+    // Values below SubBucketCount get one bucket each.
+    if(value < SubBucketCount)
+        return static_cast<size_t>(value);
+
+    size_t msb = 0;
+    for(uint64_t remaining = value; remaining > 1; remaining >>= 1) ++msb;
+
+    const size_t shift = msb - SubBucketBits;
+    const size_t subBucket = static_cast<size_t>(value >> shift) - SubBucketCount;
+    const size_t index = ((shift + 1) * SubBucketCount) + subBucket;
+    assert(index < NumBuckets);
+
+    return index;
+}
+
+uint64_t LatencyHistogram::bucketValue(const size_t index) noexcept
+{
+    if(index < SubBucketCount)
+        return index;
+
+    const size_t shift = (index / SubBucketCount) - 1;
+    const uint64_t lower = uint64_t((index % SubBucketCount) + SubBucketCount) << shift;
+
+    return lower + ((uint64_t(1) << shift) / 2);
+}
@@ -0,0 +1,60 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//
+// Lock-free log-linear histogram of durations, in the style of
+// HdrHistogram. Each power of two is split into 16 linear buckets, so
+// any recorded value is known to within about 6%, from 1 ns up to the
+// full 64-bit range, in a fixed 8 KB.
+//
+// Recording is a relaxed atomic increment, safe from any thread. Reads
+// are a snapshot that may miss values recorded concurrently.
+//
+class LatencyHistogram
+{
+public:
+    LatencyHistogram(void);
+    ~LatencyHistogram(void) = default;
+
+    void record(const uint64_t valueNs) noexcept;
+
+    // Adds every value recorded in another histogram, e.g. to summarize
+    // several together.
+    void add(const LatencyHistogram &other) noexcept;
+
+    uint64_t count(void) const noexcept;
+
+    uint64_t maximum(void) const noexcept;
+
+    // For each fraction in (0, 1], the smallest bucket value at least
+    // that fraction of recorded values fall at or below. Zero if empty.
+    std::vector<uint64_t> percentiles(const std::vector<double> &fractions) const;
+
+    // Human-readable summary of the usual percentiles, in microseconds.
+    std::string summary(void) const;
+
+    void reset(void) noexcept;
+
+private:
+    static constexpr size_t SubBucketBits = 4;
+    static constexpr size_t SubBucketCount = size_t(1) << SubBucketBits;
+    static constexpr size_t NumBuckets = (64 - SubBucketBits + 1) * SubBucketCount;
+
+    static size_t bucketIndex(const uint64_t value) noexcept;
+
+    // Midpoint of the values a bucket covers.
+    static uint64_t bucketValue(const size_t index) noexcept;
+
+    std::array<std::atomic<uint64_t>, NumBuckets> _buckets;
+    std::atomic<uint64_t> _count{0};
+    std::atomic<uint64_t> _maximum{0};
+};
@@ -0,0 +1,272 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "MessageSource.hpp"
+
+#include "IQPipeline.hpp"
+
+#include <SoapySDR/Logger.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <exception>
+
+//
+// MessageSource
+//
+
+MessageSource::MessageSource(spyserver::SpyServerClientClass &client, StreamStatistics &stats):
+    _client(client),
+    _stats(stats)
+{}
+
+void MessageSource::setStreaming(const bool streaming)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _streaming = streaming;
+    }
+    _cond.notify_all();
+}
+
+void MessageSource::configureThread(const ThreadConfig &config)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _threadConfig.reset(new ThreadConfig(config));
+    }
+    _cond.notify_all();
+}
+
+bool MessageSource::isOpen(void)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return not _stop;
+}
+
+void MessageSource::stop(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cond.notify_all();
+
+    if(_thread.joinable())
+        _thread.join();
+}
+
+void MessageSource::applyThreadConfig(const char *role)
+{
+    if(not _threadConfig)
+        return;
+
+    try
+    {
+        configureCurrentThread(*_threadConfig);
+    }
+    catch(const std::exception &ex)
+    {
+        SoapySDR::logf(SOAPY_SDR_WARNING, "SpyServer %s thread: %s", role, ex.what());
+    }
+    _threadConfig.reset();
+}
+
+//
+// CaptureReplay
+//
+
+CaptureReplay::CaptureReplay(
+    std::unique_ptr<CaptureReader> reader,
+    const bool realtime,
+    spyserver::SpyServerClientClass &client,
+    StreamStatistics &stats,
+    std::function<bool(void)> backlogged):
+    MessageSource(client, stats),
+    _reader(std::move(reader)),
+    _realtime(realtime),
+    _backlogged(std::move(backlogged))
+{
+    _thread = std::thread(&CaptureReplay::worker, this);
+}
+
+CaptureReplay::~CaptureReplay(void)
+{
+    this->stop();
+}
+
+void CaptureReplay::worker(void)
+{
+    using Clock = std::chrono::steady_clock;
+
+    CaptureReader::Record record;
+    bool restartPacing = true;
+    Clock::time_point paceStart;
+    uint64_t paceArrivalNs = 0;
+
+    try
+    {
+        while(_reader->next(record))
+        {
+            const bool isIQ = IQPipeline::isIQ(record.header);
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                this->applyThreadConfig("replay");
+
+                // Like a server, only send IQ while streaming, and pick the
+                // original timing back up from wherever it was paused.
+                if(isIQ and not _streaming)
+                {
+                    _cond.wait(lock, [this](){ return _streaming or _stop; });
+                    restartPacing = true;
+                }
+                if(_stop)
+                    break;
+
+                if(isIQ and _realtime)
+                {
+                    if(restartPacing)
+                    {
+                        paceStart = Clock::now();
+                        paceArrivalNs = record.arrivalNs;
+                        restartPacing = false;
+                    }
+                    else
+                    {
+                        const auto due = paceStart + std::chrono::nanoseconds(record.arrivalNs - std::min(record.arrivalNs, paceArrivalNs));
+                        _cond.wait_until(lock, due, [this](){ return _stop; });
+                    }
+                }
+                else if(isIQ)
+                {
+                    while(not _stop and _backlogged())
+                        _cond.wait_for(lock, std::chrono::microseconds(100));
+                }
+                if(_stop)
+                    break;
+            }
+
+            _client.receive(record.header, record.body, Clock::now());
+        }
+    }
+    catch(const std::exception &ex)
+    {
+        SoapySDR::logf(SOAPY_SDR_ERROR, "SpyServer replay failed: %s", ex.what());
+        return;
+    }
+
+    SoapySDR::log(SOAPY_SDR_INFO, "SpyServer replay finished");
+}
+
+//
+// SharedRingAttach
+//
+
+SharedRingAttach::SharedRingAttach(
+    std::unique_ptr<SharedRingReader> reader,
+    spyserver::SpyServerClientClass &client,
+    StreamStatistics &stats):
+    MessageSource(client, stats),
+    _reader(std::move(reader)),
+    _body(SPYSERVER_MAX_MESSAGE_BODY_SIZE)
+{
+    _thread = std::thread(&SharedRingAttach::worker, this);
+}
+
+SharedRingAttach::~SharedRingAttach(void)
+{
+    this->stop();
+}
+
+void SharedRingAttach::worker(void)
+{
+    using Clock = std::chrono::steady_clock;
+
+    // Present the publisher's current state as a server would on connecting.
+    SpyServerDeviceInfo devInfo;
+    SpyServerClientSync clientSync;
+    while(not _reader->info(devInfo, clientSync))
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if(_cond.wait_for(lock, std::chrono::milliseconds(10), [this](){ return _stop; }))
+            return;
+    }
+
+    SpyServerMessageHeader header;
+    header.ProtocolID = SPYSERVER_PROTOCOL_VERSION;
+    header.StreamType = SPYSERVER_STREAM_TYPE_STATUS;
+    header.SequenceNumber = 0;
+    header.MessageType = SPYSERVER_MSG_TYPE_DEVICE_INFO;
+    header.BodySize = sizeof(devInfo);
+    _client.receive(header, reinterpret_cast<const uint8_t*>(&devInfo), Clock::now());
+    header.MessageType = SPYSERVER_MSG_TYPE_CLIENT_SYNC;
+    header.BodySize = sizeof(clientSync);
+    _client.receive(header, reinterpret_cast<const uint8_t*>(&clientSync), Clock::now());
+
+    // The ring's own sequence picks up wherever the publisher is.
+    _stats.restartSequence();
+
+    SharedRingReader::Record record;
+    for(;;)
+    {
+        bool streaming = false;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if(_stop)
+                break;
+
+            this->applyThreadConfig("attach");
+            streaming = _streaming;
+        }
+
+        // Well behind, the writer would likely lap us, so catch up first.
+        if(_reader->lag() > (_reader->dataSize() / 2))
+        {
+            _reader->seekToLatest();
+            StreamStatistics::add(_stats.messagesDropped, 1);
+            continue;
+        }
+
+        const auto status = _reader->next(record);
+        if(status == SharedRingReader::Status::Closed)
+        {
+            SoapySDR::log(SOAPY_SDR_INFO, "SpyServer shared ring closed");
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stop = true;
+            }
+            break;
+        }
+        else if(status == SharedRingReader::Status::Empty)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cond.wait_for(lock, std::chrono::microseconds(200), [this](){ return _stop; });
+            continue;
+        }
+        else if(status == SharedRingReader::Status::Overrun)
+        {
+            StreamStatistics::add(_stats.messagesDropped, 1);
+            continue;
+        }
+
+        // Like a server, only deliver IQ while streaming.
+        if(IQPipeline::isIQ(record.header) and not streaming)
+        {
+            _stats.countSequence(record.header.SequenceNumber);
+            continue;
+        }
+
+        // Copy the body out, then make sure the writer didn't lap us while
+        // copying, so nothing downstream sees a half-overwritten record.
+        std::memcpy(_body.data(), record.body, record.header.BodySize);
+        if(not _reader->lastRecordValid())
+        {
+            _reader->seekToLatest();
+            StreamStatistics::add(_stats.messagesDropped, 1);
+            continue;
+        }
+
+        _client.receive(record.header, _body.data(), Clock::now());
+    }
+}
@@ -0,0 +1,105 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include "SessionCapture.hpp"
+#include "SharedRing.hpp"
+#include "StreamStatistics.hpp"
+#include "ThreadUtils.hpp"
+
+#include "spyserver_client.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//
+// Feeds a client with no connection from its own thread, in place of a
+// server. Like a server, IQ is only delivered while streaming, but
+// commands go nowhere.
+//
+class MessageSource
+{
+public:
+    virtual ~MessageSource(void) = default;
+
+    void setStreaming(const bool streaming);
+
+    // Applied from the thread itself, so failures are only logged.
+    void configureThread(const ThreadConfig &config);
+
+    // False once the source has nothing more to give.
+    bool isOpen(void);
+
+    // Joins the thread. Derived classes call this first on destruction.
+    void stop(void);
+
+protected:
+    MessageSource(spyserver::SpyServerClientClass &client, StreamStatistics &stats);
+
+    // Call with _mutex held.
+    void applyThreadConfig(const char *role);
+
+    spyserver::SpyServerClientClass &_client;
+    StreamStatistics &_stats;
+
+    // Guards everything below.
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    bool _streaming{false};
+    bool _stop{false};
+    std::unique_ptr<ThreadConfig> _threadConfig;
+
+    std::thread _thread;
+};
+
+//
+// Replays a capture through the client, either in its original timing, or
+// as fast as readers keep up without overflowing, so runs are repeatable.
+//
+class CaptureReplay: public MessageSource
+{
+public:
+    // The predicate says whether readers are behind.
+    CaptureReplay(
+        std::unique_ptr<CaptureReader> reader,
+        const bool realtime,
+        spyserver::SpyServerClientClass &client,
+        StreamStatistics &stats,
+        std::function<bool(void)> backlogged);
+    virtual ~CaptureReplay(void);
+
+private:
+    void worker(void);
+
+    std::unique_ptr<CaptureReader> _reader;
+    bool _realtime;
+    std::function<bool(void)> _backlogged;
+};
+
+//
+// Reads another process's connection through its shared ring, from the
+// newest data, starting with the publisher's current device info and sync.
+//
+class SharedRingAttach: public MessageSource
+{
+public:
+    SharedRingAttach(
+        std::unique_ptr<SharedRingReader> reader,
+        spyserver::SpyServerClientClass &client,
+        StreamStatistics &stats);
+    virtual ~SharedRingAttach(void);
+
+private:
+    void worker(void);
+
+    std::unique_ptr<SharedRingReader> _reader;
+
+    // Bodies are copied out of the ring before anything uses them.
+    std::vector<uint8_t> _body;
+};
@@ -0,0 +1,86 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "MessageTaps.hpp"
+
+void MessageTaps::startCapture(const std::string &path)
+{
+    _capture.reset(new CaptureWriter(path));
+}
+
+void MessageTaps::startRecording(spyserver::SpyServerClientClass &client, std::shared_ptr<CaptureWriter> recording)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const auto now = Clock::now();
+    client.forEachStatusMessage(
+        [&](const SpyServerMessageHeader &header, const uint8_t *body)
+        {
+            recording->write(now, header, body);
+        });
+
+    _recording = std::move(recording);
+}
+
+void MessageTaps::stopRecording(void)
+{
+    std::shared_ptr<CaptureWriter> recording;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        recording.swap(_recording);
+    }
+
+    // Flushed outside the lock, once nothing else holds it.
+}
+
+std::shared_ptr<CaptureWriter> MessageTaps::currentRecording(void)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _recording;
+}
+
+void MessageTaps::startSharing(spyserver::SpyServerClientClass &client, std::unique_ptr<SharedRingWriter> ring)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const auto now = Clock::now();
+    client.forEachStatusMessage(
+        [&](const SpyServerMessageHeader &header, const uint8_t *body)
+        {
+            ring->publish(now, header, body);
+        });
+
+    _sharing = std::move(ring);
+}
+
+void MessageTaps::startPreTrigger(spyserver::SpyServerClientClass &client, std::shared_ptr<PreTriggerRing> ring)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const auto now = Clock::now();
+    client.forEachStatusMessage(
+        [&](const SpyServerMessageHeader &header, const uint8_t *body)
+        {
+            ring->push(now, header, body);
+        });
+
+    _preTrigger = std::move(ring);
+}
+
+void MessageTaps::write(
+    const Clock::time_point &receivedTime,
+    const SpyServerMessageHeader &header,
+    const uint8_t *body)
+{
+    // Only set before any messages, so never changes under us.
+    if(_capture)
+        _capture->write(receivedTime, header, body);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if(_recording)
+        _recording->write(receivedTime, header, body);
+    if(_sharing)
+        _sharing->publish(receivedTime, header, body);
+    if(_preTrigger)
+        _preTrigger->push(receivedTime, header, body);
+}
@@ -0,0 +1,58 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include "PreTriggerRing.hpp"
+#include "SessionCapture.hpp"
+#include "SharedRing.hpp"
+
+#include "spyserver_client.h"
+
+#include <spyserver_protocol.h>
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+
+//
+// Everywhere a session's raw messages are copied to, as they arrive: the
+// capture of the whole session, a recording, a shared ring and a pre-trigger
+// ring. Anything started partway through begins with the client's current
+// device info and sync, so it can be replayed on its own.
+//
+class MessageTaps
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    MessageTaps(void) = default;
+    ~MessageTaps(void) = default;
+
+    // Only before any messages, so the capture starts with the handshake.
+    void startCapture(const std::string &path);
+
+    void startRecording(spyserver::SpyServerClientClass &client, std::shared_ptr<CaptureWriter> recording);
+    void stopRecording(void);
+    std::shared_ptr<CaptureWriter> currentRecording(void);
+
+    void startSharing(spyserver::SpyServerClientClass &client, std::unique_ptr<SharedRingWriter> ring);
+
+    void startPreTrigger(spyserver::SpyServerClientClass &client, std::shared_ptr<PreTriggerRing> ring);
+
+    // From the receive thread.
+    void write(
+        const Clock::time_point &receivedTime,
+        const SpyServerMessageHeader &header,
+        const uint8_t *body);
+
+private:
+    std::unique_ptr<CaptureWriter> _capture;
+
+    // Guards everything below.
+    std::mutex _mutex;
+    std::shared_ptr<CaptureWriter> _recording;
+    std::unique_ptr<SharedRingWriter> _sharing;
+    std::shared_ptr<PreTriggerRing> _preTrigger;
+};
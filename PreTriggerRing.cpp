@@ -0,0 +1,382 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "PreTriggerRing.hpp"
+
+#include <SoapySDR/Logger.hpp>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+//
+// Non-class utility
+//
+
+static constexpr size_t HugePageSize = 2 << 20;
+
+// A dump hands space back to the receive thread after each slice it writes.
+static constexpr uint64_t DumpSliceSize = 1 << 20;
+
+static uint8_t *allocateRing(const size_t size, bool &hugePages)
+{
+    hugePages = false;
+
+#ifdef _WIN32
+    void *ptr = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if(not ptr)
+        throw std::bad_alloc();
+#else
+    void *ptr = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    // Explicit huge pages need a reserved pool, so this often fails.
+    ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    hugePages = (ptr != MAP_FAILED);
+#endif
+
+    if(ptr == MAP_FAILED)
+    {
+        ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(ptr == MAP_FAILED)
+            throw std::bad_alloc();
+
+#ifdef MADV_HUGEPAGE
+        // Transparent huge pages, if the kernel allows them.
+        hugePages = (::madvise(ptr, size, MADV_HUGEPAGE) == 0);
+#endif
+    }
+#endif
+
+    return static_cast<uint8_t*>(ptr);
+}
+
+static void freeRing(uint8_t *data, const size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    VirtualFree(data, 0, MEM_RELEASE);
+#else
+    ::munmap(data, size);
+#endif
+}
+
+static uint64_t elapsedNs(
+    const PreTriggerRing::Clock::time_point &from,
+    const PreTriggerRing::Clock::time_point &to)
+{
+    return (to > from)
+        ? static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count())
+        : 0;
+}
+
+static bool writeStatusRecord(
+    AsyncFileWriter &file,
+    const uint64_t arrivalNs,
+    const SpyServerMessageHeader &header,
+    const void *body)
+{
+    static const uint8_t padding[CaptureRecordAlignment] = {0};
+
+    CaptureRecordHeader recordHeader;
+    recordHeader.arrivalNs = arrivalNs;
+    recordHeader.recordSize = static_cast<uint32_t>(captureRecordSize(header.BodySize));
+    recordHeader.reserved = 0;
+
+    const size_t paddingSize = recordHeader.recordSize - (sizeof(recordHeader) + sizeof(header) + header.BodySize);
+
+    return file.writeAll(&recordHeader, sizeof(recordHeader))
+       and file.writeAll(&header, sizeof(header))
+       and file.writeAll(body, header.BodySize)
+       and file.writeAll(padding, paddingSize);
+}
+
+/*******************************************************************
+ * PreTriggerRing
+ ******************************************************************/
+
+PreTriggerRing::PreTriggerRing(const size_t size, const double preSeconds, const double postSeconds):
+    _size(((size + HugePageSize - 1) / HugePageSize) * HugePageSize),
+    _preDuration(std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(preSeconds))),
+    _postDuration(std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(postSeconds)))
+{
+    if((preSeconds <= 0.0) or (postSeconds < 0.0))
+        throw std::invalid_argument("Invalid pre-trigger duration");
+
+    // Every message must fit with room to spare.
+    if(_size < (4 * captureRecordSize(SPYSERVER_MAX_MESSAGE_BODY_SIZE)))
+        throw std::invalid_argument("Pre-trigger ring too small: "+std::to_string(size));
+
+    _data = allocateRing(_size, _hugePages);
+
+    // Fault every page in now, rather than on the receive thread.
+    std::memset(_data, 0, _size);
+
+    _startTime = Clock::now();
+}
+
+PreTriggerRing::~PreTriggerRing(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cond.notify_all();
+
+    // A dump in progress is cut short, but still written.
+    if(_dumpThread.joinable())
+        _dumpThread.join();
+
+    freeRing(_data, _size);
+}
+
+void PreTriggerRing::push(
+    const Clock::time_point &arrivalTime,
+    const SpyServerMessageHeader &header,
+    const uint8_t *body)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const int messageType = header.MessageType & 0xFFFF;
+    if((messageType == SPYSERVER_MSG_TYPE_DEVICE_INFO) and (header.BodySize >= sizeof(SpyServerDeviceInfo)))
+    {
+        _deviceInfoHeader = header;
+        _deviceInfoHeader.BodySize = sizeof(SpyServerDeviceInfo);
+        std::memcpy(&_deviceInfo, body, sizeof(SpyServerDeviceInfo));
+        _hasDeviceInfo = true;
+    }
+    else if((messageType == SPYSERVER_MSG_TYPE_CLIENT_SYNC) and (header.BodySize >= sizeof(SpyServerClientSync)))
+    {
+        _clientSyncHeader = header;
+        _clientSyncHeader.BodySize = sizeof(SpyServerClientSync);
+        std::memcpy(&_clientSync, body, sizeof(SpyServerClientSync));
+        _hasClientSync = true;
+    }
+
+    const size_t recordSize = captureRecordSize(header.BodySize);
+
+    // Laid out like a shared ring: records never wrap, and a zero-sized
+    // record (or too little room for one) means the rest starts over.
+    const uint64_t offset = _tail % _size;
+    const uint64_t tail = _size - offset;
+    const uint64_t skip = (tail < recordSize) ? tail : 0;
+
+    CaptureRecordHeader recordHeader;
+    while((_tail + skip + recordSize - _head) > _size)
+    {
+        const uint64_t span = this->recordSpan(_head, recordHeader);
+
+        // A dump in progress still needs everything from its position on.
+        if(_dumping and ((_head + span) > _dumpPosition))
+        {
+            ++_dropped;
+            return;
+        }
+
+        _head += span;
+    }
+
+    if((skip > 0) and (skip >= sizeof(CaptureRecordHeader)))
+    {
+        const CaptureRecordHeader marker{0, 0, 0};
+        std::memcpy(_data + offset, &marker, sizeof(marker));
+    }
+    _tail += skip;
+
+    recordHeader.arrivalNs = elapsedNs(_startTime, arrivalTime);
+    recordHeader.recordSize = static_cast<uint32_t>(recordSize);
+    recordHeader.reserved = 0;
+
+    uint8_t *record = _data + (_tail % _size);
+    std::memcpy(record, &recordHeader, sizeof(recordHeader));
+    std::memcpy(record + sizeof(recordHeader), &header, sizeof(header));
+    if(header.BodySize > 0)
+        std::memcpy(record + sizeof(recordHeader) + sizeof(header), body, header.BodySize);
+
+    const size_t paddingSize = recordSize - (sizeof(recordHeader) + sizeof(header) + header.BodySize);
+    std::memset(record + recordSize - paddingSize, 0, paddingSize);
+
+    _tail += recordSize;
+}
+
+void PreTriggerRing::dump(const std::string &path)
+{
+    const auto triggerTime = Clock::now();
+
+    // Opening the file and joining the last dump thread happen outside the
+    // lock push() takes, so the receive thread never waits on either.
+    std::lock_guard<std::mutex> dumpLock(_dumpMutex);
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(not _dumpPath.empty())
+            throw std::runtime_error("Pre-trigger dump already in progress: "+_dumpPath);
+    }
+
+    // The last dump thread clears the path as the last thing it does, so
+    // this doesn't wait on anything.
+    if(_dumpThread.joinable())
+        _dumpThread.join();
+
+    // Open it here, so a bad path throws to the caller.
+    std::unique_ptr<AsyncFileWriter> file(new AsyncFileWriter(path));
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _dumpFile = std::move(file);
+        _dumpPath = path;
+        _triggerTime = triggerTime;
+    }
+
+    _dumpThread = std::thread(&PreTriggerRing::dumpWorker, this);
+}
+
+std::string PreTriggerRing::dumpPath(void)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _dumpPath;
+}
+
+uint64_t PreTriggerRing::dropped(void)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _dropped;
+}
+
+uint64_t PreTriggerRing::recordSpan(const uint64_t position, CaptureRecordHeader &recordHeader) const
+{
+    const uint64_t offset = position % _size;
+    const uint64_t tail = _size - offset;
+
+    recordHeader = CaptureRecordHeader{0, 0, 0};
+    if(tail >= sizeof(recordHeader))
+        std::memcpy(&recordHeader, _data + offset, sizeof(recordHeader));
+
+    return (recordHeader.recordSize == 0) ? tail : recordHeader.recordSize;
+}
+
+//
+// Dump thread
+//
+
+void PreTriggerRing::dumpWorker(void)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    // Keep filling the ring until the post-trigger time is up.
+    const auto endTime = _triggerTime + _postDuration;
+    _cond.wait_until(lock, endTime, [this]{ return _stop; });
+
+    // From here on, pushes only reuse space the dump is done with.
+    _dumping = true;
+    _dumpPosition = _head;
+
+    const uint64_t firstNs = elapsedNs(_startTime, _triggerTime - _preDuration);
+    const uint64_t lastNs = elapsedNs(_startTime, endTime);
+    const uint64_t tail = _tail;
+    uint64_t position = _head;
+
+    // Pushes may replace these while the file is written.
+    const bool hasDeviceInfo = _hasDeviceInfo;
+    const bool hasClientSync = _hasClientSync;
+    const auto deviceInfoHeader = _deviceInfoHeader;
+    const auto clientSyncHeader = _clientSyncHeader;
+    const auto deviceInfo = _deviceInfo;
+    const auto clientSync = _clientSync;
+
+    std::unique_ptr<AsyncFileWriter> file(std::move(_dumpFile));
+
+    // Nothing before the tail changes until the dump position passes it.
+    lock.unlock();
+
+    const auto releaseTo = [this](const uint64_t released)
+    {
+        std::lock_guard<std::mutex> releaseLock(_mutex);
+        _dumpPosition = released;
+    };
+
+    CaptureRecordHeader recordHeader;
+    while(position < tail)
+    {
+        const uint64_t span = this->recordSpan(position, recordHeader);
+        if((recordHeader.recordSize > 0) and (recordHeader.arrivalNs >= firstNs))
+            break;
+
+        position += span;
+    }
+    releaseTo(position);
+
+    CaptureFileHeader fileHeader;
+    std::memcpy(fileHeader.magic, CaptureMagic, sizeof(fileHeader.magic));
+    fileHeader.version = CaptureVersion;
+    fileHeader.headerSize = sizeof(CaptureFileHeader);
+    fileHeader.startTimeNs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count()) - elapsedNs(_startTime, Clock::now());
+
+    bool ok = file->writeAll(&fileHeader, sizeof(fileHeader));
+
+    // Replays need these before any IQ, and they may have been evicted.
+    const uint64_t statusNs = (position < tail) ? recordHeader.arrivalNs : firstNs;
+    if(ok and hasDeviceInfo)
+        ok = writeStatusRecord(*file, statusNs, deviceInfoHeader, &deviceInfo);
+    if(ok and hasClientSync)
+        ok = writeStatusRecord(*file, statusNs, clientSyncHeader, &clientSync);
+
+    // Written in slices of contiguous runs, broken at wrap markers and the
+    // end of the buffer.
+    const auto writeRun = [&](const uint64_t from, const uint64_t to)
+    {
+        for(uint64_t start = from; ok and (start < to); start += DumpSliceSize)
+        {
+            const uint64_t end = std::min(to, start + DumpSliceSize);
+            ok = file->writeAll(_data + (start % _size), end - start);
+            releaseTo(end);
+        }
+    };
+
+    uint64_t runStart = position;
+    while(ok and (position < tail))
+    {
+        if(((position % _size) == 0) and (position > runStart))
+        {
+            writeRun(runStart, position);
+            runStart = position;
+            continue;
+        }
+
+        const uint64_t span = this->recordSpan(position, recordHeader);
+        if(recordHeader.recordSize == 0)
+        {
+            writeRun(runStart, position);
+            position += span;
+            runStart = position;
+            continue;
+        }
+
+        if(recordHeader.arrivalNs > lastNs)
+            break;
+
+        position += span;
+    }
+    writeRun(runStart, position);
+
+    const std::string path = file->path();
+
+    // Flushes everything to disk.
+    file.reset();
+
+    if(ok)
+        SoapySDR::logf(SOAPY_SDR_INFO, "Wrote pre-trigger dump to %s", path.c_str());
+    else
+        SoapySDR::logf(SOAPY_SDR_ERROR, "Failed to write pre-trigger dump to %s", path.c_str());
+
+    // The ring keeps its history, for the next trigger.
+    lock.lock();
+    _dumping = false;
+    _dumpPath.clear();
+}
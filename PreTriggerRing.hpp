@@ -0,0 +1,110 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include "SessionCapture.hpp"
+
+#include <spyserver_protocol.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+//
+// Keeps the most recent messages in a preallocated ring, as capture
+// records, so the time before a trigger can be saved after the fact.
+//
+// Dumping writes everything from the last preSeconds before the trigger
+// through postSeconds after it as a capture file, which replays like any
+// other. The file is written from its own thread. Meanwhile, messages keep
+// arriving into space the dump has already written out, and any that don't
+// fit are dropped and counted.
+//
+// The memory is backed by huge pages where available, and touched up front,
+// so the receive thread never takes a page fault copying into it.
+//
+class PreTriggerRing
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    PreTriggerRing(const size_t size, const double preSeconds, const double postSeconds);
+    ~PreTriggerRing(void);
+
+    void push(
+        const Clock::time_point &arrivalTime,
+        const SpyServerMessageHeader &header,
+        const uint8_t *body);
+
+    // Throws if a dump is already in progress.
+    void dump(const std::string &path);
+
+    // Empty once the last dump is written.
+    std::string dumpPath(void);
+
+    // Messages with no room while a dump held onto the ring.
+    uint64_t dropped(void);
+
+    inline size_t size(void) const noexcept
+    {
+        return _size;
+    }
+
+    inline bool hugePages(void) const noexcept
+    {
+        return _hugePages;
+    }
+
+private:
+    void dumpWorker(void);
+
+    // The size of the record at the position, or of the gap to the start if
+    // it's a wrap marker, in which case the record size is zero.
+    uint64_t recordSpan(const uint64_t position, CaptureRecordHeader &recordHeader) const;
+
+    size_t _size{0};
+    uint8_t *_data{nullptr};
+    bool _hugePages{false};
+
+    Clock::duration _preDuration;
+    Clock::duration _postDuration;
+    Clock::time_point _startTime;
+
+    // Guards everything below.
+    std::mutex _mutex;
+    std::condition_variable _cond;
+
+    // In bytes since the ring was last emptied. Records never wrap; a
+    // record size of zero, or too little room left for a header, means
+    // the next one is at the start.
+    uint64_t _head{0};
+    uint64_t _tail{0};
+
+    // The latest of each, so a dump can start with them.
+    bool _hasDeviceInfo{false};
+    bool _hasClientSync{false};
+    SpyServerMessageHeader _deviceInfoHeader;
+    SpyServerMessageHeader _clientSyncHeader;
+    SpyServerDeviceInfo _deviceInfo;
+    SpyServerClientSync _clientSync;
+
+    // While dumping, nothing from the dump position on can be evicted.
+    bool _dumping{false};
+    uint64_t _dumpPosition{0};
+    uint64_t _dropped{0};
+
+    bool _stop{false};
+    std::string _dumpPath;
+    std::unique_ptr<AsyncFileWriter> _dumpFile;
+    Clock::time_point _triggerTime;
+
+    // Serializes dump() callers, outside the lock push() takes.
+    std::mutex _dumpMutex;
+    std::thread _dumpThread;
+};
@@ -3,6 +3,7 @@
 
 #include "spyserver_client.h"
 
+#include "ConnectionCache.hpp"
 #include "SoapySpyServerClient.hpp"
 
 #include <SoapySDR/Registry.hpp>
@@ -10,6 +11,7 @@
 #include <SoapySDR/Version.hpp>
 
 #include <cassert>
+#include <utility>
 
 /***********************************************************************
  * Find
@@ -20,21 +22,42 @@ static std::vector<SoapySDR::Kwargs> findSpyServerClient(const SoapySDR::Kwargs
 
     try
     {
-        const auto client = SoapySpyServerClient::makeSDRPPClient(args);
-        assert(args.count("host"));
-        assert(args.count("port"));
-        assert(client.client);
-        assert(client.client->isOpen());
+        const bool local = args.count("replay") or args.count("attach");
+        const auto url = local ? std::string() : SoapySpyServerClient::ParamsToSpyServerURL(args.at("host"), args.at("port"));
+
+        // Only connect if we haven't just seen this server. Otherwise, leave
+        // the connection for make() to pick up, if it would.
+        SpyServerDeviceInfo devInfo;
+        if(local or not ConnectionCache::instance().getDeviceInfo(url, devInfo))
+        {
+            auto session = SoapySpyServerClient::makeSession(SoapySpyServerClient::probeArgs(args));
+            assert(session);
+            assert(session->isOpen());
+
+            devInfo = session->client().devInfo;
+            if(SoapySpyServerClient::takesParkedConnection(args))
+                ConnectionCache::instance().park(url, session->release());
+        }
 
         results.emplace_back();
         auto &result = results.front();
 
-        const auto &devInfo = client.client->devInfo;
-        result["host"] = args.at("host");
-        result["port"] = args.at("port");
+        if(args.count("replay"))
+        {
+            result["replay"] = args.at("replay");
+            if(args.count("replay_mode"))
+                result["replay_mode"] = args.at("replay_mode");
+        }
+        else if(args.count("attach"))
+            result["attach"] = args.at("attach");
+        else
+        {
+            result["host"] = args.at("host");
+            result["port"] = args.at("port");
+            result["url"] = url;
+        }
         result["device"] = SoapySpyServerClient::DeviceEnumToName(devInfo.DeviceType);
         result["serial"] = std::to_string(devInfo.DeviceSerial);
-        result["url"] = SoapySpyServerClient::ParamsToSpyServerURL(args.at("host"), args.at("port"));
     }
     catch(...){ results.clear(); }
 
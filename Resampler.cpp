@@ -0,0 +1,174 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "FilterDesign.hpp"
+#include "Resampler.hpp"
+
+#include <volk/volk.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <stdexcept>
+
+//
+// Non-class utility
+//
+
+// Taps per phase needed for a transition band 10% as wide as the
+// narrower of the input and output bands, with a Blackman window.
+static constexpr double BaseTapsPerPhase = 55.0;
+
+// Cutoff relative to the narrower band, centered in the transition band.
+static constexpr double PassbandFraction = 0.45;
+
+static size_t greatestCommonDivisor(size_t a, size_t b)
+{
+    while(b != 0)
+    {
+        const size_t remainder = a % b;
+        a = b;
+        b = remainder;
+    }
+
+    return a;
+}
+
+//
+// Static utility functions
+//
+
+std::pair<size_t, size_t> PolyphaseResampler::RationalApproximation(
+    const double ratio,
+    const size_t maxInterpolation)
+{
+    if((ratio <= 0.0) or not std::isfinite(ratio))
+        throw std::invalid_argument("Invalid resampling ratio");
+
+    // Walk the continued fraction expansion, keeping the last convergent
+    // whose numerator fits.
+    size_t prevNum = 0, num = 1;
+    size_t prevDen = 1, den = 0;
+    double remainder = ratio;
+
+    for(size_t i = 0; i < 64; ++i)
+    {
+        const auto term = static_cast<size_t>(std::floor(remainder));
+        const size_t nextNum = (term * num) + prevNum;
+        const size_t nextDen = (term * den) + prevDen;
+        if(nextNum > maxInterpolation)
+            break;
+        if((nextNum > 0) and ((TapsPerPhase(nextNum, nextDen) * nextNum) > MaxPrototypeTaps))
+            break;
+
+        prevNum = num; num = nextNum;
+        prevDen = den; den = nextDen;
+
+        const double fraction = remainder - static_cast<double>(term);
+        if(fraction < 1e-9)
+            break;
+
+        remainder = 1.0 / fraction;
+    }
+
+    if((num == 0) or (den == 0))
+        throw std::invalid_argument("Unsupported resampling ratio");
+
+    const auto divisor = greatestCommonDivisor(num, den);
+    return std::make_pair(num / divisor, den / divisor);
+}
+
+size_t PolyphaseResampler::TapsPerPhase(const size_t interpolation, const size_t decimation)
+{
+    const double decimationRatio = std::max(1.0, static_cast<double>(decimation) / interpolation);
+    return static_cast<size_t>(std::ceil(BaseTapsPerPhase * decimationRatio));
+}
+
+//
+// Construction
+//
+
+PolyphaseResampler::PolyphaseResampler(const size_t interpolation, const size_t decimation):
+    _interpolation(interpolation),
+    _decimation(decimation)
+{
+    if((_interpolation == 0) or (_decimation == 0))
+        throw std::invalid_argument("Resampling factors must be non-zero");
+    if(_interpolation > MaxInterpolation)
+        throw std::invalid_argument("Interpolation factor too large");
+
+    _tapsPerPhase = TapsPerPhase(_interpolation, _decimation);
+    if((_tapsPerPhase * _interpolation) > MaxPrototypeTaps)
+        throw std::invalid_argument("Resampling factors need too long a filter");
+
+    // Normalized to the interpolated rate, with unity gain per phase.
+    const auto prototype = designLowpassTaps(
+        _tapsPerPhase * _interpolation,
+        PassbandFraction / static_cast<double>(std::max(_interpolation, _decimation)),
+        static_cast<double>(_interpolation));
+
+    _phaseTaps.resize(_interpolation);
+    for(size_t phase = 0; phase < _interpolation; ++phase)
+    {
+        auto &taps = _phaseTaps[phase];
+        taps.resize(_tapsPerPhase);
+
+        for(size_t j = 0; j < _tapsPerPhase; ++j)
+            taps[j] = prototype[phase + ((_tapsPerPhase - 1 - j) * _interpolation)];
+    }
+
+    this->reset();
+}
+
+//
+// DSP
+//
+
+void PolyphaseResampler::process(
+    const dsp::complex_t *input,
+    const size_t numInput,
+    volk::vector<dsp::complex_t> &output)
+{
+    assert(input or (numInput == 0));
+
+    const size_t historySize = _tapsPerPhase - 1;
+    assert(_workBuffer.size() >= historySize);
+
+    _workBuffer.resize(historySize + numInput);
+    std::copy(input, input + numInput, _workBuffer.begin() + historySize);
+
+    const size_t inputPositions = numInput * _interpolation;
+    const size_t maxOutput = (inputPositions > _position)
+                           ? (((inputPositions - _position) + _decimation - 1) / _decimation)
+                           : 0;
+    output.resize(maxOutput);
+
+    size_t numOutput = 0;
+    for(; _position < inputPositions; _position += _decimation)
+    {
+        const size_t index = _position / _interpolation;
+        const size_t phase = _position % _interpolation;
+
+        volk_32fc_32f_dot_prod_32fc(
+            reinterpret_cast<lv_32fc_t*>(&output[numOutput++]),
+            reinterpret_cast<const lv_32fc_t*>(&_workBuffer[index]),
+            _phaseTaps[phase].data(),
+            static_cast<unsigned int>(_tapsPerPhase));
+    }
+    assert(numOutput == maxOutput);
+
+    _position -= inputPositions;
+
+    // Keep the most recent input as history for the next block.
+    std::copy(
+        _workBuffer.end() - historySize,
+        _workBuffer.end(),
+        _workBuffer.begin());
+    _workBuffer.resize(historySize);
+}
+
+void PolyphaseResampler::reset(void)
+{
+    _workBuffer.assign(_tapsPerPhase - 1, dsp::complex_t{0.0f, 0.0f});
+    _position = 0;
+}
@@ -0,0 +1,73 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <dsp/types.h>
+
+#include <volk/volk_alloc.hh>
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+//
+// Rational (L/M) resampler implemented as a polyphase filter bank. Each
+// output sample is a single VOLK dot product between the input history
+// and one phase of the prototype lowpass filter, so only the outputs
+// we keep are ever computed.
+//
+class PolyphaseResampler
+{
+public:
+    static constexpr size_t MaxInterpolation = 1024;
+
+    // The prototype filter grows with max(L, M), so ratios that only reduce
+    // to large factors (384/625 would need ~35k taps) are approximated by
+    // smaller ones instead.
+    static constexpr size_t MaxPrototypeTaps = 16384;
+
+    PolyphaseResampler(const size_t interpolation, const size_t decimation);
+    ~PolyphaseResampler(void) = default;
+
+    // Returns the (L, M) pair whose ratio best approximates the given
+    // ratio without exceeding the given interpolation or MaxPrototypeTaps.
+    static std::pair<size_t, size_t> RationalApproximation(
+        const double ratio,
+        const size_t maxInterpolation = MaxInterpolation);
+
+    static size_t TapsPerPhase(const size_t interpolation, const size_t decimation);
+
+    inline size_t interpolation(void) const noexcept
+    {
+        return _interpolation;
+    }
+
+    inline size_t decimation(void) const noexcept
+    {
+        return _decimation;
+    }
+
+    void process(
+        const dsp::complex_t *input,
+        const size_t numInput,
+        volk::vector<dsp::complex_t> &output);
+
+    void reset(void);
+
+private:
+    size_t _interpolation{1};
+    size_t _decimation{1};
+    size_t _tapsPerPhase{0};
+
+    // One time-reversed set of taps per phase, so each output is a
+    // dot product over contiguous input.
+    std::vector<volk::vector<float>> _phaseTaps;
+
+    // The last (_tapsPerPhase-1) input samples, followed by the current input.
+    volk::vector<dsp::complex_t> _workBuffer;
+
+    // Position of the next output, in units of 1/L input samples,
+    // relative to the start of the next input block.
+    size_t _position{0};
+};
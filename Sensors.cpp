@@ -0,0 +1,367 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "spyserver_client.h"
+
+#include "SoapySpyServerClient.hpp"
+
+#include <SoapySDR/Types.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+
+/*******************************************************************
+ * Utility
+ ******************************************************************/
+
+// Sum of a counter over every window's connection. Windows not yet
+// connected are skipped.
+static uint64_t sumOverWindows(
+    const std::vector<SoapySpyServerWindow> &windows,
+    std::atomic<uint64_t> StreamStatistics::*counter)
+{
+    uint64_t sum = 0;
+    for(const auto &window: windows)
+    {
+        if(window.session)
+            sum += StreamStatistics::get(window.session->stats().*counter);
+    }
+
+    return sum;
+}
+
+// Percentiles over every window's frames.
+static std::string latencySummary(
+    const std::vector<SoapySpyServerWindow> &windows,
+    LatencyHistogram StreamStatistics::*histogram)
+{
+    LatencyHistogram merged;
+    for(const auto &window: windows)
+    {
+        if(window.session)
+            merged.add(window.session->stats().*histogram);
+    }
+
+    return merged.summary();
+}
+
+void SoapySpyServerClient::updateSensorWindow(void) const
+{
+    const auto now = std::chrono::steady_clock::now();
+    const double elapsed = std::chrono::duration<double>(now - _sensorWindow.start).count();
+
+    // Until the first window closes, report averages since connecting.
+    if((elapsed <= 0.0) or (_sensorWindow.complete and (elapsed < SensorWindowSeconds)))
+        return;
+
+    const auto bytesReceived = sumOverWindows(_windows, &StreamStatistics::bytesReceived);
+    const auto messagesReceived = sumOverWindows(_windows, &StreamStatistics::messagesReceived);
+    const auto messagesDecoded = sumOverWindows(_windows, &StreamStatistics::messagesDecoded);
+    const auto decodeTimeNs = sumOverWindows(_windows, &StreamStatistics::decodeTimeNs);
+
+    // With several windows, each reports the one poll engine thread's time
+    // since it first handled that window, so summing would count it again.
+    // The largest covers the most.
+    uint64_t socketThreadCPUTimeNs = 0;
+    for(const auto &window: _windows)
+    {
+        if(window.session)
+            socketThreadCPUTimeNs = std::max(socketThreadCPUTimeNs, StreamStatistics::get(window.session->stats().socketThreadCPUTimeNs));
+    }
+
+    auto &window = _sensorWindow;
+    const auto numDecoded = messagesDecoded - window.messagesDecoded;
+
+    window.byteRate = double(bytesReceived - window.bytesReceived) / elapsed;
+    window.messageRate = double(messagesReceived - window.messagesReceived) / elapsed;
+    window.decodeTimeUs = (numDecoded > 0) ? (double(decodeTimeNs - window.decodeTimeNs) / (1e3 * numDecoded)) : 0.0;
+    window.socketThreadCPUPercent = double(socketThreadCPUTimeNs - window.socketThreadCPUTimeNs) / (1e7 * elapsed);
+
+    if(elapsed >= SensorWindowSeconds)
+    {
+        window.start = now;
+        window.complete = true;
+        window.bytesReceived = bytesReceived;
+        window.messagesReceived = messagesReceived;
+        window.messagesDecoded = messagesDecoded;
+        window.decodeTimeNs = decodeTimeNs;
+        window.socketThreadCPUTimeNs = socketThreadCPUTimeNs;
+    }
+}
+
+/*******************************************************************
+ * Sensor API
+ ******************************************************************/
+
+std::vector<std::string> SoapySpyServerClient::listSensors(void) const
+{
+    return
+    {
+        "retune_latency",
+        "rx_byte_rate",
+        "rx_message_rate",
+        "queue_depth",
+        "queue_high_water",
+        "overflow_count",
+        "drop_count",
+        "sequence_gaps",
+        "stall_restarts",
+        "reconnects",
+        "decode_time",
+        "socket_thread_cpu",
+        "latency_decode",
+        "latency_dsp",
+        "latency_queue",
+        "latency_total",
+        "record_backlog",
+        "record_dropped",
+        "record_written",
+        "pretrigger_dropped"
+    };
+}
+
+SoapySDR::ArgInfo SoapySpyServerClient::getSensorInfo(const std::string &key) const
+{
+    SoapySDR::ArgInfo info;
+    info.key = key;
+
+    if(key == "retune_latency")
+    {
+        info.name = "Retune latency";
+        info.description = "Time from the last retune to its first valid samples, or -1 if still pending. With several windows, the slowest.";
+        info.units = "ms";
+        info.type = SoapySDR::ArgInfo::FLOAT;
+    }
+    else if(key == "rx_byte_rate")
+    {
+        info.name = "Receive rate";
+        info.description = "Bytes received from the server over every window, including headers and non-IQ messages.";
+        info.units = "B/s";
+        info.type = SoapySDR::ArgInfo::FLOAT;
+    }
+    else if(key == "rx_message_rate")
+    {
+        info.name = "Message rate";
+        info.description = "Messages received from the server over every window, of all types.";
+        info.units = "messages/s";
+        info.type = SoapySDR::ArgInfo::FLOAT;
+    }
+    else if(key == "queue_depth")
+    {
+        info.name = "Queue depth";
+        info.description = "Decoded buffers waiting to be read, in the most backed up active stream.";
+        info.units = "buffers";
+        info.type = SoapySDR::ArgInfo::INT;
+    }
+    else if(key == "queue_high_water")
+    {
+        info.name = "Queue high-water mark";
+        info.description = "Most decoded buffers ever waiting to be read, in any open stream.";
+        info.units = "buffers";
+        info.type = SoapySDR::ArgInfo::INT;
+    }
+    else if(key == "overflow_count")
+    {
+        info.name = "Overflow count";
+        info.description = "Decoded buffers discarded because a stream's queue was full, summed over open streams.";
+        info.units = "buffers";
+        info.type = SoapySDR::ArgInfo::INT;
+    }
+    else if(key == "drop_count")
+    {
+        info.name = "Drop count";
+        info.description = "IQ messages discarded before decoding finished, such as those in flight across a retune, summed over windows.";
+        info.units = "messages";
+        info.type = SoapySDR::ArgInfo::INT;
+    }
+    else if(key == "sequence_gaps")
+    {
+        info.name = "Sequence gaps";
+        info.description = "Messages missing from the server's sequence numbers, i.e. dropped by the server, summed over windows.";
+        info.units = "messages";
+        info.type = SoapySDR::ArgInfo::INT;
+    }
+    else if(key == "stall_restarts")
+    {
+        info.name = "Stall restarts";
+        info.description = "Times the watchdog re-enabled streaming after IQ stopped arriving, summed over windows.";
+        info.units = "events";
+        info.type = SoapySDR::ArgInfo::INT;
+    }
+    else if(key == "reconnects")
+    {
+        info.name = "Reconnects";
+        info.description = "Times the watchdog replaced a connection after restarting the stream didn't help, summed over windows.";
+        info.units = "events";
+        info.type = SoapySDR::ArgInfo::INT;
+    }
+    else if(key == "decode_time")
+    {
+        info.name = "Decode time";
+        info.description = "Mean time to decode one IQ message.";
+        info.units = "us";
+        info.type = SoapySDR::ArgInfo::FLOAT;
+    }
+    else if(key == "socket_thread_cpu")
+    {
+        info.name = "Socket thread CPU";
+        info.description = "CPU used by the thread receiving and decoding messages.";
+        info.units = "%";
+        info.type = SoapySDR::ArgInfo::FLOAT;
+    }
+    else if(key == "latency_decode")
+    {
+        info.name = "Decode latency";
+        info.description = "Percentiles of the time from a message arriving to its samples being decoded.";
+        info.units = "us";
+        info.type = SoapySDR::ArgInfo::STRING;
+    }
+    else if(key == "latency_dsp")
+    {
+        info.name = "DSP latency";
+        info.description = "Percentiles of the time from decoding to queueing, including any mixing, resampling and channelization.";
+        info.units = "us";
+        info.type = SoapySDR::ArgInfo::STRING;
+    }
+    else if(key == "latency_queue")
+    {
+        info.name = "Queue latency";
+        info.description = "Percentiles of the time decoded samples wait in the queue for readStream.";
+        info.units = "us";
+        info.type = SoapySDR::ArgInfo::STRING;
+    }
+    else if(key == "latency_total")
+    {
+        info.name = "Total latency";
+        info.description = "Percentiles of the time from a message arriving to readStream returning its first samples.";
+        info.units = "us";
+        info.type = SoapySDR::ArgInfo::STRING;
+    }
+    else if(key == "record_backlog")
+    {
+        info.name = "Recording backlog";
+        info.description = "Recorded data waiting to be written to disk, or 0 if not recording.";
+        info.units = "B";
+        info.type = SoapySDR::ArgInfo::INT;
+    }
+    else if(key == "record_dropped")
+    {
+        info.name = "Recording drops";
+        info.description = "Messages left out of the recording because the disk fell behind or failed.";
+        info.units = "messages";
+        info.type = SoapySDR::ArgInfo::INT;
+    }
+    else if(key == "record_written")
+    {
+        info.name = "Recording size";
+        info.description = "Bytes written to the current recording.";
+        info.units = "B";
+        info.type = SoapySDR::ArgInfo::INT;
+    }
+    else if(key == "pretrigger_dropped")
+    {
+        info.name = "Pre-trigger drops";
+        info.description = "Messages left out of the pre-trigger ring because a dump still needed the space.";
+        info.units = "messages";
+        info.type = SoapySDR::ArgInfo::INT;
+    }
+    else throw std::invalid_argument("Invalid sensor: "+key);
+
+    return info;
+}
+
+std::string SoapySpyServerClient::readSensor(const std::string &key) const
+{
+    // With several windows, counters and latencies cover all of them.
+    this->ensureConnected();
+
+    if(key == "retune_latency")
+    {
+        int64_t latencyUs = 0;
+        for(const auto &window: _windows)
+        {
+            if(not window.session)
+                continue;
+
+            const auto windowLatencyUs = window.session->pipeline().retuneLatencyUs();
+            if(windowLatencyUs < 0)
+                return SoapySDR::SettingToString(-1.0);
+
+            latencyUs = std::max(latencyUs, windowLatencyUs);
+        }
+
+        return SoapySDR::SettingToString(latencyUs / 1e3);
+    }
+    else if((key == "queue_depth") or (key == "queue_high_water") or (key == "overflow_count"))
+    {
+        std::lock_guard<std::mutex> lock(_streamMutex);
+
+        size_t depth = 0;
+        size_t highWater = 0;
+        size_t numDropped = 0;
+        for(const auto &stream: _streams)
+        {
+            if(stream->active)
+                depth = std::max(depth, stream->queue->size());
+            highWater = std::max(highWater, stream->queue->highWater());
+            numDropped += stream->queue->numDropped();
+        }
+
+        if(key == "queue_depth")
+            return SoapySDR::SettingToString(depth);
+        else if(key == "queue_high_water")
+            return SoapySDR::SettingToString(highWater);
+        else
+            return SoapySDR::SettingToString(numDropped);
+    }
+    else if(key == "drop_count")
+        return SoapySDR::SettingToString(sumOverWindows(_windows, &StreamStatistics::messagesDropped));
+    else if(key == "sequence_gaps")
+        return SoapySDR::SettingToString(sumOverWindows(_windows, &StreamStatistics::sequenceGaps));
+    else if(key == "stall_restarts")
+        return SoapySDR::SettingToString(sumOverWindows(_windows, &StreamStatistics::streamRestarts));
+    else if(key == "reconnects")
+        return SoapySDR::SettingToString(sumOverWindows(_windows, &StreamStatistics::reconnects));
+    else if(key == "latency_decode")
+        return latencySummary(_windows, &StreamStatistics::decodeLatency);
+    else if(key == "latency_dsp")
+        return latencySummary(_windows, &StreamStatistics::dspLatency);
+    else if(key == "latency_queue")
+        return latencySummary(_windows, &StreamStatistics::queueLatency);
+    else if(key == "latency_total")
+        return latencySummary(_windows, &StreamStatistics::totalLatency);
+    else if((key == "record_backlog") or (key == "record_dropped") or (key == "record_written"))
+    {
+        // Only one stream on the device records.
+        std::shared_ptr<CaptureWriter> recording;
+        for(const auto &window: _windows)
+        {
+            if(not recording)
+                recording = window.session->currentRecording();
+        }
+
+        if(not recording)
+            return "0";
+        else if(key == "record_backlog")
+            return SoapySDR::SettingToString(recording->file().backlog());
+        else if(key == "record_dropped")
+            return SoapySDR::SettingToString(recording->file().recordsDropped());
+        else
+            return SoapySDR::SettingToString(recording->file().bytesWritten());
+    }
+    else if(key == "pretrigger_dropped")
+        return SoapySDR::SettingToString(_preTrigger ? _preTrigger->dropped() : 0);
+
+    std::lock_guard<std::mutex> lock(_sensorMutex);
+    this->updateSensorWindow();
+
+    if(key == "rx_byte_rate")
+        return SoapySDR::SettingToString(_sensorWindow.byteRate);
+    else if(key == "rx_message_rate")
+        return SoapySDR::SettingToString(_sensorWindow.messageRate);
+    else if(key == "decode_time")
+        return SoapySDR::SettingToString(_sensorWindow.decodeTimeUs);
+    else if(key == "socket_thread_cpu")
+        return SoapySDR::SettingToString(_sensorWindow.socketThreadCPUPercent);
+    else throw std::invalid_argument("Invalid sensor: "+key);
+}
@@ -0,0 +1,171 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "SessionCapture.hpp"
+
+#include <SoapySDR/Logger.hpp>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cstring>
+#include <stdexcept>
+
+/*******************************************************************
+ * CaptureWriter
+ ******************************************************************/
+
+CaptureWriter::CaptureWriter(const std::string &path, const bool direct):
+    _file(new AsyncFileWriter(path, direct))
+{
+    CaptureFileHeader fileHeader;
+    std::memcpy(fileHeader.magic, CaptureMagic, sizeof(fileHeader.magic));
+    fileHeader.version = CaptureVersion;
+    fileHeader.headerSize = sizeof(CaptureFileHeader);
+    fileHeader.startTimeNs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+
+    _startTime = Clock::now();
+
+    // Nothing has been queued yet, so this can't be dropped.
+    _file->write({{&fileHeader, sizeof(fileHeader)}});
+}
+
+bool CaptureWriter::write(
+    const Clock::time_point &arrivalTime,
+    const SpyServerMessageHeader &header,
+    const uint8_t *body)
+{
+    static const uint8_t padding[CaptureRecordAlignment] = {0};
+
+    CaptureRecordHeader recordHeader;
+    recordHeader.arrivalNs = (arrivalTime > _startTime)
+        ? static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(arrivalTime - _startTime).count())
+        : 0;
+    recordHeader.recordSize = static_cast<uint32_t>(captureRecordSize(header.BodySize));
+    recordHeader.reserved = 0;
+
+    const size_t paddingSize = recordHeader.recordSize - (sizeof(recordHeader) + sizeof(header) + header.BodySize);
+
+    return _file->write({
+        {&recordHeader, sizeof(recordHeader)},
+        {&header, sizeof(header)},
+        {body, header.BodySize},
+        {padding, paddingSize}});
+}
+
+/*******************************************************************
+ * CaptureReader
+ ******************************************************************/
+
+CaptureReader::CaptureReader(const std::string &path):
+    _path(path)
+{
+#ifdef _WIN32
+    _fileHandle = CreateFileA(_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if(_fileHandle == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Failed to open capture file: "+_path);
+
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(_fileHandle, &fileSize);
+    _size = static_cast<size_t>(fileSize.QuadPart);
+
+    if(_size > 0)
+    {
+        _mappingHandle = CreateFileMappingA(_fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if(_mappingHandle)
+            _data = static_cast<const uint8_t*>(MapViewOfFile(_mappingHandle, FILE_MAP_READ, 0, 0, 0));
+    }
+#else
+    const int fd = ::open(_path.c_str(), O_RDONLY);
+    if(fd < 0)
+        throw std::runtime_error("Failed to open capture file: "+_path);
+
+    struct stat fileStat;
+    if(::fstat(fd, &fileStat) == 0)
+        _size = static_cast<size_t>(fileStat.st_size);
+
+    if(_size > 0)
+    {
+        void *mapping = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(mapping != MAP_FAILED)
+        {
+            _data = static_cast<const uint8_t*>(mapping);
+            ::madvise(mapping, _size, MADV_SEQUENTIAL);
+        }
+    }
+    ::close(fd);
+#endif
+
+    if(not _data or (_size < sizeof(CaptureFileHeader)))
+    {
+        this->unmap();
+        throw std::runtime_error("Failed to map capture file: "+_path);
+    }
+
+    std::memcpy(&_fileHeader, _data, sizeof(_fileHeader));
+    if(std::memcmp(_fileHeader.magic, CaptureMagic, sizeof(CaptureMagic)) or (_fileHeader.version != CaptureVersion))
+    {
+        this->unmap();
+        throw std::runtime_error("Not a SpyServer capture: "+_path);
+    }
+
+    this->rewind();
+}
+
+CaptureReader::~CaptureReader(void)
+{
+    this->unmap();
+}
+
+void CaptureReader::unmap(void)
+{
+#ifdef _WIN32
+    if(_data) UnmapViewOfFile(_data);
+    if(_mappingHandle) CloseHandle(_mappingHandle);
+    if(_fileHandle and (_fileHandle != INVALID_HANDLE_VALUE)) CloseHandle(_fileHandle);
+    _mappingHandle = nullptr;
+    _fileHandle = nullptr;
+#else
+    if(_data) ::munmap(const_cast<uint8_t*>(_data), _size);
+#endif
+    _data = nullptr;
+}
+
+bool CaptureReader::next(Record &record)
+{
+    if(_offset >= _size)
+        return false;
+
+    const size_t prefixSize = sizeof(CaptureRecordHeader) + sizeof(SpyServerMessageHeader);
+    if((_size - _offset) < prefixSize)
+        throw std::runtime_error("Truncated capture record in "+_path);
+
+    CaptureRecordHeader recordHeader;
+    std::memcpy(&recordHeader, _data + _offset, sizeof(recordHeader));
+    std::memcpy(&record.header, _data + _offset + sizeof(recordHeader), sizeof(record.header));
+
+    if((record.header.BodySize > SPYSERVER_MAX_MESSAGE_BODY_SIZE)
+       or (recordHeader.recordSize != captureRecordSize(record.header.BodySize))
+       or ((_size - _offset) < recordHeader.recordSize))
+    {
+        throw std::runtime_error("Corrupt capture record in "+_path);
+    }
+
+    record.arrivalNs = recordHeader.arrivalNs;
+    record.body = _data + _offset + prefixSize;
+    _offset += recordHeader.recordSize;
+
+    return true;
+}
+
+void CaptureReader::rewind(void)
+{
+    _offset = _fileHeader.headerSize;
+}
@@ -0,0 +1,136 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include "AsyncFileWriter.hpp"
+
+#include <spyserver_protocol.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+//
+// A capture is every message a server sent in one session, as framed on
+// the wire, with its arrival time:
+//
+//   CaptureFileHeader
+//   For each message:
+//     CaptureRecordHeader
+//     SpyServerMessageHeader
+//     Body
+//     Zero padding to a multiple of 8 bytes
+//
+// All fields are in host byte order, like the protocol itself.
+//
+
+struct CaptureFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+
+    // Wall clock time the capture started, in ns since the Unix epoch.
+    uint64_t startTimeNs;
+};
+
+struct CaptureRecordHeader
+{
+    // Since the capture started.
+    uint64_t arrivalNs;
+
+    // Including this header and padding.
+    uint32_t recordSize;
+    uint32_t reserved;
+};
+
+static constexpr char CaptureMagic[8] = {'S', 'P', 'Y', 'C', 'A', 'P', '\0', '\0'};
+static constexpr uint32_t CaptureVersion = 1;
+static constexpr size_t CaptureRecordAlignment = 8;
+
+// Size of a message's record, including headers and padding.
+inline size_t captureRecordSize(const uint32_t bodySize)
+{
+    const size_t size = sizeof(CaptureRecordHeader) + sizeof(SpyServerMessageHeader) + bodySize;
+
+    return ((size + CaptureRecordAlignment - 1) / CaptureRecordAlignment) * CaptureRecordAlignment;
+}
+
+//
+// Appends messages to a new capture file through an AsyncFileWriter, so
+// the receive thread only copies them. Messages that arrive while its
+// buffers are full, or after a write error, are dropped.
+//
+class CaptureWriter
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    CaptureWriter(const std::string &path, const bool direct = false);
+    ~CaptureWriter(void) = default;
+
+    // Returns false if the message was dropped.
+    bool write(
+        const Clock::time_point &arrivalTime,
+        const SpyServerMessageHeader &header,
+        const uint8_t *body);
+
+    inline const AsyncFileWriter &file(void) const noexcept
+    {
+        return *_file;
+    }
+
+private:
+    std::unique_ptr<AsyncFileWriter> _file;
+    Clock::time_point _startTime;
+};
+
+//
+// Memory-maps a capture file and walks its records in order, without
+// copying message bodies.
+//
+class CaptureReader
+{
+public:
+    struct Record
+    {
+        uint64_t arrivalNs;
+        SpyServerMessageHeader header;
+
+        // Points into the mapping, valid for the reader's lifetime.
+        const uint8_t *body;
+    };
+
+    CaptureReader(const std::string &path);
+    ~CaptureReader(void);
+
+    inline uint64_t startTimeNs(void) const noexcept
+    {
+        return _fileHeader.startTimeNs;
+    }
+
+    // Returns false at the end of the capture. Throws on a truncated or
+    // corrupt record.
+    bool next(Record &record);
+
+    void rewind(void);
+
+private:
+    void unmap(void);
+
+    std::string _path;
+
+    const uint8_t *_data{nullptr};
+    size_t _size{0};
+    size_t _offset{0};
+
+#ifdef _WIN32
+    void *_fileHandle{nullptr};
+    void *_mappingHandle{nullptr};
+#endif
+
+    CaptureFileHeader _fileHeader;
+};
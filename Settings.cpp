@@ -3,17 +3,23 @@
 
 #include "spyserver_client.h"
 
+#include "ConnectionCache.hpp"
 #include "SoapySpyServerClient.hpp"
 
 #include <SoapySDR/Constants.h>
 #include <SoapySDR/Formats.h>
+#include <SoapySDR/Formats.hpp>
 #include <SoapySDR/Logger.hpp>
 
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <iterator>
+#include <limits>
 #include <stdexcept>
+#include <vector>
 
 //
 // Non-class utility
@@ -25,12 +31,68 @@ static inline bool almostEqual(const double lhs, const double rhs)
     return (std::abs(lhs-rhs) <= EPSILON);
 }
 
+// Reads <prefix>_name, <prefix>_cpus, <prefix>_priority and <prefix>_nice.
+static ThreadConfig threadConfigFromArgs(
+    const SoapySDR::Kwargs &args,
+    const std::string &prefix,
+    const std::string &defaultName)
+{
+    ThreadConfig config;
+
+    const auto nameIter = args.find(prefix+"_name");
+    config.name = (nameIter != args.end()) ? nameIter->second : defaultName;
+
+    const auto cpusIter = args.find(prefix+"_cpus");
+    if(cpusIter != args.end())
+        config.cpus = parseCPUList(cpusIter->second);
+
+    const auto priorityIter = args.find(prefix+"_priority");
+    if(priorityIter != args.end())
+    {
+        config.realtimePriority = SoapySDR::StringToSetting<int>(priorityIter->second);
+        if((config.realtimePriority < 1) or (config.realtimePriority > 99))
+            throw std::invalid_argument("Invalid real-time priority: "+priorityIter->second);
+    }
+
+    const auto niceIter = args.find(prefix+"_nice");
+    if(niceIter != args.end())
+    {
+        config.setNice = true;
+        config.nice = SoapySDR::StringToSetting<int>(niceIter->second);
+        if((config.nice < -20) or (config.nice > 19))
+            throw std::invalid_argument("Invalid nice value: "+niceIter->second);
+    }
+
+    return config;
+}
+
+static size_t timeoutMsFromArgs(const SoapySDR::Kwargs &args)
+{
+    const auto timeoutIter = args.find("timeout_ms");
+    if(timeoutIter == args.end())
+        return SpyServerSession::DefaultTimeoutMs;
+
+    const auto timeoutMs = SoapySDR::StringToSetting<size_t>(timeoutIter->second);
+    if((timeoutMs == 0) or (timeoutMs > static_cast<size_t>(std::numeric_limits<int>::max())))
+        throw std::invalid_argument("Invalid timeout: "+timeoutIter->second);
+
+    return timeoutMs;
+}
+
 //
 // Static utility functions
 //
 
-SDRPPClient SoapySpyServerClient::makeSDRPPClient(const SoapySDR::Kwargs &args)
+std::unique_ptr<SpyServerSession> SoapySpyServerClient::makeSession(const SoapySDR::Kwargs &args, net::PollEngine pollEngine)
 {
+    const auto replayIter = args.find("replay");
+    if(replayIter != args.end())
+        return makeReplaySession(args);
+
+    const auto attachIter = args.find("attach");
+    if(attachIter != args.end())
+        return makeAttachSession(args);
+
     auto hostIter = args.find("host");
     if(hostIter == args.end())
         throw std::runtime_error("SoapySpyServer: missing required key \"host\"");
@@ -42,25 +104,46 @@ SDRPPClient SoapySpyServerClient::makeSDRPPClient(const SoapySDR::Kwargs &args)
     const auto &host = hostIter->second;
     const auto &port = portIter->second;
 
-    SDRPPClient client;
-    client.bufferQueue.reset(new DSPComplexBufferQueue(SDRPPClient::MaxQueueSize));
+    std::unique_ptr<SpyServerSession> session(new SpyServerSession(timeoutMsFromArgs(args)));
 
     const auto spyServerURL = ParamsToSpyServerURL(host, port);
-    SoapySDR::logf(
-        SOAPY_SDR_INFO,
-        "Connecting to %s...",
-        spyServerURL.c_str());
-    client.client = spyserver::connect(
-        hostIter->second,
-        SoapySDR::StringToSetting<uint16_t>(portIter->second),
-        *client.bufferQueue);
-
-    if(not client.client or not client.client->isOpen() or not client.syncFields())
+    const auto captureIter = args.find("capture");
+
+    // A capture has to start with the handshake, so it needs its own connection.
+    spyserver::SpyServerClient cached;
+    if((captureIter == args.end()) and not pollEngine)
+        cached = ConnectionCache::instance().take(spyServerURL);
+
+    bool connected = false;
+    if(cached)
+    {
+        SoapySDR::logf(
+            SOAPY_SDR_INFO,
+            "Reusing connection to %s...",
+            spyServerURL.c_str());
+        session->adopt(std::move(cached));
+        connected = true;
+    }
+    else
+    {
+        SoapySDR::logf(
+            SOAPY_SDR_INFO,
+            "Connecting to %s...",
+            spyServerURL.c_str());
+        connected = session->connect(
+            hostIter->second,
+            SoapySDR::StringToSetting<uint16_t>(portIter->second),
+            (captureIter != args.end()) ? captureIter->second : "",
+            pollEngine);
+    }
+
+    if(not connected or not session->isOpen() or not session->syncFields())
         throw std::runtime_error("SoapySpyServer: failed to connect to client with args: "+SoapySDR::KwargsToString(args));
 
-    if(client.client->devInfo.ForcedIQFormat != static_cast<uint32_t>(SPYSERVER_STREAM_FORMAT_INVALID))
+    const auto &devInfo = session->client().devInfo;
+    if(devInfo.ForcedIQFormat != static_cast<uint32_t>(SPYSERVER_STREAM_FORMAT_INVALID))
     {
-        switch(static_cast<SpyServerStreamFormat>(client.client->devInfo.ForcedIQFormat))
+        switch(static_cast<SpyServerStreamFormat>(devInfo.ForcedIQFormat))
         {
         case SPYSERVER_STREAM_FORMAT_INT24:
             throw std::runtime_error("Conversion from internal stream format INT24 unsupported.");
@@ -73,11 +156,85 @@ SDRPPClient SoapySpyServerClient::makeSDRPPClient(const SoapySDR::Kwargs &args)
         }
     }
 
+    ConnectionCache::instance().storeDeviceInfo(spyServerURL, devInfo);
+
     SoapySDR::log(
         SOAPY_SDR_INFO,
         "Ready.");
 
-    return client;
+    return session;
+}
+
+std::unique_ptr<SpyServerSession> SoapySpyServerClient::makeReplaySession(const SoapySDR::Kwargs &args)
+{
+    const auto &path = args.at("replay");
+
+    bool realtime = true;
+    const auto modeIter = args.find("replay_mode");
+    if(modeIter != args.end())
+    {
+        if(modeIter->second == "fast")
+            realtime = false;
+        else if(modeIter->second != "realtime")
+            throw std::invalid_argument("Invalid replay mode: "+modeIter->second);
+    }
+
+    std::unique_ptr<SpyServerSession> session(new SpyServerSession(timeoutMsFromArgs(args)));
+
+    SoapySDR::logf(
+        SOAPY_SDR_INFO,
+        "Replaying %s...",
+        path.c_str());
+    session->replay(std::unique_ptr<CaptureReader>(new CaptureReader(path)), realtime);
+
+    if(not session->syncFields())
+        throw std::runtime_error("SoapySpyServer: capture has no device info: "+path);
+
+    return session;
+}
+
+std::unique_ptr<SpyServerSession> SoapySpyServerClient::makeAttachSession(const SoapySDR::Kwargs &args)
+{
+    const auto &name = args.at("attach");
+
+    std::unique_ptr<SpyServerSession> session(new SpyServerSession(timeoutMsFromArgs(args)));
+
+    SoapySDR::logf(
+        SOAPY_SDR_INFO,
+        "Attaching to shared ring %s...",
+        name.c_str());
+    session->attach(std::unique_ptr<SharedRingReader>(new SharedRingReader(name)));
+
+    if(not session->syncFields())
+        throw std::runtime_error("SoapySpyServer: shared ring has no device info: "+name);
+
+    return session;
+}
+
+SoapySDR::Kwargs SoapySpyServerClient::probeArgs(const SoapySDR::Kwargs &args)
+{
+    static const std::vector<std::string> ProbeKeys{"host", "port", "timeout_ms", "replay", "replay_mode", "attach"};
+
+    SoapySDR::Kwargs probe;
+    for(const auto &key: ProbeKeys)
+    {
+        const auto iter = args.find(key);
+        if(iter != args.end())
+            probe.emplace(*iter);
+    }
+
+    return probe;
+}
+
+bool SoapySpyServerClient::takesParkedConnection(const SoapySDR::Kwargs &args)
+{
+    // A capture has to start with the handshake, and windows connect through
+    // a poll engine, so neither takes over a connection of its own.
+    if(args.count("replay") or args.count("attach") or args.count("capture"))
+        return false;
+
+    const auto windowsIter = args.find("windows");
+    return (windowsIter == args.end()) or (SoapySDR::StringToSetting<size_t>(windowsIter->second) == 1);
 }
 
 std::string SoapySpyServerClient::ParamsToSpyServerURL(
@@ -105,38 +262,390 @@ std::string SoapySpyServerClient::DeviceEnumToName(const uint32_t deviceType)
     }
 }
 
+//
+// Utility
+//
+
+void SoapySpyServerClient::updateMixer(const size_t channel)
+{
+    auto &window = this->window(channel);
+    assert(window.serverSampleRate > 0.0);
+
+    window.session->pipeline().setMixerFrequency(window.basebandFrequency / window.serverSampleRate);
+}
+
+bool SoapySpyServerClient::queueSettings(const size_t channel, const SoapySDR::Kwargs &args)
+{
+    auto &client = this->window(channel).session->client();
+
+    bool queued = false;
+
+    const auto modeIter = args.find("streaming_mode");
+    if(modeIter != args.end())
+    {
+        uint32_t mode = 0;
+        if(modeIter->second == "iq")
+            mode = SPYSERVER_STREAM_MODE_IQ_ONLY;
+        else if(modeIter->second == "fft_iq")
+            mode = SPYSERVER_STREAM_MODE_FFT_IQ;
+        else
+            throw std::invalid_argument("Invalid streaming mode: "+modeIter->second);
+
+        client.setSetting(static_cast<uint32_t>(SPYSERVER_SETTING_STREAMING_MODE), mode);
+        queued = true;
+    }
+
+    const auto wireIter = args.find("wire");
+    if(wireIter != args.end())
+    {
+        SpyServerStreamFormat format = SPYSERVER_STREAM_FORMAT_INVALID;
+        if(wireIter->second == SOAPY_SDR_CU8)
+            format = SPYSERVER_STREAM_FORMAT_UINT8;
+        else if(wireIter->second == SOAPY_SDR_CS16)
+            format = SPYSERVER_STREAM_FORMAT_INT16;
+        else if(wireIter->second == SOAPY_SDR_CF32)
+            format = SPYSERVER_STREAM_FORMAT_FLOAT;
+        else
+            throw std::invalid_argument("Invalid wire format: "+wireIter->second);
+
+        const auto forcedFormat = client.devInfo.ForcedIQFormat;
+        if((forcedFormat != static_cast<uint32_t>(SPYSERVER_STREAM_FORMAT_INVALID)) and (forcedFormat != static_cast<uint32_t>(format)))
+            throw std::invalid_argument("This server doesn't allow changing the wire format.");
+
+        client.setSetting(static_cast<uint32_t>(SPYSERVER_SETTING_IQ_FORMAT), static_cast<uint32_t>(format));
+        queued = true;
+    }
+
+    const auto rateIter = args.find("rate");
+    if(rateIter != args.end())
+    {
+        this->setSampleRate(SOAPY_SDR_RX, channel, SoapySDR::StringToSetting<double>(rateIter->second));
+        queued = true;
+    }
+
+    const auto freqIter = args.find("freq");
+    if(freqIter != args.end())
+    {
+        this->setFrequency(SOAPY_SDR_RX, channel, FrequencyName, SoapySDR::StringToSetting<double>(freqIter->second), SoapySDR::Kwargs());
+        queued = true;
+    }
+
+    const auto gainIter = args.find("gain");
+    if(gainIter != args.end())
+    {
+        this->setGain(SOAPY_SDR_RX, channel, GainName, SoapySDR::StringToSetting<double>(gainIter->second));
+        queued = true;
+    }
+
+    return queued;
+}
+
+void SoapySpyServerClient::sendSettings(const size_t channel, spyserver::CommandBatch &batch)
+{
+    const auto &session = *this->window(channel).session;
+
+    const auto ack = session.client().requestAcknowledgement();
+    batch.end();
+
+    if(not session.client().waitForAcknowledgement(ack, static_cast<int>(session.timeoutMs())))
+        SoapySDR::logf(
+            SOAPY_SDR_WARNING,
+            "Server didn't acknowledge settings within %zu ms",
+            session.timeoutMs());
+}
+
+double SoapySpyServerClient::channelOffset(const size_t channel) const
+{
+    const auto index = channel % _numChannels;
+
+    return (_numChannels > 1) ? ((static_cast<double>(index) - static_cast<double>(_numChannels / 2)) * this->window(channel).sampleRate)
+                              : 0.0;
+}
+
 //
 // Construction
 //
 
 SoapySpyServerClient::SoapySpyServerClient(const SoapySDR::Kwargs &args):
-    _sdrppClient(makeSDRPPClient(args))
+    _args(args)
 {
-    assert(args.count("host"));
-    assert(args.count("port"));
-    _spyServerURL = ParamsToSpyServerURL(args.at("host"), args.at("port"));
+    const bool local = args.count("replay") or args.count("attach");
+    if(args.count("replay"))
+        _spyServerURL = "replay:"+args.at("replay");
+    else if(args.count("attach"))
+        _spyServerURL = "shm:"+args.at("attach");
+    else
+    {
+        if(not args.count("host") or not args.count("port"))
+            throw std::runtime_error("SoapySpyServer: missing required keys \"host\" and \"port\"");
+
+        _spyServerURL = ParamsToSpyServerURL(args.at("host"), args.at("port"));
+    }
+
+    // Only server connections hold anything worth deferring.
+    const auto lazyIter = args.find("lazy");
+    _lazy = not local and (lazyIter != args.end()) and SoapySDR::StringToSetting<bool>(lazyIter->second);
+    if(_lazy and args.count("share"))
+        throw std::invalid_argument("A lazy device can't share its connection");
+
+    // Optionally open several sessions, each tuned on its own. Everything
+    // that follows one session's messages stays with the first alone.
+    size_t numWindows = 1;
+    const auto windowsIter = args.find("windows");
+    if(windowsIter != args.end())
+        numWindows = SoapySDR::StringToSetting<size_t>(windowsIter->second);
+    if(numWindows == 0)
+        throw std::invalid_argument("Invalid window count: "+windowsIter->second);
+    if((numWindows > 1) and (local or args.count("capture") or args.count("share") or args.count("pretrigger")))
+        throw std::invalid_argument("Windows need sessions of their own, so can't be combined with replay, attach, capture, share or pretrigger");
+
+    _windows.resize(numWindows);
+    if(numWindows > 1)
+        _pollEngine = std::make_shared<net::PollEngineClass>();
+
+    if(not _lazy)
+    {
+        _windows[0].session = makeSession(args, _pollEngine);
+        _deviceInfo = _windows[0].session->client().devInfo;
+    }
+    else if(not ConnectionCache::instance().getDeviceInfo(_spyServerURL, _deviceInfo))
+    {
+        // Without a recent find(), do what it would have, so opening still
+        // costs one handshake. The connection is left for a first use that
+        // comes soon enough, if that would take it.
+        auto probe = makeSession(probeArgs(args));
+        _deviceInfo = probe->client().devInfo;
+        if(takesParkedConnection(args))
+            ConnectionCache::instance().park(_spyServerURL, probe->release());
+    }
+
+    // Derive sample rates from associated fields.
+    for(uint32_t i = _deviceInfo.MinimumIQDecimation;
+        i <= _deviceInfo.DecimationStageCount;
+        ++i)
+    {
+        const auto rate = static_cast<double>(_deviceInfo.MaximumSampleRate / (1 << i));
+        _sampleRates.emplace_back(i, rate);
+    }
+    assert(not _sampleRates.empty());
+
+    // Optionally split the IQ stream into evenly spaced channels.
+    const auto channelsIter = args.find("channels");
+    if(channelsIter != args.end())
+        _numChannels = SoapySDR::StringToSetting<size_t>(channelsIter->second);
+    if((_numChannels == 0) or (_numChannels > PolyphaseChannelizer::MaxChannels) or (_numChannels & (_numChannels - 1)))
+        throw std::invalid_argument("Invalid channel count: "+channelsIter->second+" (must be a power of two up to "+std::to_string(PolyphaseChannelizer::MaxChannels)+")");
+
+    // An explicit rate is set on connecting, with the other settings.
+    const auto spacingIter = args.find("channel_spacing");
+    if(args.count("rate") and (_numChannels > 1) and (spacingIter != args.end()))
+        throw std::invalid_argument("Specify either rate or channel_spacing, not both");
+
+    if(not _lazy)
+        this->ensureConnected();
+
+    // Only once nothing above can throw, so every device counted is removed.
+    ConnectionCache::instance().addDevice();
+}
+
+SoapySpyServerClient::~SoapySpyServerClient(void)
+{
+    ConnectionCache::instance().removeDevice();
+}
+
+void SoapySpyServerClient::connect(void)
+{
+    try
+    {
+        this->openWindows();
+    }
+    catch(...)
+    {
+        // Sessions left open would be reused by the next attempt, in
+        // whatever state this one left them.
+        for(auto &window: _windows)
+        {
+            window.session.reset();
+            window.numActiveStreams = 0;
+        }
+        _preTrigger.reset();
+
+        throw;
+    }
+}
+
+void SoapySpyServerClient::openWindows(void)
+{
+    const auto &args = _args;
+
+    for(auto &window: _windows)
+    {
+        if(window.session)
+            continue;
+
+        window.session = makeSession(args, _pollEngine);
+
+        // Everything derived from the cached info would be wrong.
+        if(std::memcmp(&window.session->client().devInfo, &_deviceInfo, sizeof(_deviceInfo)) != 0)
+        {
+            window.session.reset();
+            throw std::runtime_error("SoapySpyServer: device at "+_spyServerURL+" changed since it was enumerated");
+        }
+    }
+
+    auto &session = *_windows[0].session;
+
+    _sensorWindow.start = session.stats().startTime;
 
-    if(not _sdrppClient.client->clientSync.CanControl)
+    // With a poll engine, the read thread is the engine's, and there's no
+    // write thread.
+    const auto readThreadConfig = threadConfigFromArgs(args, "read_thread", "spyserver-read");
+    const auto writeThreadConfig = threadConfigFromArgs(args, "write_thread", "spyserver-write");
+    for(auto &window: _windows)
+        window.session->configureThreads(readThreadConfig, writeThreadConfig);
+
+    // Replays and shared rings have no connection to restart.
+    const auto stallIter = args.find("stall_timeout_ms");
+    if((stallIter != args.end()) and not args.count("replay") and not args.count("attach"))
+    {
+        const auto stallTimeoutMs = SoapySDR::StringToSetting<size_t>(stallIter->second);
+        if(stallTimeoutMs > static_cast<size_t>(std::numeric_limits<int>::max()))
+            throw std::invalid_argument("Invalid stall timeout: "+stallIter->second);
+
+        // Zero leaves the watchdog off.
+        if(stallTimeoutMs > 0)
+        {
+            for(auto &window: _windows)
+                window.session->startWatchdog(
+                    args.at("host"),
+                    SoapySDR::StringToSetting<uint16_t>(args.at("port")),
+                    static_cast<int>(stallTimeoutMs));
+        }
+    }
+
+    // Everything the device sets up below goes out in one write per window.
+    std::vector<std::unique_ptr<spyserver::CommandBatch>> batches;
+    for(auto &window: _windows)
+        batches.emplace_back(new spyserver::CommandBatch(window.session->client()));
+
+    // Publishing to other processes keeps the server streaming for as long
+    // as the device is open, as if it had a stream of its own. This isn't
+    // done in makeSession(), which find() also calls.
+    const auto shareIter = args.find("share");
+    if(shareIter != args.end())
+    {
+        const auto sizeIter = args.find("share_size");
+        const auto size = (sizeIter != args.end()) ? SoapySDR::StringToSetting<size_t>(sizeIter->second)
+                                                   : SharedRingWriter::DefaultSize;
+
+        const auto replaceIter = args.find("share_replace");
+        const bool replace = (replaceIter != args.end()) and SoapySDR::StringToSetting<bool>(replaceIter->second);
+
+        session.startSharing(std::unique_ptr<SharedRingWriter>(new SharedRingWriter(shareIter->second, size, replace)));
+        session.startStream();
+        _windows[0].numActiveStreams = 1;
+    }
+
+    if(not session.client().clientSync.CanControl)
         SoapySDR::logf(
             SOAPY_SDR_WARNING,
             "This device restricts changing gain. %s gain is set to %f.",
             GainName.c_str(),
             this->getGain(SOAPY_SDR_RX, 0, GainName));
 
-    // Derive sample rates from associated fields.
-    for(uint32_t i = _sdrppClient.client->devInfo.MinimumIQDecimation;
-        i <= _sdrppClient.client->devInfo.DecimationStageCount;
-        ++i)
+    // Each window starts with the same settings, and is tuned on its own
+    // from then on.
+    const auto spacingIter = args.find("channel_spacing");
+    for(size_t channel = 0; channel < (_numChannels * _windows.size()); channel += _numChannels)
     {
-        const auto rate = static_cast<double>(_sdrppClient.client->devInfo.MaximumSampleRate / (1 << i));
-        _sampleRates.emplace_back(i, rate);
+        if(_numChannels > 1)
+            this->window(channel).session->pipeline().setChannelizer(std::unique_ptr<PolyphaseChannelizer>(new PolyphaseChannelizer(_numChannels)));
+
+        // Ugly workaround: there doesn't seem to be a way to query the sample rate, so
+        // each implementation just stores the sample rate passed into the setter. We'll
+        // quietly set the sample rate so we have an initial value.
+        // An explicit rate is set below, with the other settings.
+        if(not args.count("rate"))
+        {
+            if((_numChannels > 1) and (spacingIter != args.end()))
+                this->setSampleRate(SOAPY_SDR_RX, channel, SoapySDR::StringToSetting<double>(spacingIter->second));
+            else
+                this->setSampleRate(SOAPY_SDR_RX, channel, _sampleRates[0].second / _numChannels);
+        }
+
+        // Only wait on the server if there's something to read back.
+        auto &batch = *batches[this->windowIndex(channel)];
+        if(this->queueSettings(channel, args))
+            this->sendSettings(channel, batch);
+        else
+            batch.end();
     }
-    assert(not _sampleRates.empty());
 
-    // Ugly workaround: there doesn't seem to be a way to query the sample rate, so
-    // each implementation just stores the sample rate passed into the setter. We'll
-    // quietly set the sample rate so we have an initial value.
-    this->setSampleRate(SOAPY_SDR_RX, 0, _sampleRates[0].second);
+    // Unless given a size, the ring holds the requested time at the rate and
+    // wire format just set, with some room for headers and retunes.
+    const auto preTriggerIter = args.find("pretrigger");
+    if(preTriggerIter != args.end())
+    {
+        const auto preSeconds = SoapySDR::StringToSetting<double>(preTriggerIter->second);
+        const auto postIter = args.find("pretrigger_post");
+        const auto postSeconds = (postIter != args.end()) ? SoapySDR::StringToSetting<double>(postIter->second) : 0.0;
+
+        const auto wireIter = args.find("wire");
+        const auto sampleSize = SoapySDR::formatToSize((wireIter != args.end()) ? wireIter->second : SOAPY_SDR_CS16);
+
+        const auto sizeIter = args.find("pretrigger_size");
+        const auto size = (sizeIter != args.end()) ? SoapySDR::StringToSetting<size_t>(sizeIter->second)
+                                                   : static_cast<size_t>(1.25 * (preSeconds + postSeconds) * _windows[0].serverSampleRate * sampleSize);
+
+        _preTrigger = std::make_shared<PreTriggerRing>(size, preSeconds, postSeconds);
+        session.startPreTrigger(_preTrigger);
+
+        SoapySDR::logf(
+            SOAPY_SDR_INFO,
+            "Pre-trigger ring: %zu MiB%s",
+            (_preTrigger->size() >> 20),
+            _preTrigger->hugePages() ? ", huge pages" : "");
+    }
+}
+
+void SoapySpyServerClient::ensureConnected(void) const
+{
+    if(_connected.load(std::memory_order_acquire))
+        return;
+
+    std::lock_guard<std::recursive_mutex> lock(_connectMutex);
+    if(_connected.load(std::memory_order_relaxed) or _connecting)
+        return;
+
+    if(_lazy)
+        SoapySDR::logf(SOAPY_SDR_DEBUG, "Connecting lazy device %s", _spyServerURL.c_str());
+
+    // The device is never const itself, only the getters that may connect.
+    _connecting = true;
+    try
+    {
+        const_cast<SoapySpyServerClient*>(this)->connect();
+    }
+    catch(...)
+    {
+        _connecting = false;
+        throw;
+    }
+    _connecting = false;
+
+    _connected.store(true, std::memory_order_release);
+}
+
+void SoapySpyServerClient::applySettings(const SoapySDR::Kwargs &args)
+{
+    this->ensureConnected();
+
+    for(size_t channel = 0; channel < (_numChannels * _windows.size()); channel += _numChannels)
+    {
+        spyserver::CommandBatch batch(this->window(channel).session->client());
+        if(this->queueSettings(channel, args))
+            this->sendSettings(channel, batch);
+    }
 }
 
 /*******************************************************************
@@ -155,12 +664,10 @@ std::string SoapySpyServerClient::getHardwareKey(void) const
 
 SoapySDR::Kwargs SoapySpyServerClient::getHardwareInfo(void) const
 {
-    _sdrppClient.syncFields();
-
     return
     {
-        {"device", DeviceEnumToName(_sdrppClient.client->devInfo.DeviceType)},
-        {"serial", SoapySDR::SettingToString(_sdrppClient.client->devInfo.DeviceSerial)},
+        {"device", DeviceEnumToName(_deviceInfo.DeviceType)},
+        {"serial", SoapySDR::SettingToString(_deviceInfo.DeviceSerial)},
         {"protocol_version", SoapySDR::SettingToString(SPYSERVER_PROTOCOL_VERSION)},
     };
 }
@@ -171,7 +678,7 @@ SoapySDR::Kwargs SoapySpyServerClient::getHardwareInfo(void) const
 
 size_t SoapySpyServerClient::getNumChannels(const int direction) const
 {
-    return (direction == SOAPY_SDR_RX) ? 1 : 0;
+    return (direction == SOAPY_SDR_RX) ? (_numChannels * _windows.size()) : 0;
 }
 
 SoapySDR::Kwargs SoapySpyServerClient::getChannelInfo(const int direction, const size_t channel) const
@@ -179,8 +686,13 @@ SoapySDR::Kwargs SoapySpyServerClient::getChannelInfo(const int direction, const
     SoapySDR::Kwargs channelInfo;
     if(validChannelParams(direction, channel))
     {
-        _sdrppClient.syncFields();
-        channelInfo["full_control"] = SoapySDR::SettingToString(_sdrppClient.client->clientSync.CanControl > 0);
+        this->ensureConnected();
+
+        const auto &session = *this->window(channel).session;
+        session.syncFields();
+        channelInfo["full_control"] = SoapySDR::SettingToString(session.client().clientSync.CanControl > 0);
+        channelInfo["frequency_offset"] = SoapySDR::SettingToString(this->channelOffset(channel));
+        channelInfo["window"] = SoapySDR::SettingToString(this->windowIndex(channel));
     }
     else channelInfo = SoapySDR::Device::getChannelInfo(direction, channel);
 
@@ -215,6 +727,89 @@ std::string SoapySpyServerClient::getAntenna(const int direction, const size_t c
                                                   : SoapySDR::Device::getAntenna(direction, channel);
 }
 
+/*******************************************************************
+ * Frontend corrections API
+ ******************************************************************/
+
+// Corrections are applied to each window's IQ stream before
+// channelization, so they're shared by the window's channels.
+
+bool SoapySpyServerClient::hasDCOffsetMode(const int direction, const size_t channel) const
+{
+    return validChannelParams(direction, channel);
+}
+
+void SoapySpyServerClient::setDCOffsetMode(const int direction, const size_t channel, const bool automatic)
+{
+    if(validChannelParams(direction, channel))
+        this->connectedSession(channel).pipeline().iqCorrection.setDCOffsetMode(automatic);
+    else
+        SoapySDR::Device::setDCOffsetMode(direction, channel, automatic);
+}
+
+bool SoapySpyServerClient::getDCOffsetMode(const int direction, const size_t channel) const
+{
+    return validChannelParams(direction, channel) ? this->connectedSession(channel).pipeline().iqCorrection.getDCOffsetMode()
+                                                  : SoapySDR::Device::getDCOffsetMode(direction, channel);
+}
+
+bool SoapySpyServerClient::hasDCOffset(const int direction, const size_t channel) const
+{
+    return validChannelParams(direction, channel);
+}
+
+void SoapySpyServerClient::setDCOffset(const int direction, const size_t channel, const std::complex<double> &offset)
+{
+    if(validChannelParams(direction, channel))
+        this->connectedSession(channel).pipeline().iqCorrection.setDCOffset(offset);
+    else
+        SoapySDR::Device::setDCOffset(direction, channel, offset);
+}
+
+std::complex<double> SoapySpyServerClient::getDCOffset(const int direction, const size_t channel) const
+{
+    return validChannelParams(direction, channel) ? this->connectedSession(channel).pipeline().iqCorrection.getDCOffset()
+                                                  : SoapySDR::Device::getDCOffset(direction, channel);
+}
+
+bool SoapySpyServerClient::hasIQBalance(const int direction, const size_t channel) const
+{
+    return validChannelParams(direction, channel);
+}
+
+void SoapySpyServerClient::setIQBalance(const int direction, const size_t channel, const std::complex<double> &balance)
+{
+    if(validChannelParams(direction, channel))
+        this->connectedSession(channel).pipeline().iqCorrection.setIQBalance(balance);
+    else
+        SoapySDR::Device::setIQBalance(direction, channel, balance);
+}
+
+std::complex<double> SoapySpyServerClient::getIQBalance(const int direction, const size_t channel) const
+{
+    return validChannelParams(direction, channel) ? this->connectedSession(channel).pipeline().iqCorrection.getIQBalance()
+                                                  : SoapySDR::Device::getIQBalance(direction, channel);
+}
+
+bool SoapySpyServerClient::hasIQBalanceMode(const int direction, const size_t channel) const
+{
+    return validChannelParams(direction, channel);
+}
+
+void SoapySpyServerClient::setIQBalanceMode(const int direction, const size_t channel, const bool automatic)
+{
+    if(validChannelParams(direction, channel))
+        this->connectedSession(channel).pipeline().iqCorrection.setIQBalanceMode(automatic);
+    else
+        SoapySDR::Device::setIQBalanceMode(direction, channel, automatic);
+}
+
+bool SoapySpyServerClient::getIQBalanceMode(const int direction, const size_t channel) const
+{
+    return validChannelParams(direction, channel) ? this->connectedSession(channel).pipeline().iqCorrection.getIQBalanceMode()
+                                                  : SoapySDR::Device::getIQBalanceMode(direction, channel);
+}
+
 /*******************************************************************
  * Gain API
  ******************************************************************/
@@ -231,14 +826,21 @@ void SoapySpyServerClient::setGain(const int direction, const size_t channel, co
 {
     if(validGainParams(direction, channel, name))
     {
-        _sdrppClient.syncFields();
-        if(_sdrppClient.client->clientSync.CanControl)
+        this->ensureConnected();
+
+        const auto &window = this->window(channel);
+        window.session->syncFields();
+        if(window.session->client().clientSync.CanControl)
         {
-            _sdrppClient.client->setSetting(
+            // Acknowledged, so the sync read back reflects it.
+            spyserver::CommandBatch batch(window.session->client());
+            window.session->client().setSetting(
                 static_cast<uint32_t>(SPYSERVER_SETTING_GAIN),
                 static_cast<uint32_t>(value));
+            window.session->client().requestAcknowledgement();
+            batch.end();
 
-            _sdrppClient.syncFields();
+            window.session->syncFields();
         }
         else throw std::runtime_error("This device does not allow setting gain.");
     }
@@ -249,9 +851,12 @@ double SoapySpyServerClient::getGain(const int direction, const size_t channel,
 {
     if(validGainParams(direction, channel, name))
     {
-        _sdrppClient.syncFields();
+        this->ensureConnected();
 
-        return static_cast<double>(_sdrppClient.client->clientSync.Gain);
+        const auto &window = this->window(channel);
+        window.session->syncFields();
+
+        return static_cast<double>(window.session->client().clientSync.Gain);
     }
     else return SoapySDR::Device::getGain(direction, channel, name);
 }
@@ -260,20 +865,21 @@ SoapySDR::Range SoapySpyServerClient::getGainRange(const int direction, const si
 {
     if(validGainParams(direction, channel, name))
     {
-        _sdrppClient.syncFields();
+        const auto &window = this->window(channel);
 
-        if(_sdrppClient.client->clientSync.CanControl)
+        // Until a lazy device connects, assume it'll have control.
+        if(not _connected or (window.session->syncFields() and window.session->client().clientSync.CanControl))
         {
             return SoapySDR::Range(
                 0.0,
-                static_cast<double>(_sdrppClient.client->devInfo.MaximumGainIndex),
+                static_cast<double>(_deviceInfo.MaximumGainIndex),
                 1.0);
         }
         else
         {
             return SoapySDR::Range(
-                static_cast<double>(_sdrppClient.client->clientSync.Gain),
-                static_cast<double>(_sdrppClient.client->clientSync.Gain),
+                static_cast<double>(window.session->client().clientSync.Gain),
+                static_cast<double>(window.session->client().clientSync.Gain),
                 1.0);
         }
 
@@ -286,16 +892,42 @@ SoapySDR::Range SoapySpyServerClient::getGainRange(const int direction, const si
  ******************************************************************/
 
 const std::string SoapySpyServerClient::FrequencyName("RF");
+const std::string SoapySpyServerClient::BasebandFrequencyName("BB");
 
 void SoapySpyServerClient::setFrequency(const int direction, const size_t channel, const std::string &name, const double frequency, const SoapySDR::Kwargs &args)
 {
     if(validFrequencyParams(direction, channel, name))
     {
-        _sdrppClient.client->setSetting(
-            static_cast<uint32_t>(SPYSERVER_SETTING_IQ_FREQUENCY),
-            static_cast<uint32_t>(frequency));
+        this->ensureConnected();
+
+        auto &window = this->window(channel);
+        if(name == BasebandFrequencyName)
+        {
+            // A window's channels share one mixer, so this moves all of them.
+            const auto basebandFrequency = frequency - this->channelOffset(channel);
+
+            const auto maxOffset = window.serverSampleRate / 2.0;
+            if(std::abs(basebandFrequency) > maxOffset)
+                throw std::invalid_argument("Baseband frequency outside of IQ bandwidth: "+SoapySDR::SettingToString(frequency));
 
-        _sdrppClient.syncFields();
+            window.basebandFrequency = basebandFrequency;
+            this->updateMixer(channel);
+            window.session->pipeline().markLocalRetune();
+            window.session->updateStreaming();
+        }
+        else
+        {
+            // SoapySDR's default tuning reads this back right away, to give
+            // BB the remainder, so it has to be the new frequency. In a batch,
+            // this doesn't wait, and until the server acknowledges it, the
+            // requested frequency is what's read back.
+            window.requestedFrequency = static_cast<uint32_t>(frequency);
+            window.frequencyAck = window.session->setTuningSetting(
+                static_cast<uint32_t>(SPYSERVER_SETTING_IQ_FREQUENCY),
+                window.requestedFrequency);
+
+            window.session->syncFields();
+        }
     }
     else SoapySDR::Device::setFrequency(direction, channel, name, frequency, args);
 }
@@ -304,16 +936,25 @@ double SoapySpyServerClient::getFrequency(const int direction, const size_t chan
 {
     if(validFrequencyParams(direction, channel, name))
     {
-        _sdrppClient.syncFields();
+        this->ensureConnected();
+
+        const auto &window = this->window(channel);
+        if(name == BasebandFrequencyName)
+            return window.basebandFrequency + this->channelOffset(channel);
+
+        if(not window.session->client().acknowledged(window.frequencyAck))
+            return static_cast<double>(window.requestedFrequency);
 
-        return static_cast<double>(_sdrppClient.client->clientSync.IQCenterFrequency);
+        window.session->syncFields();
+
+        return static_cast<double>(window.session->client().clientSync.IQCenterFrequency);
     }
     else return SoapySDR::Device::getFrequency(direction, channel, name);
 }
 
 std::vector<std::string> SoapySpyServerClient::listFrequencies(const int direction, const size_t channel) const
 {
-    return validChannelParams(direction, channel) ? std::vector<std::string>{FrequencyName}
+    return validChannelParams(direction, channel) ? std::vector<std::string>{FrequencyName, BasebandFrequencyName}
                                                   : SoapySDR::Device::listFrequencies(direction, channel);
 }
 
@@ -321,11 +962,29 @@ SoapySDR::RangeList SoapySpyServerClient::getFrequencyRange(const int direction,
 {
     if(validFrequencyParams(direction, channel, name))
     {
-        _sdrppClient.syncFields();
+        const auto &window = this->window(channel);
+        if(name == BasebandFrequencyName)
+        {
+            this->ensureConnected();
+
+            const auto offset = this->channelOffset(channel);
+            return SoapySDR::RangeList{{offset - (window.serverSampleRate / 2.0), offset + (window.serverSampleRate / 2.0)}};
+        }
+
+        // Until a lazy device connects, report the device's full range.
+        if(not _connected)
+        {
+            return SoapySDR::RangeList{{
+                static_cast<double>(_deviceInfo.MinimumFrequency),
+                static_cast<double>(_deviceInfo.MaximumFrequency),
+                1.0}};
+        }
+
+        window.session->syncFields();
 
         return SoapySDR::RangeList{{
-            static_cast<double>(_sdrppClient.client->clientSync.MinimumIQCenterFrequency),
-            static_cast<double>(_sdrppClient.client->clientSync.MaximumIQCenterFrequency),
+            static_cast<double>(window.session->client().clientSync.MinimumIQCenterFrequency),
+            static_cast<double>(window.session->client().clientSync.MaximumIQCenterFrequency),
             1.0}};
     }
     else return SoapySDR::Device::getFrequencyRange(direction, channel, name);
@@ -339,34 +998,85 @@ void SoapySpyServerClient::setSampleRate(const int direction, const size_t chann
 {
     if(validChannelParams(direction, channel))
     {
+        this->ensureConnected();
+        assert(not _sampleRates.empty());
+
+        auto &window = this->window(channel);
+
+        // When channelized, the requested rate is per channel.
+        const auto streamRate = rate * _numChannels;
+
+        const auto &minRate = _sampleRates.back().second;
+        const auto &maxRate = _sampleRates.front().second;
+        if(((streamRate < minRate) and not almostEqual(streamRate, minRate)) or ((streamRate > maxRate) and not almostEqual(streamRate, maxRate)))
+            throw std::invalid_argument("Invalid sample rate: "+SoapySDR::SettingToString(rate));
+
+        // SpyServer only offers power-of-two decimations of the device's maximum
+        // rate, so use the lowest one that covers the requested rate and resample
+        // the rest of the way ourselves.
         auto sampleRateIter = std::find_if(
-            _sampleRates.begin(),
-            _sampleRates.end(),
+            _sampleRates.rbegin(),
+            _sampleRates.rend(),
             [&](const std::pair<uint32_t, double> &ratePair)
             {
-                return almostEqual(ratePair.second, rate);
+                return (ratePair.second > streamRate) or almostEqual(ratePair.second, streamRate);
             });
+        assert(sampleRateIter != _sampleRates.rend());
 
-        if(sampleRateIter != _sampleRates.end())
+        std::unique_ptr<PolyphaseResampler> resampler;
+        double actualRate = sampleRateIter->second;
+        if(not almostEqual(sampleRateIter->second, streamRate))
         {
-            // SpyServer takes in sample rate by the decimation index.
-            _sdrppClient.client->setSetting(
-                static_cast<uint32_t>(SPYSERVER_SETTING_IQ_DECIMATION),
-                sampleRateIter->first);
+            const auto factors = PolyphaseResampler::RationalApproximation(streamRate / sampleRateIter->second);
+            resampler.reset(new PolyphaseResampler(factors.first, factors.second));
+
+            actualRate = (sampleRateIter->second * factors.first) / factors.second;
+            if(not almostEqual(actualRate, streamRate))
+                SoapySDR::logf(
+                    SOAPY_SDR_NOTICE,
+                    "Sample rate %f approximated as %f (%zu/%zu of %f)",
+                    streamRate,
+                    actualRate,
+                    factors.first,
+                    factors.second,
+                    sampleRateIter->second);
+        }
+
+        // SpyServer takes in sample rate by the decimation index.
+        window.session->setTuningSetting(
+            static_cast<uint32_t>(SPYSERVER_SETTING_IQ_DECIMATION),
+            sampleRateIter->first);
+        window.session->pipeline().setResampler(std::move(resampler));
+        window.session->pipeline().setSampleClockRate(sampleRateIter->second);
 
-            _sampleRate = rate;
+        window.sampleRate = actualRate / _numChannels;
+        window.serverSampleRate = sampleRateIter->second;
 
-            _sdrppClient.syncFields();
+        // The baseband offset may no longer fit in the new IQ bandwidth.
+        if(std::abs(window.basebandFrequency) > (window.serverSampleRate / 2.0))
+        {
+            SoapySDR::logf(
+                SOAPY_SDR_WARNING,
+                "Baseband frequency %f outside of new IQ bandwidth. Resetting to 0.",
+                window.basebandFrequency);
+            window.basebandFrequency = 0.0;
         }
-        else throw std::invalid_argument("Invalid sample rate: "+SoapySDR::SettingToString(rate));
+        this->updateMixer(channel);
+
+        window.session->syncFields();
     }
     else SoapySDR::Device::setSampleRate(direction, channel, rate);
 }
 
 double SoapySpyServerClient::getSampleRate(const int direction, const size_t channel) const
 {
-    return validChannelParams(direction, channel) ? _sampleRate
-                                                  : SoapySDR::Device::getSampleRate(direction, channel);
+    if(validChannelParams(direction, channel))
+    {
+        this->ensureConnected();
+
+        return this->window(channel).sampleRate;
+    }
+    else return SoapySDR::Device::getSampleRate(direction, channel);
 }
 
 std::vector<double> SoapySpyServerClient::listSampleRates(const int direction, const size_t channel) const
@@ -378,12 +1088,82 @@ std::vector<double> SoapySpyServerClient::listSampleRates(const int direction, c
             _sampleRates.begin(),
             _sampleRates.end(),
             std::back_inserter(sampleRates),
-            [](const std::pair<uint32_t, double> &ratePair)
+            [this](const std::pair<uint32_t, double> &ratePair)
             {
-                return ratePair.second;
+                return ratePair.second / _numChannels;
             });
 
         return sampleRates;
     }
     else return SoapySDR::Device::listSampleRates(direction, channel);
 }
+
+SoapySDR::RangeList SoapySpyServerClient::getSampleRateRange(const int direction, const size_t channel) const
+{
+    // Anything between the server's rates is reachable by resampling.
+    return validChannelParams(direction, channel) ? SoapySDR::RangeList{{_sampleRates.back().second / _numChannels, _sampleRates.front().second / _numChannels}}
+                                                  : SoapySDR::Device::getSampleRateRange(direction, channel);
+}
+
+/*******************************************************************
+ * Time API
+ ******************************************************************/
+
+long long SoapySpyServerClient::getHardwareTime(const std::string &what) const
+{
+    if(what.empty())
+        return this->connectedSession().pipeline().sampleClockNs();
+
+    // Streams on other windows are timed on their own window's clock.
+    char *end = nullptr;
+    const auto channel = std::strtoul(what.c_str(), &end, 10);
+    if((end != what.c_str()) and (*end == '\0') and validChannelParams(SOAPY_SDR_RX, channel))
+        return this->connectedSession(channel).pipeline().sampleClockNs();
+
+    return SoapySDR::Device::getHardwareTime(what);
+}
+
+/*******************************************************************
+ * Settings API
+ ******************************************************************/
+
+SoapySDR::ArgInfoList SoapySpyServerClient::getSettingInfo(void) const
+{
+    SoapySDR::ArgInfo applyInfo;
+    applyInfo.key = "apply_settings";
+    applyInfo.name = "Apply settings";
+    applyInfo.description = "Write \"freq\", \"gain\", \"rate\", \"wire\" and \"streaming_mode\" as key=value pairs, to send them in one write and wait once for the server to acknowledge them. Reads back empty.";
+    applyInfo.type = SoapySDR::ArgInfo::STRING;
+
+    SoapySDR::ArgInfo dumpInfo;
+    dumpInfo.key = "pretrigger_dump";
+    dumpInfo.name = "Pre-trigger dump";
+    dumpInfo.description = "Write a path to save the pre-trigger ring, and what follows, as a capture. Reads back the path until it's written.";
+    dumpInfo.type = SoapySDR::ArgInfo::STRING;
+
+    return SoapySDR::ArgInfoList{applyInfo, dumpInfo};
+}
+
+void SoapySpyServerClient::writeSetting(const std::string &key, const std::string &value)
+{
+    if(key == "apply_settings")
+        this->applySettings(SoapySDR::KwargsFromString(value));
+    else if(key == "pretrigger_dump")
+    {
+        this->ensureConnected();
+        if(not _preTrigger)
+            throw std::runtime_error("No pre-trigger ring. Open the device with \"pretrigger\".");
+
+        _preTrigger->dump(value);
+    }
+    else throw std::invalid_argument("Invalid setting: "+key);
+}
+
+std::string SoapySpyServerClient::readSetting(const std::string &key) const
+{
+    if(key == "apply_settings")
+        return "";
+    else if(key == "pretrigger_dump")
+        return _preTrigger ? _preTrigger->dumpPath() : "";
+    else throw std::invalid_argument("Invalid setting: "+key);
+}
@@ -0,0 +1,341 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "SharedRing.hpp"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+//
+// Non-class utility
+//
+
+// Keeps the data cache-line aligned.
+static constexpr size_t SharedRingDataOffset = ((sizeof(SharedRingHeader) + 63) / 64) * 64;
+
+static constexpr size_t MaxInfoAttempts = 1000;
+
+static std::string sharedMemoryName(const std::string &name)
+{
+    if(name.empty())
+        throw std::invalid_argument("Empty shared memory name");
+
+    return (name[0] == '/') ? name : ("/"+name);
+}
+
+/*******************************************************************
+ * SharedRingWriter
+ ******************************************************************/
+
+SharedRingWriter::SharedRingWriter(const std::string &name, const size_t size, const bool replace):
+    _name(sharedMemoryName(name))
+{
+#ifdef _WIN32
+    (void)size;
+    (void)replace;
+    throw std::runtime_error("Shared memory rings are unsupported on Windows");
+#else
+    _dataSize = 1;
+    while(_dataSize < size) _dataSize <<= 1;
+
+    // Every message must fit with room to spare.
+    if(_dataSize < (4 * captureRecordSize(SPYSERVER_MAX_MESSAGE_BODY_SIZE)))
+        throw std::invalid_argument("Shared ring too small: "+std::to_string(size));
+
+    _mappingSize = SharedRingDataOffset + _dataSize;
+
+    // Readers of a replaced ring keep their mapping, and see it go quiet.
+    if(replace)
+        ::shm_unlink(_name.c_str());
+
+    const int fd = ::shm_open(_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if((fd < 0) and (errno == EEXIST))
+        throw std::runtime_error("Shared memory "+_name+" already exists, and another device may be sharing to it. Open with \"share_replace=true\" to replace it.");
+    else if(fd < 0)
+        throw std::runtime_error("Failed to create shared memory "+_name+": "+std::string(strerror(errno)));
+
+    struct stat status;
+    if(::fstat(fd, &status) == 0)
+    {
+        _device = static_cast<uint64_t>(status.st_dev);
+        _inode = static_cast<uint64_t>(status.st_ino);
+    }
+
+    void *mapping = MAP_FAILED;
+    if(::ftruncate(fd, static_cast<off_t>(_mappingSize)) == 0)
+        mapping = ::mmap(nullptr, _mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    const int error = errno;
+    ::close(fd);
+
+    if(mapping == MAP_FAILED)
+    {
+        ::shm_unlink(_name.c_str());
+        throw std::runtime_error("Failed to map shared memory "+_name+": "+std::string(strerror(error)));
+    }
+
+    _mapping = static_cast<uint8_t*>(mapping);
+    _data = _mapping + SharedRingDataOffset;
+
+    _header = new (_mapping) SharedRingHeader;
+    _header->version = SharedRingVersion;
+    _header->headerSize = static_cast<uint32_t>(SharedRingDataOffset);
+    _header->dataSize = _dataSize;
+    _header->reservePosition.store(0, std::memory_order_relaxed);
+    _header->writePosition.store(0, std::memory_order_relaxed);
+    _header->closed.store(0, std::memory_order_relaxed);
+    _header->infoSequence.store(0, std::memory_order_relaxed);
+    _header->hasDeviceInfo = 0;
+    _header->hasClientSync = 0;
+
+    _startTime = Clock::now();
+
+    // Readers check this last.
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(_header->magic, SharedRingMagic, sizeof(_header->magic));
+#endif
+}
+
+SharedRingWriter::~SharedRingWriter(void)
+{
+#ifndef _WIN32
+    _header->closed.store(1, std::memory_order_release);
+
+    // Attached readers keep their mappings until they notice.
+    ::munmap(_mapping, _mappingSize);
+
+    // Unless another writer has replaced it since.
+    const int fd = ::shm_open(_name.c_str(), O_RDONLY, 0);
+    if(fd >= 0)
+    {
+        struct stat status;
+        if((::fstat(fd, &status) == 0)
+           and (static_cast<uint64_t>(status.st_dev) == _device)
+           and (static_cast<uint64_t>(status.st_ino) == _inode))
+        {
+            ::shm_unlink(_name.c_str());
+        }
+        ::close(fd);
+    }
+#endif
+}
+
+void SharedRingWriter::publish(
+    const Clock::time_point &arrivalTime,
+    const SpyServerMessageHeader &header,
+    const uint8_t *body)
+{
+    const int messageType = header.MessageType & 0xFFFF;
+    if((messageType == SPYSERVER_MSG_TYPE_DEVICE_INFO) or (messageType == SPYSERVER_MSG_TYPE_CLIENT_SYNC))
+        this->updateInfo(messageType, body, header.BodySize);
+
+    const size_t recordSize = captureRecordSize(header.BodySize);
+
+    // Records never wrap. If this one won't fit before the end, a zero-sized
+    // record (or too little room for one) tells readers to start over.
+    const uint64_t offset = _position & (_dataSize - 1);
+    const uint64_t tail = _dataSize - offset;
+    const uint64_t skip = (tail < recordSize) ? tail : 0;
+
+    _header->reservePosition.store(_position + skip + recordSize, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    if((skip > 0) and (skip >= sizeof(CaptureRecordHeader)))
+    {
+        const CaptureRecordHeader marker{0, 0, 0};
+        std::memcpy(_data + offset, &marker, sizeof(marker));
+    }
+    _position += skip;
+
+    CaptureRecordHeader recordHeader;
+    recordHeader.arrivalNs = (arrivalTime > _startTime)
+        ? static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(arrivalTime - _startTime).count())
+        : 0;
+    recordHeader.recordSize = static_cast<uint32_t>(recordSize);
+    recordHeader.reserved = 0;
+
+    uint8_t *record = _data + (_position & (_dataSize - 1));
+    std::memcpy(record, &recordHeader, sizeof(recordHeader));
+    std::memcpy(record + sizeof(recordHeader), &header, sizeof(header));
+    if(header.BodySize > 0)
+        std::memcpy(record + sizeof(recordHeader) + sizeof(header), body, header.BodySize);
+
+    _position += recordSize;
+    _header->writePosition.store(_position, std::memory_order_release);
+}
+
+void SharedRingWriter::updateInfo(const uint32_t messageType, const uint8_t *body, const size_t size)
+{
+    const auto sequence = _header->infoSequence.load(std::memory_order_relaxed);
+    _header->infoSequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    if((messageType == SPYSERVER_MSG_TYPE_DEVICE_INFO) and (size >= sizeof(SpyServerDeviceInfo)))
+    {
+        std::memcpy(&_header->deviceInfo, body, sizeof(SpyServerDeviceInfo));
+        _header->hasDeviceInfo = 1;
+    }
+    else if((messageType == SPYSERVER_MSG_TYPE_CLIENT_SYNC) and (size >= sizeof(SpyServerClientSync)))
+    {
+        std::memcpy(&_header->clientSync, body, sizeof(SpyServerClientSync));
+        _header->hasClientSync = 1;
+    }
+
+    _header->infoSequence.store(sequence + 2, std::memory_order_release);
+}
+
+/*******************************************************************
+ * SharedRingReader
+ ******************************************************************/
+
+SharedRingReader::SharedRingReader(const std::string &name):
+    _name(sharedMemoryName(name))
+{
+#ifdef _WIN32
+    throw std::runtime_error("Shared memory rings are unsupported on Windows");
+#else
+    const int fd = ::shm_open(_name.c_str(), O_RDONLY, 0);
+    if(fd < 0)
+        throw std::runtime_error("Failed to open shared memory "+_name+": "+std::string(strerror(errno)));
+
+    struct stat status;
+    void *mapping = MAP_FAILED;
+    if((::fstat(fd, &status) == 0) and (static_cast<size_t>(status.st_size) > SharedRingDataOffset))
+    {
+        _mappingSize = static_cast<size_t>(status.st_size);
+        mapping = ::mmap(nullptr, _mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+
+    if(mapping == MAP_FAILED)
+        throw std::runtime_error("Failed to map shared memory "+_name);
+
+    _mapping = static_cast<const uint8_t*>(mapping);
+    _header = reinterpret_cast<const SharedRingHeader*>(_mapping);
+    _data = _mapping + SharedRingDataOffset;
+    _dataSize = _header->dataSize;
+
+    if((std::memcmp(_header->magic, SharedRingMagic, sizeof(SharedRingMagic)) != 0)
+       or (_header->version != SharedRingVersion)
+       or (_header->headerSize != SharedRingDataOffset)
+       or ((SharedRingDataOffset + _dataSize) > _mappingSize)
+       or (_dataSize & (_dataSize - 1)))
+    {
+        ::munmap(const_cast<uint8_t*>(_mapping), _mappingSize);
+        throw std::runtime_error("Not a SpyServer shared ring: "+_name);
+    }
+
+    this->seekToLatest();
+#endif
+}
+
+SharedRingReader::~SharedRingReader(void)
+{
+#ifndef _WIN32
+    ::munmap(const_cast<uint8_t*>(_mapping), _mappingSize);
+#endif
+}
+
+bool SharedRingReader::info(SpyServerDeviceInfo &deviceInfo, SpyServerClientSync &clientSync) const
+{
+    // Don't spin forever on a writer that died mid-update.
+    for(size_t attempt = 0; attempt < MaxInfoAttempts; ++attempt)
+    {
+        const auto before = _header->infoSequence.load(std::memory_order_acquire);
+        if(before & 1)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        const bool valid = _header->hasDeviceInfo and _header->hasClientSync;
+        std::memcpy(&deviceInfo, &_header->deviceInfo, sizeof(deviceInfo));
+        std::memcpy(&clientSync, &_header->clientSync, sizeof(clientSync));
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(_header->infoSequence.load(std::memory_order_relaxed) == before)
+            return valid;
+    }
+
+    return false;
+}
+
+SharedRingReader::Status SharedRingReader::next(Record &record)
+{
+    while(true)
+    {
+        const auto writePosition = _header->writePosition.load(std::memory_order_acquire);
+        if(writePosition == _position)
+            return _header->closed.load(std::memory_order_acquire) ? Status::Closed : Status::Empty;
+
+        if((writePosition - _position) > _dataSize)
+        {
+            this->seekToLatest();
+            return Status::Overrun;
+        }
+
+        const uint64_t offset = _position & (_dataSize - 1);
+        const uint64_t tail = _dataSize - offset;
+
+        _recordStart = _position;
+
+        CaptureRecordHeader recordHeader{0, 0, 0};
+        if(tail >= sizeof(recordHeader))
+            std::memcpy(&recordHeader, _data + offset, sizeof(recordHeader));
+
+        // Wrap marker
+        if(recordHeader.recordSize == 0)
+        {
+            _position += tail;
+            continue;
+        }
+
+        const size_t prefixSize = sizeof(CaptureRecordHeader) + sizeof(SpyServerMessageHeader);
+        bool sane = (recordHeader.recordSize >= prefixSize) and (recordHeader.recordSize <= tail);
+        if(sane)
+        {
+            std::memcpy(&record.header, _data + offset + sizeof(recordHeader), sizeof(record.header));
+            sane = (record.header.BodySize <= SPYSERVER_MAX_MESSAGE_BODY_SIZE)
+               and (recordHeader.recordSize == captureRecordSize(record.header.BodySize));
+        }
+
+        // Garbage means the writer got here first.
+        if(not sane or not this->lastRecordValid())
+        {
+            this->seekToLatest();
+            return Status::Overrun;
+        }
+
+        record.arrivalNs = recordHeader.arrivalNs;
+        record.body = _data + offset + prefixSize;
+        _position += recordHeader.recordSize;
+
+        return Status::Record;
+    }
+}
+
+bool SharedRingReader::lastRecordValid(void) const
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return (_header->reservePosition.load(std::memory_order_relaxed) - _recordStart) <= _dataSize;
+}
+
+uint64_t SharedRingReader::lag(void) const
+{
+    return _header->writePosition.load(std::memory_order_acquire) - _position;
+}
+
+void SharedRingReader::seekToLatest(void)
+{
+    _position = _header->writePosition.load(std::memory_order_acquire);
+    _recordStart = _position;
+}
@@ -0,0 +1,158 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include "SessionCapture.hpp"
+
+#include <spyserver_protocol.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+//
+// A POSIX shared memory ring of raw SpyServer messages, so one connection
+// can feed any number of local processes. One writer publishes every
+// message as a capture record; readers walk the records in place and
+// decode them themselves.
+//
+// The writer never waits for readers. Each reader checks, after using a
+// record, that the writer hasn't lapped it in the meantime, and skips
+// ahead to the newest data if it has.
+//
+// The header also keeps the latest device info and client sync, so
+// readers can start at any time.
+//
+
+static constexpr char SharedRingMagic[8] = {'S', 'P', 'Y', 'R', 'I', 'N', 'G', '\0'};
+static constexpr uint32_t SharedRingVersion = 1;
+
+struct SharedRingHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+
+    // A power of two.
+    uint64_t dataSize;
+
+    // In bytes since the ring was created. Records are at least reserved
+    // before they're written, and published once they're complete.
+    std::atomic<uint64_t> reservePosition;
+    std::atomic<uint64_t> writePosition;
+
+    std::atomic<uint32_t> closed;
+
+    // Odd while the fields below are being updated.
+    std::atomic<uint32_t> infoSequence;
+    uint32_t hasDeviceInfo;
+    uint32_t hasClientSync;
+    SpyServerDeviceInfo deviceInfo;
+    SpyServerClientSync clientSync;
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Shared rings need lock-free 64-bit atomics");
+
+//
+// Creates the ring and removes it when destroyed. Names are POSIX shared
+// memory names, with or without the leading slash. An existing ring of the
+// same name is an error, since another writer may still be using it,
+// unless asked to replace it.
+//
+class SharedRingWriter
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr size_t DefaultSize = 64 << 20;
+
+    SharedRingWriter(const std::string &name, const size_t size = DefaultSize, const bool replace = false);
+    ~SharedRingWriter(void);
+
+    inline const std::string &name(void) const noexcept
+    {
+        return _name;
+    }
+
+    void publish(
+        const Clock::time_point &arrivalTime,
+        const SpyServerMessageHeader &header,
+        const uint8_t *body);
+
+private:
+    void updateInfo(const uint32_t messageType, const uint8_t *body, const size_t size);
+
+    std::string _name;
+
+    uint8_t *_mapping{nullptr};
+    size_t _mappingSize{0};
+    SharedRingHeader *_header{nullptr};
+    uint8_t *_data{nullptr};
+    uint64_t _dataSize{0};
+
+    uint64_t _position{0};
+    Clock::time_point _startTime;
+
+    // Identifies the shared memory object, so removing it on destruction
+    // can't take a ring that replaced it.
+    uint64_t _device{0};
+    uint64_t _inode{0};
+};
+
+class SharedRingReader
+{
+public:
+    using Record = CaptureReader::Record;
+
+    enum class Status
+    {
+        Record,
+        Empty,
+        Overrun,
+        Closed
+    };
+
+    // Starts at the newest data.
+    SharedRingReader(const std::string &name);
+    ~SharedRingReader(void);
+
+    inline const std::string &name(void) const noexcept
+    {
+        return _name;
+    }
+
+    // Returns false until the writer has seen both.
+    bool info(SpyServerDeviceInfo &deviceInfo, SpyServerClientSync &clientSync) const;
+
+    // The record's body points into the ring, and is only valid until the
+    // writer laps it. After an overrun, reading resumes at the newest data.
+    Status next(Record &record);
+
+    // Whether the last record returned is still intact. Check after using it.
+    bool lastRecordValid(void) const;
+
+    // How far behind the writer we are, in bytes.
+    uint64_t lag(void) const;
+
+    inline uint64_t dataSize(void) const noexcept
+    {
+        return _dataSize;
+    }
+
+    void seekToLatest(void);
+
+private:
+    std::string _name;
+
+    const uint8_t *_mapping{nullptr};
+    size_t _mappingSize{0};
+    const SharedRingHeader *_header{nullptr};
+    const uint8_t *_data{nullptr};
+    uint64_t _dataSize{0};
+
+    uint64_t _position{0};
+    uint64_t _recordStart{0};
+};
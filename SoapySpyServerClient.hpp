@@ -3,7 +3,7 @@
 
 #pragma once
 
-#include "spyserver_client.h"
+#include "SpyServerSession.hpp"
 
 #include <SoapySDR/Constants.h>
 #include <SoapySDR/Device.hpp>
@@ -12,45 +12,98 @@
 #include <volk/volk_alloc.hh>
 
 #include <atomic>
-#include <cassert>
+#include <chrono>
+#include <complex>
+#include <cstdint>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <utility>
 
-struct SDRPPClient
+// One session with the server. With "windows", the device opens several,
+// each tuned on its own and exposed as its own channels.
+struct SoapySpyServerWindow
 {
-    static constexpr size_t MaxQueueSize = 128;
-    static constexpr size_t TimeoutMs = 1000;
+    std::unique_ptr<SpyServerSession> session;
 
-    std::unique_ptr<DSPComplexBufferQueue> bufferQueue;
-    spyserver::SpyServerClient client;
+    // Per channel, when channelized.
+    double sampleRate{0.0};
+    double serverSampleRate{0.0};
+    double basebandFrequency{0.0};
 
-    inline bool syncFields(void) const
-    {
-        assert(client);
-        assert(client->isOpen());
+    // The last RF frequency sent, reported until the server acknowledges it.
+    uint32_t requestedFrequency{0};
+    spyserver::SpyServerClientClass::Acknowledgement frequencyAck{0, 0};
 
-        return (client->waitForDevInfo(TimeoutMs) and client->waitForClientSync(TimeoutMs));
-    }
+    // The session streams while any of its streams is active.
+    size_t numActiveStreams{0};
 };
 
 struct SoapySpyServerStream
 {
     std::atomic_bool active{false};
+    std::vector<size_t> channels;
+
+    // Every channel of a stream is in the same window.
+    size_t window{0};
+
+    // Attached to the pipeline while active. Deactivating interrupts it, so
+    // a pending read returns right away.
+    std::shared_ptr<DSPComplexBufferQueue> queue;
+
+    // Guards the read position, so streams can be read concurrently. Only
+    // readers take it, so control calls never wait on a read.
+    std::mutex readMutex;
+    DSPComplexFramePtr currentFrame;
+    size_t startIndex{0};
+
+    // Set on activation, for the next read to drop its position.
+    std::atomic_bool resetPending{false};
+
+    // The pipeline counts a finite burst as it's queued, and flags its last
+    // frame, which the reader ends the burst with. Activation sets the burst,
+    // null when unlimited, and numbers itself before raising resetPending,
+    // and the next read takes both.
+    std::shared_ptr<IQBurst> burst;
+    std::atomic<uint64_t> activation{0};
+    std::shared_ptr<IQBurst> readBurst;
+    uint64_t readActivation{0};
+
+    // Set if this stream started the session's recording.
+    std::shared_ptr<CaptureWriter> recording;
 };
 
 class SoapySpyServerClient: public SoapySDR::Device
 {
 public:
     SoapySpyServerClient(const SoapySDR::Kwargs &args);
-    virtual ~SoapySpyServerClient(void) = default;
+    virtual ~SoapySpyServerClient(void);
+
+    // Applies any "freq", "gain", "rate", "wire" and "streaming_mode" among
+    // the arguments in a single write, and waits once for the server to
+    // acknowledge them all. With several windows, each gets them all.
+    // Exposed as the "apply_settings" setting.
+    void applySettings(const SoapySDR::Kwargs &args);
 
     /*******************************************************************
      * Utility
      ******************************************************************/
 
-    static SDRPPClient makeSDRPPClient(const SoapySDR::Kwargs &args);
+    // With a poll engine, the connection is never taken from the cache,
+    // since it would have threads of its own.
+    static std::unique_ptr<SpyServerSession> makeSession(const SoapySDR::Kwargs &args, net::PollEngine pollEngine = nullptr);
+    static std::unique_ptr<SpyServerSession> makeReplaySession(const SoapySDR::Kwargs &args);
+    static std::unique_ptr<SpyServerSession> makeAttachSession(const SoapySDR::Kwargs &args);
+
+    // Only what a session needs to reach the server or source, for find()
+    // and a lazy device's probe, leaving out anything that acts on opening,
+    // such as a capture.
+    static SoapySDR::Kwargs probeArgs(const SoapySDR::Kwargs &args);
+
+    // Whether opening a device with these arguments takes over a parked
+    // connection. Otherwise, parking one only holds a server slot until it
+    // expires.
+    static bool takesParkedConnection(const SoapySDR::Kwargs &args);
 
     static std::string ParamsToSpyServerURL(
         const std::string &host,
@@ -74,7 +127,7 @@ public:
 
     inline bool validChannelParams(const int direction, const size_t channel) const
     {
-        return (direction == SOAPY_SDR_RX) and (channel == 0);
+        return (direction == SOAPY_SDR_RX) and (channel < (_numChannels * _windows.size()));
     }
 
     size_t getNumChannels(const int direction) const;
@@ -85,10 +138,8 @@ public:
      * Stream API
      ******************************************************************/
 
-    inline bool validStream(SoapySDR::Stream* stream)
-    {
-        return (stream == (SoapySDR::Stream*)_stream.get());
-    }
+    // Set by readStream on the first samples after a retune.
+    static constexpr int RetuneFlag = SOAPY_SDR_USER_FLAG0;
 
     std::vector<std::string> getStreamFormats(const int direction, const size_t channel) const;
 
@@ -131,6 +182,37 @@ public:
 
     std::string getAntenna(const int direction, const size_t channel) const;
 
+    /*******************************************************************
+     * Frontend corrections API
+     ******************************************************************/
+
+    // The DC offset is subtracted, and the IQ balance is the weight w in
+    // y = x + w*conj(x). Both are in normalized full-scale units.
+
+    bool hasDCOffsetMode(const int direction, const size_t channel) const;
+
+    void setDCOffsetMode(const int direction, const size_t channel, const bool automatic);
+
+    bool getDCOffsetMode(const int direction, const size_t channel) const;
+
+    bool hasDCOffset(const int direction, const size_t channel) const;
+
+    void setDCOffset(const int direction, const size_t channel, const std::complex<double> &offset);
+
+    std::complex<double> getDCOffset(const int direction, const size_t channel) const;
+
+    bool hasIQBalance(const int direction, const size_t channel) const;
+
+    void setIQBalance(const int direction, const size_t channel, const std::complex<double> &balance);
+
+    std::complex<double> getIQBalance(const int direction, const size_t channel) const;
+
+    bool hasIQBalanceMode(const int direction, const size_t channel) const;
+
+    void setIQBalanceMode(const int direction, const size_t channel, const bool automatic);
+
+    bool getIQBalanceMode(const int direction, const size_t channel) const;
+
     /*******************************************************************
      * Gain API
      ******************************************************************/
@@ -156,9 +238,12 @@ public:
 
     static const std::string FrequencyName;
 
+    // Applied by mixing on the client, without a round trip to the server.
+    static const std::string BasebandFrequencyName;
+
     inline bool validFrequencyParams(const int direction, const size_t channel, const std::string &name) const
     {
-        return validChannelParams(direction, channel) and (name == FrequencyName);
+        return validChannelParams(direction, channel) and ((name == FrequencyName) or (name == BasebandFrequencyName));
     }
 
     void setFrequency(const int direction, const size_t channel, const std::string &name, const double frequency, const SoapySDR::Kwargs &args);
@@ -178,25 +263,167 @@ public:
     double getSampleRate(const int direction, const size_t channel) const;
 
     // Intentionally using deprecated API, no guaranteed step. Let Soapy deal with it.
+    // These are the server's native rates, which need no resampling.
     std::vector<double> listSampleRates(const int direction, const size_t channel) const;
 
+    SoapySDR::RangeList getSampleRateRange(const int direction, const size_t channel) const;
+
+    /*******************************************************************
+     * Time API
+     ******************************************************************/
+
+    // SpyServer has no timestamps, so this counts samples received at the
+    // server's IQ rate. It only advances while streaming, and is what
+    // readStream times and HAS_TIME activation refer to. Each window counts
+    // its own; this is the first's, or given a channel number as what, that
+    // channel's.
+    long long getHardwareTime(const std::string &what) const;
+
+    /*******************************************************************
+     * Sensor API
+     ******************************************************************/
+
+    std::vector<std::string> listSensors(void) const;
+
+    SoapySDR::ArgInfo getSensorInfo(const std::string &key) const;
+
+    std::string readSensor(const std::string &key) const;
+
+    /*******************************************************************
+     * Settings API
+     ******************************************************************/
+
+    SoapySDR::ArgInfoList getSettingInfo(void) const;
+
+    void writeSetting(const std::string &key, const std::string &value);
+
+    std::string readSetting(const std::string &key) const;
+
 private:
     //
-    // Fields
+    // Utility
     //
 
-    static constexpr int SDRPP_TIMEOUT_MS = 1000;
+    void updateMixer(const size_t channel);
+
+    // Opens the connection if needed, and applies the initial configuration
+    // from the device arguments. On failure, every session is closed again,
+    // so a lazy device starts over on its next use.
+    void connect(void);
+    void openWindows(void);
+
+    // Every call that needs the server goes through here first, so lazy
+    // devices connect on first use. Connecting calls setters that come back
+    // through here, which return immediately.
+    void ensureConnected(void) const;
+
+    inline size_t windowIndex(const size_t channel) const
+    {
+        return channel / _numChannels;
+    }
+
+    inline const SoapySpyServerWindow &window(const size_t channel) const
+    {
+        return _windows[this->windowIndex(channel)];
+    }
+
+    inline SoapySpyServerWindow &window(const size_t channel)
+    {
+        return _windows[this->windowIndex(channel)];
+    }
+
+    // Device-wide state, like sensors, comes from the first window.
+    inline SpyServerSession &connectedSession(const size_t channel = 0) const
+    {
+        this->ensureConnected();
+        return *this->window(channel).session;
+    }
+
+    // Queues the settings among the arguments in the current batch of the
+    // channel's window. Returns whether there were any.
+    bool queueSettings(const size_t channel, const SoapySDR::Kwargs &args);
+
+    // Ends the window's batch and waits for the server to apply it.
+    void sendSettings(const size_t channel, spyserver::CommandBatch &batch);
+
+    // Returns null for an unknown stream. Call with _streamMutex held. Readers
+    // keep their copy, so closing a stream never frees it under them.
+    std::shared_ptr<SoapySpyServerStream> getStream(SoapySDR::Stream *stream) const;
+
+    // Detaches an active stream from its window, stopping the window's
+    // stream if it was the last. Call with _streamMutex held.
+    void detachStream(SoapySpyServerStream &stream);
+
+    // Deactivates a stream whose burst was just read to the end, unless it's
+    // been deactivated, or activated again, since. The server's already
+    // been stopped, so this writes nothing to it.
+    void endBurst(SoapySpyServerStream &stream, const uint64_t activation);
+
+    // Channel center relative to its window's IQ stream, in Hz.
+    double channelOffset(const size_t channel) const;
+
+    // Rate sensors are averaged over windows of at least this long, so
+    // frequent polling doesn't make them noisy.
+    static constexpr double SensorWindowSeconds = 1.0;
+
+    struct SensorWindow
+    {
+        std::chrono::steady_clock::time_point start;
+        bool complete{false};
+
+        // Totals at the start of the window.
+        uint64_t bytesReceived{0};
+        uint64_t messagesReceived{0};
+        uint64_t messagesDecoded{0};
+        uint64_t decodeTimeNs{0};
+        uint64_t socketThreadCPUTimeNs{0};
+
+        // Averages over the last window.
+        double byteRate{0.0};
+        double messageRate{0.0};
+        double decodeTimeUs{0.0};
+        double socketThreadCPUPercent{0.0};
+    };
+
+    // Closes the current window if it's long enough. Call with _sensorMutex held.
+    void updateSensorWindow(void) const;
+
+    //
+    // Fields
+    //
 
     std::string _spyServerURL;
+    SoapySDR::Kwargs _args;
 
-    SDRPPClient _sdrppClient;
+    // Every window's connection is serviced by the one poll engine, rather
+    // than threads of its own. With a single window, there's no engine.
+    net::PollEngine _pollEngine;
+    std::vector<SoapySpyServerWindow> _windows;
 
-    volk::vector<dsp::complex_t> _currentBuffer;
-    size_t _startIndex{0};
+    // What's static about the device, known before connecting.
+    SpyServerDeviceInfo _deviceInfo;
+
+    // A lazy device only connects when something needs the server.
+    bool _lazy{false};
+    mutable std::atomic_bool _connected{false};
+    mutable bool _connecting{false};
+    mutable std::recursive_mutex _connectMutex;
+
+    // Per window. More than one channel means the IQ stream is channelized,
+    // and the sample rate is that of each channel, equal to the channel
+    // spacing.
+    size_t _numChannels{1};
 
-    double _sampleRate{0.0};
     std::vector<std::pair<uint32_t, double>> _sampleRates;
 
-    std::unique_ptr<SoapySpyServerStream> _stream;
+    // Only with the "pretrigger" argument.
+    std::shared_ptr<PreTriggerRing> _preTrigger;
+
+    // Streams share their window's connection, which streams while any is
+    // active.
+    std::vector<std::shared_ptr<SoapySpyServerStream>> _streams;
     mutable std::mutex _streamMutex;
+
+    mutable SensorWindow _sensorWindow;
+    mutable std::mutex _sensorMutex;
 };
@@ -0,0 +1,270 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "SpyServerSession.hpp"
+
+// Defined for std::make_shared, which takes them by reference.
+constexpr size_t SpyServerSession::MaxQueueSize;
+constexpr size_t SpyServerSession::DefaultTimeoutMs;
+
+//
+// Construction
+//
+
+SpyServerSession::SpyServerSession(const size_t timeoutMs):
+    _timeoutMs(timeoutMs),
+    _pipeline(_stats)
+{
+    _pipeline.setRetuneTimeout(static_cast<int>(timeoutMs));
+    _pipeline.setBurstsQueuedHandler([this](){ this->updateStreaming(); });
+}
+
+SpyServerSession::~SpyServerSession(void)
+{
+    // The watchdog uses the client, and a source feeds it. Closing the
+    // client joins its threads, so first wait out any message they're
+    // handling, which may use the client too.
+    _watchdog.reset();
+    _source.reset();
+    if(_client)
+        _client->setMessageHandler(nullptr);
+    _client.reset();
+}
+
+bool SpyServerSession::connect(
+    const std::string &host,
+    const uint16_t port,
+    const std::string &capturePath,
+    net::PollEngine pollEngine)
+{
+    assert(not _client);
+
+    if(not capturePath.empty())
+        _taps.startCapture(capturePath);
+
+    _client = spyserver::connect(host, port, this, pollEngine);
+
+    return static_cast<bool>(_client);
+}
+
+void SpyServerSession::adopt(spyserver::SpyServerClient &&client)
+{
+    assert(not _client);
+
+    _client = std::move(client);
+    _client->setMessageHandler(this);
+}
+
+void SpyServerSession::replay(std::unique_ptr<CaptureReader> reader, const bool realtime)
+{
+    assert(not _client);
+
+    _client.reset(new spyserver::SpyServerClientClass(this));
+    _source.reset(new CaptureReplay(
+        std::move(reader),
+        realtime,
+        *_client,
+        _stats,
+        [this](){ return _pipeline.outputQueuesFull(); }));
+}
+
+void SpyServerSession::attach(std::unique_ptr<SharedRingReader> reader)
+{
+    assert(not _client);
+
+    _client.reset(new spyserver::SpyServerClientClass(this));
+    _source.reset(new SharedRingAttach(std::move(reader), *_client, _stats));
+}
+
+spyserver::SpyServerClient SpyServerSession::release(void)
+{
+    assert(not _source and not _watchdog);
+
+    _client->setMessageHandler(nullptr);
+    return std::move(_client);
+}
+
+//
+// Client
+//
+
+bool SpyServerSession::isOpen(void) const
+{
+    return _client and _client->isOpen() and (not _source or _source->isOpen());
+}
+
+void SpyServerSession::configureThreads(const ThreadConfig &readConfig, const ThreadConfig &writeConfig)
+{
+    if(_source)
+        _source->configureThread(readConfig);
+    else
+        _client->configureThreads(readConfig, writeConfig);
+}
+
+void SpyServerSession::startStream(void)
+{
+    std::lock_guard<std::mutex> lock(_streamingMutex);
+
+    _streaming = true;
+    this->updateStreamingLocked();
+}
+
+void SpyServerSession::stopStream(void)
+{
+    std::lock_guard<std::mutex> lock(_streamingMutex);
+
+    _streaming = false;
+    this->updateStreamingLocked();
+}
+
+void SpyServerSession::updateStreaming(void)
+{
+    std::lock_guard<std::mutex> lock(_streamingMutex);
+    this->updateStreamingLocked();
+}
+
+void SpyServerSession::updateStreamingLocked(void)
+{
+    // Only written when it changes, so a stream finishing its burst after
+    // the server's been stopped doesn't write anything.
+    const bool serverStreaming = _streaming and not _pipeline.burstsQueued();
+    if(serverStreaming == _serverStreaming)
+        return;
+
+    _serverStreaming = serverStreaming;
+    if(serverStreaming)
+    {
+        _lastIQTimeNs = steadyTimeNs();
+        _client->startStream();
+    }
+    else _client->stopStream();
+
+    if(_source)
+        _source->setStreaming(serverStreaming);
+}
+
+spyserver::SpyServerClientClass::Acknowledgement SpyServerSession::setTuningSetting(const uint32_t setting, const uint32_t arg)
+{
+    // The server answers commands in order, so once the acknowledgement
+    // comes back, everything after it reflects the new setting. Without a
+    // server, it's acknowledged already.
+    spyserver::CommandBatch batch(*_client);
+    _client->setSetting(setting, arg);
+    const auto ack = _client->requestAcknowledgement();
+    _pipeline.beginRetune(*_client, ack);
+
+    // Bursts need whatever the retune discarded again.
+    this->updateStreaming();
+    batch.end();
+
+    return ack;
+}
+
+void SpyServerSession::startWatchdog(const std::string &host, const uint16_t port, const int stallTimeoutMs)
+{
+    if(_source or _watchdog)
+        return;
+
+    _watchdog.reset(new StreamWatchdog(*this, host, port, stallTimeoutMs));
+}
+
+//
+// Taps
+//
+
+void SpyServerSession::startRecording(std::shared_ptr<CaptureWriter> recording)
+{
+    _taps.startRecording(*_client, std::move(recording));
+}
+
+void SpyServerSession::stopRecording(void)
+{
+    _taps.stopRecording();
+}
+
+std::shared_ptr<CaptureWriter> SpyServerSession::currentRecording(void)
+{
+    return _taps.currentRecording();
+}
+
+void SpyServerSession::startSharing(std::unique_ptr<SharedRingWriter> ring)
+{
+    _taps.startSharing(*_client, std::move(ring));
+}
+
+void SpyServerSession::startPreTrigger(std::shared_ptr<PreTriggerRing> ring)
+{
+    _taps.startPreTrigger(*_client, std::move(ring));
+}
+
+//
+// Processing
+//
+
+bool SpyServerSession::handleMessage(
+    const SpyServerMessageHeader &header,
+    const uint8_t *body,
+    std::chrono::steady_clock::time_point receivedTime)
+{
+    _taps.write(receivedTime, header, body);
+    _stats.countMessage(header);
+
+    if(IQPipeline::isIQ(header))
+    {
+        _lastIQTimeNs = steadyTimeNs(receivedTime);
+        _pipeline.process(header, body, receivedTime);
+    }
+
+    // Sources have no socket thread to account for.
+    if(not _source)
+        _stats.sampleThreadCPUTime(receivedTime);
+
+    return true;
+}
+
+//
+// For the watchdog
+//
+
+int64_t SpyServerSession::steadyTimeNs(const std::chrono::steady_clock::time_point &time)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+bool SpyServerSession::streaming(void)
+{
+    std::lock_guard<std::mutex> lock(_streamingMutex);
+    return _serverStreaming;
+}
+
+void SpyServerSession::restartStream(void)
+{
+    std::lock_guard<std::mutex> lock(_streamingMutex);
+    if(not _serverStreaming)
+        return;
+
+    // Turn it off first, in case the server thinks it's still streaming.
+    spyserver::CommandBatch batch(*_client);
+    _client->stopStream();
+    _client->startStream();
+}
+
+bool SpyServerSession::reconnect(const std::string &host, const uint16_t port)
+{
+    // Called once the old connection's thread has stopped, and before the
+    // new one's starts, so the receive state is ours alone.
+    const bool reconnected = _client->reconnect(
+        host,
+        port,
+        [this](const spyserver::SpyServerClientClass::Acknowledgement &ack)
+        {
+            _stats.restartSequence();
+            _pipeline.beginRetune(*_client, ack);
+        });
+
+    // The settings resent don't include bursts the retune reopened.
+    if(reconnected)
+        this->updateStreaming();
+
+    return reconnected;
+}
@@ -0,0 +1,191 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include "IQPipeline.hpp"
+#include "MessageSource.hpp"
+#include "MessageTaps.hpp"
+#include "StreamStatistics.hpp"
+#include "StreamWatchdog.hpp"
+#include "ThreadUtils.hpp"
+
+#include "spyserver_client.h"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+//
+// Everything the driver keeps for one session: the protocol client, where
+// its messages come from when there's no server, and what's done with them.
+// Each message is copied to the taps, counted, and if it's IQ, handed to
+// the pipeline, all on the thread that received it.
+//
+class SpyServerSession: public spyserver::MessageHandler
+{
+public:
+    static constexpr size_t MaxQueueSize = 128;
+    static constexpr size_t DefaultTimeoutMs = 1000;
+
+    SpyServerSession(const size_t timeoutMs = DefaultTimeoutMs);
+    virtual ~SpyServerSession(void);
+
+    SpyServerSession(const SpyServerSession &) = delete;
+    SpyServerSession &operator=(const SpyServerSession &) = delete;
+
+    //
+    // Opening, each only once
+    //
+
+    // Returns false if the server can't be reached. A capture gets every
+    // message, starting with the handshake. With a poll engine, the
+    // connection has no threads of its own.
+    bool connect(
+        const std::string &host,
+        const uint16_t port,
+        const std::string &capturePath = "",
+        net::PollEngine pollEngine = nullptr);
+
+    // Takes over a connection opened elsewhere, as from the connection cache.
+    void adopt(spyserver::SpyServerClient &&client);
+
+    // Like a server, a replay only delivers IQ while streaming.
+    void replay(std::unique_ptr<CaptureReader> reader, const bool realtime);
+    void attach(std::unique_ptr<SharedRingReader> reader);
+
+    // Hands the connection back, for the connection cache, leaving the
+    // session closed.
+    spyserver::SpyServerClient release(void);
+
+    //
+    // Client
+    //
+
+    inline spyserver::SpyServerClientClass &client(void) const
+    {
+        assert(_client);
+        return *_client;
+    }
+
+    inline size_t timeoutMs(void) const
+    {
+        return _timeoutMs;
+    }
+
+    // Once settings sent outside of a batch are acknowledged, the fields
+    // reflect them.
+    inline bool syncFields(void) const
+    {
+        assert(this->isOpen());
+
+        return _client->waitForHandshake(static_cast<int>(_timeoutMs));
+    }
+
+    bool isOpen(void) const;
+
+    // With no server, the read configuration applies to the source's thread.
+    void configureThreads(const ThreadConfig &readConfig, const ThreadConfig &writeConfig);
+
+    // The server only streams while the pipeline still needs samples, so
+    // it stops once every attached burst is queued.
+    void startStream(void);
+    void stopStream(void);
+
+    // After attaching or detaching output queues, or retuning locally,
+    // which may change whether the pipeline needs samples.
+    void updateStreaming(void);
+
+    // Sends a setting that invalidates samples already in flight, and has
+    // the pipeline discard everything until the server acknowledges it.
+    spyserver::SpyServerClientClass::Acknowledgement setTuningSetting(const uint32_t setting, const uint32_t arg);
+
+    // Only for server connections, and only once.
+    void startWatchdog(const std::string &host, const uint16_t port, const int stallTimeoutMs);
+
+    //
+    // Taps
+    //
+
+    // Each starts with the current device info and sync.
+    void startRecording(std::shared_ptr<CaptureWriter> recording);
+    void stopRecording(void);
+    std::shared_ptr<CaptureWriter> currentRecording(void);
+
+    void startSharing(std::unique_ptr<SharedRingWriter> ring);
+    void startPreTrigger(std::shared_ptr<PreTriggerRing> ring);
+
+    //
+    // Processing
+    //
+
+    inline IQPipeline &pipeline(void)
+    {
+        return _pipeline;
+    }
+
+    inline StreamStatistics &stats(void)
+    {
+        return _stats;
+    }
+
+    bool handleMessage(
+        const SpyServerMessageHeader &header,
+        const uint8_t *body,
+        std::chrono::steady_clock::time_point receivedTime) override;
+
+    //
+    // For the watchdog
+    //
+
+    static int64_t steadyTimeNs(const std::chrono::steady_clock::time_point &time = std::chrono::steady_clock::now());
+
+    // Whether the server's meant to be streaming.
+    bool streaming(void);
+
+    // Steady clock time of the last IQ message, in nanoseconds.
+    inline int64_t lastIQTimeNs(void) const
+    {
+        return _lastIQTimeNs;
+    }
+
+    inline void resetIQTime(const int64_t timeNs)
+    {
+        _lastIQTimeNs = timeNs;
+    }
+
+    // Re-enables streaming, if the server's meant to be streaming.
+    void restartStream(void);
+
+    // Replaces the connection, resending every setting.
+    bool reconnect(const std::string &host, const uint16_t port);
+
+private:
+    size_t _timeoutMs;
+
+    StreamStatistics _stats;
+    IQPipeline _pipeline;
+    MessageTaps _taps;
+
+    // Call with _streamingMutex held.
+    void updateStreamingLocked(void);
+
+    // Serializes starting and stopping the stream. Streaming is what the
+    // driver asked for, and the server streams if the pipeline needs it too.
+    std::mutex _streamingMutex;
+    bool _streaming{false};
+    bool _serverStreaming{false};
+
+    std::atomic<int64_t> _lastIQTimeNs{0};
+
+    // Torn down in the destructor, in reverse order, so nothing still
+    // running calls back into a session that's going away.
+    spyserver::SpyServerClient _client;
+    std::unique_ptr<MessageSource> _source;
+    std::unique_ptr<StreamWatchdog> _watchdog;
+};
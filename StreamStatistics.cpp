@@ -0,0 +1,57 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "StreamStatistics.hpp"
+
+#include "ThreadUtils.hpp"
+
+void StreamStatistics::countMessage(const SpyServerMessageHeader &header)
+{
+    add(bytesReceived, sizeof(SpyServerMessageHeader) + header.BodySize);
+    add(messagesReceived, 1);
+    this->countSequence(header.SequenceNumber);
+}
+
+void StreamStatistics::countSequence(const uint32_t sequenceNumber)
+{
+    // Unsigned arithmetic handles wraparound.
+    if(_sequenceValid)
+    {
+        const uint32_t gap = sequenceNumber - _lastSequenceNumber - 1;
+        if((gap != 0) and (gap < 0x80000000u))
+            add(sequenceGaps, gap);
+    }
+
+    _lastSequenceNumber = sequenceNumber;
+    _sequenceValid = true;
+}
+
+void StreamStatistics::restartSequence(void)
+{
+    _sequenceValid = false;
+}
+
+constexpr std::chrono::milliseconds StreamStatistics::CPUSampleInterval;
+
+void StreamStatistics::sampleThreadCPUTime(const Clock::time_point &receivedTime)
+{
+    // Reading a thread's CPU time is a system call, unlike the steady clock.
+    const auto thread = std::this_thread::get_id();
+    if((thread == _cpuThread) and (receivedTime < _nextCPUSample))
+        return;
+
+    _nextCPUSample = receivedTime + CPUSampleInterval;
+
+    // A poll engine's thread carries on with its own clock across
+    // connections, but a connection's own read thread starts over.
+    const auto threadNs = currentThreadCPUTimeNs();
+    if(thread != _cpuThread)
+    {
+        _cpuTotalNs += _cpuThreadNs - _cpuThreadStartNs;
+        _cpuThread = thread;
+        _cpuThreadStartNs = threadNs;
+    }
+
+    _cpuThreadNs = threadNs;
+    set(socketThreadCPUTimeNs, _cpuTotalNs + _cpuThreadNs - _cpuThreadStartNs);
+}
@@ -0,0 +1,105 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include "LatencyHistogram.hpp"
+
+#include <spyserver_protocol.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+//
+// Running totals kept by the receive thread and read by sensors. Each
+// counter has a single writer thread, so increments are plain relaxed
+// loads and stores, and readers see each counter eventually,
+// but not necessarily consistent with each other. The histograms are
+// also written by readStream, and are lock-free on their own.
+//
+struct StreamStatistics
+{
+    using Clock = std::chrono::steady_clock;
+
+    const Clock::time_point startTime{Clock::now()};
+
+    // Headers and bodies, of every message type.
+    std::atomic<uint64_t> bytesReceived{0};
+    std::atomic<uint64_t> messagesReceived{0};
+
+    // IQ messages discarded before reaching the queue, e.g. across a retune.
+    std::atomic<uint64_t> messagesDropped{0};
+
+    // Messages the server numbered but never sent.
+    std::atomic<uint64_t> sequenceGaps{0};
+
+    std::atomic<uint64_t> messagesDecoded{0};
+    std::atomic<uint64_t> decodeTimeNs{0};
+
+    // Total for the thread running the data handler, sampled every
+    // CPUSampleInterval rather than on every message.
+    std::atomic<uint64_t> socketThreadCPUTimeNs{0};
+
+    // Written by the stall watchdog.
+    std::atomic<uint64_t> streamRestarts{0};
+    std::atomic<uint64_t> reconnects{0};
+
+    // Per-frame latency of each stage between a message's body arriving
+    // and readStream handing its samples out.
+    LatencyHistogram decodeLatency;  // Received to decoded
+    LatencyHistogram dspLatency;     // Decoded to enqueued
+    LatencyHistogram queueLatency;   // Enqueued to read
+    LatencyHistogram totalLatency;   // Received to read
+
+    static inline void add(std::atomic<uint64_t> &counter, const uint64_t value) noexcept
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    static inline void set(std::atomic<uint64_t> &counter, const uint64_t value) noexcept
+    {
+        counter.store(value, std::memory_order_relaxed);
+    }
+
+    static inline uint64_t get(const std::atomic<uint64_t> &counter) noexcept
+    {
+        return counter.load(std::memory_order_relaxed);
+    }
+
+    static inline uint64_t elapsedNs(const Clock::time_point &from, const Clock::time_point &to) noexcept
+    {
+        return (to > from) ? uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count()) : 0;
+    }
+
+    // The rest is only for the receive thread, or while there's none.
+
+    // Counts a message and its bytes, and any gap in sequence before it.
+    void countMessage(const SpyServerMessageHeader &header);
+
+    // For a message seen but not counted.
+    void countSequence(const uint32_t sequenceNumber);
+
+    // The next message starts the sequence over, as on a new connection.
+    void restartSequence(void);
+
+    // Adds the calling thread's CPU time, if CPUSampleInterval has passed
+    // since the last sample, going by message arrival times. A thread only
+    // counts from the first message it handles here, leaving out what it did
+    // before, such as a poll engine's other connections. Whenever a new thread
+    // takes over, as on reconnecting, its time adds to what earlier ones used.
+    void sampleThreadCPUTime(const Clock::time_point &receivedTime);
+
+    static constexpr std::chrono::milliseconds CPUSampleInterval{100};
+
+private:
+    bool _sequenceValid{false};
+    uint32_t _lastSequenceNumber{0};
+
+    std::thread::id _cpuThread;
+    Clock::time_point _nextCPUSample;
+    uint64_t _cpuTotalNs{0};
+    uint64_t _cpuThreadStartNs{0};
+    uint64_t _cpuThreadNs{0};
+};
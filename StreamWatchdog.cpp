@@ -0,0 +1,86 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "StreamWatchdog.hpp"
+
+#include "SpyServerSession.hpp"
+
+#include <SoapySDR/Logger.hpp>
+
+#include <algorithm>
+#include <chrono>
+
+StreamWatchdog::StreamWatchdog(
+    SpyServerSession &session,
+    const std::string &host,
+    const uint16_t port,
+    const int stallTimeoutMs):
+    _session(session),
+    _host(host),
+    _port(port),
+    _stallTimeoutMs(stallTimeoutMs)
+{
+    _thread = std::thread(&StreamWatchdog::worker, this);
+}
+
+StreamWatchdog::~StreamWatchdog(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cond.notify_all();
+
+    _thread.join();
+}
+
+void StreamWatchdog::worker(void)
+{
+    const auto timeoutNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::milliseconds(_stallTimeoutMs)).count();
+    const auto period = std::chrono::milliseconds(std::max(1, _stallTimeoutMs / 4));
+    bool restarted = false;
+    int64_t stepTimeNs = 0;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    while(not _cond.wait_for(lock, period, [this](){ return _stop; }))
+    {
+        const bool streaming = _session.streaming();
+
+        // Only IQ arriving, or the stream being started anew, moves this on
+        // from the last step.
+        const auto lastIQTimeNs = _session.lastIQTimeNs();
+        if(not streaming or (lastIQTimeNs != stepTimeNs))
+            restarted = false;
+
+        const bool stalled = (SpyServerSession::steadyTimeNs() - lastIQTimeNs) > timeoutNs;
+        const bool open = _session.isOpen();
+        if(not streaming or (open and not stalled))
+            continue;
+
+        // Restarting and reconnecting wait on the other threads.
+        lock.unlock();
+        if(open and not restarted)
+        {
+            SoapySDR::logf(SOAPY_SDR_WARNING, "SpyServer sent no IQ for %d ms. Restarting the stream.", _stallTimeoutMs);
+            _session.restartStream();
+            StreamStatistics::add(_session.stats().streamRestarts, 1);
+            restarted = true;
+        }
+        else
+        {
+            SoapySDR::logf(SOAPY_SDR_WARNING, "Reconnecting to SpyServer at %s:%u...", _host.c_str(), unsigned(_port));
+            if(_session.reconnect(_host, _port))
+            {
+                SoapySDR::log(SOAPY_SDR_INFO, "Reconnected.");
+                StreamStatistics::add(_session.stats().reconnects, 1);
+                restarted = false;
+            }
+            else SoapySDR::log(SOAPY_SDR_ERROR, "Failed to reconnect to SpyServer. Retrying.");
+        }
+
+        // Each step gets a full timeout to take effect.
+        stepTimeNs = SpyServerSession::steadyTimeNs();
+        _session.resetIQTime(stepTimeNs);
+        lock.lock();
+    }
+}
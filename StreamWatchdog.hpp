@@ -0,0 +1,42 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class SpyServerSession;
+
+//
+// Watches a server session for IQ messages stopping while it's streaming.
+// After the given time without any, streaming is re-enabled. If that
+// doesn't help either, the connection is replaced, with every setting sent
+// so far.
+//
+class StreamWatchdog
+{
+public:
+    StreamWatchdog(
+        SpyServerSession &session,
+        const std::string &host,
+        const uint16_t port,
+        const int stallTimeoutMs);
+    ~StreamWatchdog(void);
+
+private:
+    void worker(void);
+
+    SpyServerSession &_session;
+    std::string _host;
+    uint16_t _port;
+    int _stallTimeoutMs;
+
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    bool _stop{false};
+    std::thread _thread;
+};
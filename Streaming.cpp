@@ -4,40 +4,88 @@
 #include "spyserver_client.h"
 
 #include "SoapySpyServerClient.hpp"
+#include "Tracing.hpp"
 
 #include <SoapySDR/Constants.h>
 #include <SoapySDR/Formats.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <stdexcept>
 
 std::vector<std::string> SoapySpyServerClient::getStreamFormats(const int direction, const size_t channel) const
 {
-    return ((direction == SOAPY_SDR_RX) and (channel == 0)) ? std::vector<std::string>{SOAPY_SDR_CF32}
-                                                            : SoapySDR::Device::getStreamFormats(direction, channel);
+    return validChannelParams(direction, channel) ? std::vector<std::string>{SOAPY_SDR_CF32}
+                                                  : SoapySDR::Device::getStreamFormats(direction, channel);
+}
+
+std::shared_ptr<SoapySpyServerStream> SoapySpyServerClient::getStream(SoapySDR::Stream *stream) const
+{
+    for(const auto &candidate: _streams)
+    {
+        if(stream == (SoapySDR::Stream*)candidate.get())
+            return candidate;
+    }
+
+    return nullptr;
 }
 
 SoapySDR::Stream *SoapySpyServerClient::setupStream(
     const int direction,
     const std::string &format,
     const std::vector<size_t> &channels,
-    const SoapySDR::Kwargs &)
+    const SoapySDR::Kwargs &args)
 {
+    // Not while holding the stream mutex, since connecting can take a while.
+    this->ensureConnected();
+
     std::lock_guard<std::mutex> lock(_streamMutex);
 
-    if(_stream)
-        throw std::runtime_error("Stream already active");
     if(direction != SOAPY_SDR_RX)
         throw std::invalid_argument("SoapySpyServerClient only supports RX");
     if(format != SOAPY_SDR_CF32)
         throw std::invalid_argument("Invalid format: "+format);
-    if((channels.size() != 1) or (channels[0] != 0))
-        throw std::invalid_argument("SoapySpyServerClient only accepts RX channel 0");
 
-    _stream.reset(new SoapySpyServerStream);
+    std::vector<size_t> streamChannels = channels.empty() ? std::vector<size_t>{0} : channels;
+    for(size_t i = 0; i < streamChannels.size(); ++i)
+    {
+        if(not validChannelParams(direction, streamChannels[i]))
+            throw std::invalid_argument("Invalid channel: "+std::to_string(streamChannels[i]));
+        if(std::count(streamChannels.begin(), streamChannels.begin()+i, streamChannels[i]))
+            throw std::invalid_argument("Duplicate channel: "+std::to_string(streamChannels[i]));
+
+        // Windows are separate sessions, whose samples don't line up.
+        if(windowIndex(streamChannels[i]) != windowIndex(streamChannels[0]))
+            throw std::invalid_argument("Channels in different windows: "+std::to_string(streamChannels[0])+", "+std::to_string(streamChannels[i]));
+    }
+
+    auto newStream = std::make_shared<SoapySpyServerStream>();
+    newStream->window = windowIndex(streamChannels[0]);
+    newStream->channels = std::move(streamChannels);
+    newStream->queue = std::make_shared<DSPComplexBufferQueue>(SpyServerSession::MaxQueueSize);
+
+    // Optionally tee the raw messages to disk from the receive thread, in
+    // the same format as the "capture" device argument.
+    const auto recordIter = args.find("record");
+    if(recordIter != args.end())
+    {
+        for(const auto &window: _windows)
+        {
+            if(window.session->currentRecording())
+                throw std::runtime_error("Another stream is already recording");
+        }
+
+        const auto directIter = args.find("record_direct");
+        const bool direct = (directIter != args.end()) and SoapySDR::StringToSetting<bool>(directIter->second);
+
+        newStream->recording = std::make_shared<CaptureWriter>(recordIter->second, direct);
+        _windows[newStream->window].session->startRecording(newStream->recording);
+    }
+
+    _streams.emplace_back(std::move(newStream));
 
-    return (SoapySDR::Stream*)_stream.get();
+    return (SoapySDR::Stream*)_streams.back().get();
 }
 
 void SoapySpyServerClient::closeStream(SoapySDR::Stream *stream)
@@ -46,16 +94,31 @@ void SoapySpyServerClient::closeStream(SoapySDR::Stream *stream)
 
     if(not stream)
         throw std::invalid_argument("Null stream");
-    if(stream != (SoapySDR::Stream*)_stream.get())
+
+    const auto streamPtr = getStream(stream);
+    if(not streamPtr)
         throw std::invalid_argument("Invalid stream");
 
-    assert(_sdrppClient.client);
-    assert(_sdrppClient.client->isOpen());
+    auto &window = _windows[streamPtr->window];
+    assert(window.session);
+
+    // Anyone still reading gets woken, and keeps the stream alive until
+    // they're done with it.
+    streamPtr->queue->interrupt();
 
-    if(_stream->active)
-        _sdrppClient.client->stopStream();
+    if(streamPtr->active)
+        this->detachStream(*streamPtr);
 
-    _stream.reset(nullptr);
+    if(streamPtr->recording and (window.session->currentRecording() == streamPtr->recording))
+        window.session->stopRecording();
+
+    _streams.erase(std::find_if(
+        _streams.begin(),
+        _streams.end(),
+        [&streamPtr](const std::shared_ptr<SoapySpyServerStream> &candidate)
+        {
+            return (candidate == streamPtr);
+        }));
 }
 
 int SoapySpyServerClient::activateStream(
@@ -65,16 +128,46 @@ int SoapySpyServerClient::activateStream(
     const size_t numElems)
 {
     std::lock_guard<std::mutex> lock(_streamMutex);
-    if(not validStream(stream))
+
+    const auto streamPtr = getStream(stream);
+    if(not streamPtr)
         throw std::invalid_argument("Invalid stream");
-    if(_stream->active)
+    if(streamPtr->active)
         throw std::runtime_error("Stream is already active");
 
-    if((flags != 0) or (timeNs != 0) or (numElems != 0))
+    // A finite burst stops once numElems samples have arrived. END_BURST
+    // may or may not accompany it, but means nothing on its own.
+    if(flags & ~(SOAPY_SDR_END_BURST | SOAPY_SDR_HAS_TIME))
+        return SOAPY_SDR_NOT_SUPPORTED;
+    if((flags & SOAPY_SDR_END_BURST) and (numElems == 0))
         return SOAPY_SDR_NOT_SUPPORTED;
 
-    _sdrppClient.client->startStream();
-    _stream->active = true;
+    auto &window = _windows[streamPtr->window];
+
+    // Timed activation starts on the window's sample clock, which can't go
+    // back.
+    const bool timed = (flags & SOAPY_SDR_HAS_TIME);
+    if(timed and (timeNs < window.session->pipeline().sampleClockNs()))
+        return SOAPY_SDR_TIME_ERROR;
+
+    // Start from live samples, not whatever was left from last time. The
+    // next read drops its own position, so this never waits on a reader.
+    streamPtr->queue->clear();
+    streamPtr->queue->resetOverflow();
+    const auto burst = (numElems > 0) ? std::make_shared<IQBurst>(numElems) : nullptr;
+    std::atomic_store(&streamPtr->burst, burst);
+    streamPtr->activation++;
+    streamPtr->resetPending = true;
+
+    // Another stream's burst may have stopped the server.
+    window.session->pipeline().addOutputQueue(streamPtr->queue, timed, timeNs, burst);
+    if(window.numActiveStreams++ == 0)
+        window.session->startStream();
+    else
+        window.session->updateStreaming();
+
+    streamPtr->active = true;
+    streamPtr->queue->resume();
 
     return 0;
 }
@@ -85,78 +178,188 @@ int SoapySpyServerClient::deactivateStream(
     const long long timeNs)
 {
     std::lock_guard<std::mutex> lock(_streamMutex);
-    if(not validStream(stream))
+
+    const auto streamPtr = getStream(stream);
+    if(not streamPtr)
         throw std::invalid_argument("Invalid stream");
-    if(not _stream->active)
+    if(not streamPtr->active)
         throw std::runtime_error("Stream is already inactive");
 
     if((flags != 0) or (timeNs != 0))
         return SOAPY_SDR_NOT_SUPPORTED;
 
-    _sdrppClient.client->stopStream();
-    _stream->active = false;
+    this->detachStream(*streamPtr);
 
     return 0;
 }
 
+void SoapySpyServerClient::detachStream(SoapySpyServerStream &stream)
+{
+    assert(stream.active);
+
+    // Wake any pending read first, rather than after the server's told.
+    stream.active = false;
+    stream.queue->interrupt();
+
+    auto &window = _windows[stream.window];
+    window.session->pipeline().removeOutputQueue(stream.queue);
+
+    // The rest may be bursts that are done.
+    assert(window.numActiveStreams > 0);
+    if(--window.numActiveStreams == 0)
+        window.session->stopStream();
+    else
+        window.session->updateStreaming();
+}
+
+void SoapySpyServerClient::endBurst(SoapySpyServerStream &stream, const uint64_t activation)
+{
+    std::lock_guard<std::mutex> lock(_streamMutex);
+
+    if(stream.active and (stream.activation == activation))
+        this->detachStream(stream);
+}
+
 int SoapySpyServerClient::readStream(
     SoapySDR::Stream *stream,
     void * const *buffs,
     const size_t numElems,
-    int &,
-    long long &,
+    int &flags,
+    long long &timeNs,
     const long timeoutUs)
 {
-    std::lock_guard<std::mutex> lock(_streamMutex);
-
-    assert(_sdrppClient.bufferQueue);
+    // Only hold the device-wide lock long enough to find the stream, so
+    // readers and control calls don't wait on each other.
+    std::shared_ptr<SoapySpyServerStream> streamPtr;
+    {
+        std::lock_guard<std::mutex> lock(_streamMutex);
+        streamPtr = getStream(stream);
+    }
 
     // As a policy, don't throw.
-    if(not validStream(stream))
+    if(not streamPtr)
         return SOAPY_SDR_NOT_SUPPORTED;
-    if(not _stream->active)
+
+    std::lock_guard<std::mutex> readLock(streamPtr->readMutex);
+
+    if(not streamPtr->active)
         return SOAPY_SDR_NOT_SUPPORTED;
-    if(not buffs or not buffs[0])
+    if(not buffs)
         return SOAPY_SDR_NOT_SUPPORTED;
+    for(size_t i = 0; i < streamPtr->channels.size(); ++i)
+    {
+        if(not buffs[i])
+            return SOAPY_SDR_NOT_SUPPORTED;
+    }
+
+    flags = 0;
+
+    auto &session = *_windows[streamPtr->window].session;
+    auto &queue = *streamPtr->queue;
+    auto &currentFrame = streamPtr->currentFrame;
+    auto &startIndex = streamPtr->startIndex;
+
+    if(streamPtr->resetPending.exchange(false))
+    {
+        currentFrame.reset();
+        startIndex = 0;
+        streamPtr->readActivation = streamPtr->activation;
+        streamPtr->readBurst = std::atomic_load(&streamPtr->burst);
+    }
 
-    // The SpyServer client asychronously adds buffers to a queue as
-    // it receives data. If we haven't consumed the entirety of the
-    // latest buffer, we'll grab the next one here.
-    if(_currentBuffer.empty())
+    // Anything left over from before a retune is stale.
+    if(currentFrame and (currentFrame->retuneCount != session.pipeline().retuneCount()))
     {
-        if(_sdrppClient.bufferQueue->overflow())
+        currentFrame.reset();
+        startIndex = 0;
+    }
+
+    // The session's pipeline asynchronously adds buffers to each active
+    // stream's queue as it receives data. If we haven't consumed the
+    // entirety of the latest buffer, we'll grab the next one here.
+    if(not currentFrame)
+    {
+        if(queue.overflow())
         {
-            _sdrppClient.bufferQueue->resetOverflow();
+            queue.resetOverflow();
+            SPYSERVER_TRACE2(read_stream_return, SOAPY_SDR_OVERFLOW, flags);
             return SOAPY_SDR_OVERFLOW;
         }
 
-        const auto timeoutS = static_cast<double>(timeoutUs * 1e6);
-        if(not _sdrppClient.bufferQueue->dequeue(timeoutS, _currentBuffer))
-            return SOAPY_SDR_TIMEOUT;
+        const auto timeoutS = static_cast<double>(timeoutUs) / 1e6;
+        if(not queue.dequeue(timeoutS, currentFrame))
+        {
+            // Deactivation interrupts the wait.
+            const int ret = streamPtr->active ? SOAPY_SDR_TIMEOUT : SOAPY_SDR_NOT_SUPPORTED;
+            SPYSERVER_TRACE2(read_stream_return, ret, flags);
+            return ret;
+        }
+
+        auto &stats = session.stats();
+        const auto now = StreamStatistics::Clock::now();
+        stats.queueLatency.record(StreamStatistics::elapsedNs(currentFrame->enqueuedTime, now));
+        stats.totalLatency.record(StreamStatistics::elapsedNs(currentFrame->receivedTime, now));
     }
 
-    assert(not _currentBuffer.empty());
+    assert(currentFrame);
+    assert(not currentFrame->channels.empty());
+
+    // Every channel in a frame has the same number of samples.
+    const auto frameSize = currentFrame->channels.front().size();
+    assert(frameSize > 0);
+
+    if(currentFrame->firstAfterRetune and (startIndex == 0))
+        flags |= RetuneFlag;
+
+    // SpyServer sends no timestamps, so times are on the window's sample
+    // clock, counting the samples received. That is this device's hardware
+    // time: getHardwareTime reads the same clock and HAS_TIME activation
+    // waits on it, so the times are consistent with both.
+    if(currentFrame->hasTime)
+    {
+        const auto frameDurationNs = currentFrame->endTimeNs - currentFrame->timeNs;
+        timeNs = currentFrame->timeNs + (frameDurationNs * static_cast<long long>(startIndex)) / static_cast<long long>(frameSize);
+        flags |= SOAPY_SDR_HAS_TIME;
+    }
 
     static constexpr size_t elemSize = sizeof(std::complex<float>);
 
-    const auto actualNumElems = std::min(
-        numElems,
-        (_currentBuffer.size() - _startIndex));
-    assert((_startIndex + actualNumElems) <= _currentBuffer.size());
+    const auto actualNumElems = std::min(numElems, (frameSize - startIndex));
+    assert((startIndex + actualNumElems) <= frameSize);
+
+    for(size_t i = 0; i < streamPtr->channels.size(); ++i)
+    {
+        const auto &channelBuffer = currentFrame->channels[streamPtr->channels[i] % _numChannels];
+        assert(channelBuffer.size() == frameSize);
+
+        std::memcpy(
+            buffs[i],
+            &channelBuffer[startIndex],
+            actualNumElems * elemSize);
+    }
 
-    std::memcpy(
-        buffs[0],
-        &_currentBuffer[_startIndex],
-        actualNumElems * elemSize);
+    startIndex += actualNumElems;
+    assert(startIndex <= frameSize);
 
-    _startIndex += actualNumElems;
-    assert(_startIndex <= _currentBuffer.size());
+    // For a retune to know what to queue again.
+    if(streamPtr->readBurst)
+        streamPtr->readBurst->numRead += actualNumElems;
 
-    if(_startIndex == _currentBuffer.size())
+    if(startIndex == frameSize)
     {
-        _currentBuffer.clear();
-        _startIndex = 0;
+        // The stream goes inactive with the burst's last sample, so the
+        // next read returns SOAPY_SDR_NOT_SUPPORTED until it's activated
+        // again.
+        if(currentFrame->endOfBurst)
+        {
+            flags |= SOAPY_SDR_END_BURST;
+            this->endBurst(*streamPtr, streamPtr->readActivation);
+        }
+
+        currentFrame.reset();
+        startIndex = 0;
     }
 
+    SPYSERVER_TRACE2(read_stream_return, actualNumElems, flags);
     return static_cast<int>(actualNumElems);
 }
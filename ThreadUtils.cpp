@@ -0,0 +1,165 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "ThreadUtils.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#endif
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+uint64_t currentThreadCPUTimeNs(void)
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if(not GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+        return 0;
+
+    // FILETIMEs count 100 ns intervals.
+    const auto toNs = [](const FILETIME &time)
+    {
+        return ((uint64_t(time.dwHighDateTime) << 32) | time.dwLowDateTime) * 100;
+    };
+    return toNs(kernel) + toNs(user);
+#else
+    timespec time;
+    if(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) != 0)
+        return 0;
+
+    return (uint64_t(time.tv_sec) * 1000000000) + uint64_t(time.tv_nsec);
+#endif
+}
+
+std::vector<size_t> parseCPUList(const std::string &cpuList)
+{
+    std::vector<size_t> cpus;
+
+    const auto parseCPU = [&cpuList](const std::string &field) -> size_t
+    {
+        if(field.empty() or (field.find_first_not_of("0123456789") != std::string::npos))
+            throw std::invalid_argument("Invalid CPU list: "+cpuList);
+
+        return static_cast<size_t>(std::stoul(field));
+    };
+
+    size_t start = 0;
+    while(start <= cpuList.size())
+    {
+        auto end = cpuList.find(',', start);
+        if(end == std::string::npos)
+            end = cpuList.size();
+
+        const auto field = cpuList.substr(start, end - start);
+        const auto dash = field.find('-');
+        if(dash == std::string::npos)
+            cpus.emplace_back(parseCPU(field));
+        else
+        {
+            const auto first = parseCPU(field.substr(0, dash));
+            const auto last = parseCPU(field.substr(dash + 1));
+            if(first > last)
+                throw std::invalid_argument("Invalid CPU list: "+cpuList);
+
+            for(size_t cpu = first; cpu <= last; ++cpu)
+                cpus.emplace_back(cpu);
+        }
+
+        start = end + 1;
+    }
+
+    return cpus;
+}
+
+void configureCurrentThread(const ThreadConfig &config)
+{
+#ifdef _WIN32
+    // Thread names need a newer SDK than we require, so they're skipped.
+    if(not config.cpus.empty())
+    {
+        DWORD_PTR mask = 0;
+        for(const auto cpu: config.cpus)
+        {
+            if(cpu >= (sizeof(mask) * 8))
+                throw std::invalid_argument("CPU out of range: "+std::to_string(cpu));
+            mask |= (DWORD_PTR(1) << cpu);
+        }
+        if(SetThreadAffinityMask(GetCurrentThread(), mask) == 0)
+            throw std::runtime_error("Failed to set thread affinity");
+    }
+
+    int priority = THREAD_PRIORITY_NORMAL;
+    if(config.realtimePriority > 0)
+        priority = THREAD_PRIORITY_TIME_CRITICAL;
+    else if(config.setNice and (config.nice < 0))
+        priority = THREAD_PRIORITY_HIGHEST;
+    else if(config.setNice and (config.nice > 0))
+        priority = THREAD_PRIORITY_LOWEST;
+
+    if((priority != THREAD_PRIORITY_NORMAL) and not SetThreadPriority(GetCurrentThread(), priority))
+        throw std::runtime_error("Failed to set thread priority");
+#else
+    if(not config.name.empty())
+    {
+        const auto name = config.name.substr(0, 15);
+#if defined(__APPLE__)
+        pthread_setname_np(name.c_str());
+#else
+        pthread_setname_np(pthread_self(), name.c_str());
+#endif
+    }
+
+    if(not config.cpus.empty())
+    {
+#ifdef __linux__
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        for(const auto cpu: config.cpus)
+        {
+            if(cpu >= CPU_SETSIZE)
+                throw std::invalid_argument("CPU out of range: "+std::to_string(cpu));
+            CPU_SET(cpu, &cpuSet);
+        }
+
+        const int error = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+        if(error != 0)
+            throw std::runtime_error("Failed to set thread affinity: "+std::string(strerror(error)));
+#else
+        throw std::runtime_error("Thread affinity is unsupported on this platform");
+#endif
+    }
+
+    if(config.realtimePriority != 0)
+    {
+        sched_param param{};
+        param.sched_priority = config.realtimePriority;
+
+        const int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if(error != 0)
+            throw std::runtime_error("Failed to set SCHED_FIFO priority: "+std::string(strerror(error)));
+    }
+
+    if(config.setNice)
+    {
+#ifdef __linux__
+        // Linux applies nice values per thread, by kernel thread ID.
+        const auto tid = static_cast<id_t>(syscall(SYS_gettid));
+        if(setpriority(PRIO_PROCESS, tid, config.nice) != 0)
+            throw std::runtime_error("Failed to set nice value: "+std::string(strerror(errno)));
+#else
+        throw std::runtime_error("Per-thread nice values are unsupported on this platform");
+#endif
+    }
+#endif
+}
@@ -0,0 +1,36 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// CPU time used so far by the calling thread, or zero if unavailable.
+uint64_t currentThreadCPUTimeNs(void);
+
+//
+// Scheduling for a worker thread. Empty or zero fields are left alone.
+//
+struct ThreadConfig
+{
+    // Truncated to 15 characters, the limit on Linux.
+    std::string name;
+
+    std::vector<size_t> cpus;
+
+    // SCHED_FIFO priority, from 1 to 99.
+    int realtimePriority{0};
+
+    bool setNice{false};
+    int nice{0};
+};
+
+// Parses a CPU list of the form "0,2,4-7".
+std::vector<size_t> parseCPUList(const std::string &cpuList);
+
+// Applies the configuration to the calling thread, throwing on the first
+// setting that fails. Real-time priority usually needs CAP_SYS_NICE.
+void configureCurrentThread(const ThreadConfig &config);
@@ -0,0 +1,37 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+//
+// Static tracepoints on the streaming path, under the "soapyspyserver"
+// provider. Built with -DENABLE_TRACEPOINTS=ON, these are SystemTap SDT
+// (USDT) probes: a nop plus their arguments' evaluation until something
+// like bpftrace, perf or LTTng attaches. Otherwise they compile to nothing,
+// and their arguments aren't evaluated.
+//
+// Probes, and their arguments:
+//  * conn_read(requested, returned)
+//  * message_header(type, sequence, bodySize)
+//  * message_body(type, sequence, bodySize)
+//  * decode_done(sequence, numSamples, decodeNs)
+//  * enqueue(sequence, numSamples, numReaders)
+//  * queue_overflow(queueDepth, numDropped)
+//  * read_stream_return(ret, flags)
+//
+
+#ifdef ENABLE_TRACEPOINTS
+
+#include <sys/sdt.h>
+
+#define SPYSERVER_TRACE2(name, a, b) \
+    DTRACE_PROBE2(soapyspyserver, name, a, b)
+#define SPYSERVER_TRACE3(name, a, b, c) \
+    DTRACE_PROBE3(soapyspyserver, name, a, b, c)
+
+#else
+
+#define SPYSERVER_TRACE2(name, a, b) ((void)0)
+#define SPYSERVER_TRACE3(name, a, b, c) ((void)0)
+
+#endif
@@ -0,0 +1,38 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include <cstdint>
+
+// CPU time used by every thread in the process, in seconds.
+static inline double processCPUSeconds(void)
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if(not GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+        return 0.0;
+
+    const auto toSeconds = [](const FILETIME &time)
+    {
+        return double((uint64_t(time.dwHighDateTime) << 32) | time.dwLowDateTime) / 1e7;
+    };
+    return toSeconds(kernel) + toSeconds(user);
+#else
+    rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0.0;
+
+    const auto toSeconds = [](const timeval &time)
+    {
+        return double(time.tv_sec) + (double(time.tv_usec) / 1e6);
+    };
+    return toSeconds(usage.ru_utime) + toSeconds(usage.ru_stime);
+#endif
+}
@@ -0,0 +1,200 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+//
+// Repeatedly activates a stream for a finite burst on a loopback mock
+// SpyServer, reads until END_BURST, and activates it again. Every burst must
+// deliver exactly the requested number of samples, even with a retune
+// partway through, and leave the stream inactive. Every few bursts, reading
+// waits until the server should have stopped, which it must have done
+// within a few messages of the burst's end. Exits nonzero on the first
+// burst that doesn't.
+//
+
+#include "MockSpyServer.hpp"
+
+#include "SoapySpyServerClient.hpp"
+
+#include <SoapySDR/Errors.hpp>
+#include <SoapySDR/Formats.hpp>
+
+#include <chrono>
+#include <complex>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+struct BurstOptions
+{
+    size_t bursts{50};
+    size_t burstSize{10000};
+    MockSpyServerConfig server;
+};
+
+//
+// Options
+//
+
+static void printUsage(const char *name)
+{
+    std::printf(
+        "Usage: %s [options]\n"
+        "  --bursts <n>      Bursts to read (default: %zu)\n"
+        "  --burst-size <n>  Samples per burst (default: %zu)\n"
+        "  --port <n>        Loopback port (default: %u)\n",
+        name,
+        BurstOptions().bursts,
+        BurstOptions().burstSize,
+        unsigned(MockSpyServerConfig().port));
+}
+
+static BurstOptions parseOptions(int argc, char **argv)
+{
+    BurstOptions options;
+    options.server.maximumSampleRate = 2000000;
+    options.server.samplesPerMessage = 1024;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        const std::string arg(argv[i]);
+        const auto next = [&]() -> std::string
+        {
+            if(++i >= argc)
+                throw std::invalid_argument("Missing value for "+arg);
+
+            return argv[i];
+        };
+
+        if(arg == "--bursts")          options.bursts = std::stoul(next());
+        else if(arg == "--burst-size") options.burstSize = std::stoul(next());
+        else if(arg == "--port")       options.server.port = static_cast<uint16_t>(std::stoul(next()));
+        else if((arg == "--help") or (arg == "-h"))
+        {
+            printUsage(argv[0]);
+            std::exit(EXIT_SUCCESS);
+        }
+        else throw std::invalid_argument("Unknown option: "+arg);
+    }
+
+    if(options.burstSize == 0)
+        throw std::invalid_argument("Burst size must be positive");
+
+    return options;
+}
+
+//
+// Bursts
+//
+
+// Reads one burst to its end, retuning once about halfway if asked.
+static size_t readBurst(SoapySpyServerClient &device, SoapySDR::Stream *stream, const size_t burstSize, const bool retune)
+{
+    static constexpr size_t BufferSize = 4096;
+    std::vector<std::complex<float>> buffer(BufferSize);
+    void *buffPtrs[] = {buffer.data()};
+
+    size_t total = 0;
+    bool retuned = false;
+    for(;;)
+    {
+        if(retune and not retuned and (total >= burstSize/2))
+        {
+            const auto &name = SoapySpyServerClient::FrequencyName;
+            device.setFrequency(SOAPY_SDR_RX, 0, name, device.getFrequency(SOAPY_SDR_RX, 0, name)+1e6, SoapySDR::Kwargs());
+            retuned = true;
+        }
+
+        int flags = 0;
+        long long timeNs = 0;
+        const int ret = device.readStream(stream, buffPtrs, BufferSize, flags, timeNs, 1000000);
+        if(ret == SOAPY_SDR_OVERFLOW)
+            continue;
+        if(ret < 0)
+            throw std::runtime_error(std::string("readStream: ")+SoapySDR::errToStr(ret));
+
+        total += static_cast<size_t>(ret);
+        if(total > burstSize)
+            throw std::runtime_error("Read "+std::to_string(total)+" samples of a "+std::to_string(burstSize)+" sample burst");
+        if(flags & SOAPY_SDR_END_BURST)
+            return total;
+    }
+}
+
+// Messages the server may send after a burst, while its stop is on the way
+// and the client catches up on any already sent. Far fewer than a slow
+// reader would cost if the stop waited on reading.
+static constexpr uint64_t MaxOvershootMessages = SpyServerSession::MaxQueueSize / 2;
+
+static void runBurst(MockSpyServer &server, SoapySpyServerClient &device, SoapySDR::Stream *stream, const size_t burstSize, const bool retune, const bool slow)
+{
+    const auto samplesBefore = server.samplesSent();
+
+    const int activateRet = device.activateStream(stream, SOAPY_SDR_END_BURST, 0, burstSize);
+    if(activateRet != 0)
+        throw std::runtime_error(std::string("activateStream: ")+SoapySDR::errToStr(activateRet));
+
+    // A slow reader mustn't keep the server streaming.
+    if(slow)
+    {
+        const auto burstDuration = std::chrono::duration<double>(double(burstSize) / double(server.config().maximumSampleRate));
+        std::this_thread::sleep_for(std::chrono::duration_cast<Clock::duration>(burstDuration * 4) + std::chrono::milliseconds(200));
+
+        const auto sent = server.samplesSent() - samplesBefore;
+        const auto limit = burstSize + (MaxOvershootMessages * server.config().samplesPerMessage);
+        if(sent > limit)
+            throw std::runtime_error("Server sent "+std::to_string(sent)+" samples for a "+std::to_string(burstSize)+" sample burst");
+    }
+
+    const auto total = readBurst(device, stream, burstSize, retune);
+    if(total != burstSize)
+        throw std::runtime_error("Burst ended after "+std::to_string(total)+" of "+std::to_string(burstSize)+" samples");
+
+    // The burst's last read deactivated the stream.
+    std::complex<float> sample;
+    void *buffPtrs[] = {&sample};
+    int flags = 0;
+    long long timeNs = 0;
+    const int ret = device.readStream(stream, buffPtrs, 1, flags, timeNs, 0);
+    if(ret != SOAPY_SDR_NOT_SUPPORTED)
+        throw std::runtime_error("Stream still readable after END_BURST: "+std::to_string(ret));
+}
+
+int main(int argc, char **argv)
+{
+    try
+    {
+        const auto options = parseOptions(argc, argv);
+        MockSpyServer server(options.server);
+
+        SoapySpyServerClient device(SoapySDR::Kwargs{
+            {"host", server.config().host},
+            {"port", std::to_string(server.config().port)}});
+
+        auto *stream = device.setupStream(SOAPY_SDR_RX, SOAPY_SDR_CF32, {0}, SoapySDR::Kwargs());
+
+        const auto start = Clock::now();
+        for(size_t i = 0; i < options.bursts; ++i)
+            runBurst(server, device, stream, options.burstSize, (i % 2) == 1, (i % 5) == 0);
+
+        device.closeStream(stream);
+
+        std::printf(
+            "%zu bursts of %zu samples read and reactivated in %.2f s\n",
+            options.bursts,
+            options.burstSize,
+            std::chrono::duration<double>(Clock::now() - start).count());
+    }
+    catch(const std::exception &ex)
+    {
+        std::fprintf(stderr, "Error: %s\n", ex.what());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,280 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+//
+// Times each IQDecoder kernel per wire format, message size and VOLK
+// implementation, and checks every result against a scalar reference.
+//
+
+#include "IQDecoder.hpp"
+
+#include <volk/volk.h>
+#include <volk/volk_alloc.hh>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <random>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static const std::vector<SpyServerStreamFormat> Formats{
+    SPYSERVER_STREAM_FORMAT_UINT8,
+    SPYSERVER_STREAM_FORMAT_INT16,
+    SPYSERVER_STREAM_FORMAT_FLOAT};
+
+// Allow for float rounding in the kernels, relative to full scale.
+static constexpr double Tolerance = 1e-5;
+
+// A typical digital gain and a mild correction, so no term is trivial.
+static constexpr float Gain = 1.5f;
+static const AffineCoefficients CorrectionMatrix{1.01f, 0.02f, -0.03f, 0.98f, 0.001f, -0.002f};
+
+struct BenchmarkOptions
+{
+    std::vector<size_t> sizes{1024, 16384, 131072};
+    double minTime{0.2};
+};
+
+//
+// Utility
+//
+
+static std::string formatName(const SpyServerStreamFormat format)
+{
+    switch(format)
+    {
+    case SPYSERVER_STREAM_FORMAT_UINT8: return "uint8";
+    case SPYSERVER_STREAM_FORMAT_INT16: return "int16";
+    case SPYSERVER_STREAM_FORMAT_FLOAT: return "float";
+    default:                            return "unknown";
+    }
+}
+
+static std::vector<size_t> parseSizes(const std::string &str)
+{
+    std::vector<size_t> sizes;
+
+    size_t start = 0;
+    while(start <= str.size())
+    {
+        const auto end = std::min(str.find(',', start), str.size());
+        sizes.emplace_back(std::stoul(str.substr(start, end - start)));
+        start = end + 1;
+    }
+
+    return sizes;
+}
+
+static BenchmarkOptions parseOptions(int argc, char **argv)
+{
+    BenchmarkOptions options;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        const std::string arg(argv[i]);
+        if((arg == "--sizes") and ((i+1) < argc))
+            options.sizes = parseSizes(argv[++i]);
+        else if((arg == "--min-time") and ((i+1) < argc))
+            options.minTime = std::stod(argv[++i]);
+        else
+        {
+            std::printf(
+                "Usage: %s [--sizes <samples>[,<samples>...]] [--min-time <s>]\n",
+                argv[0]);
+            std::exit((arg == "--help") ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    return options;
+}
+
+// Random wire samples spanning the format's full range.
+static volk::vector<uint8_t> makeInput(const SpyServerStreamFormat format, const size_t numSamples)
+{
+    std::mt19937 rng(1234);
+    volk::vector<uint8_t> input;
+
+    switch(format)
+    {
+    case SPYSERVER_STREAM_FORMAT_UINT8:
+    {
+        std::uniform_int_distribution<int> dist(0, 255);
+        input.resize(numSamples * 2);
+        for(auto &value: input) value = static_cast<uint8_t>(dist(rng));
+        break;
+    }
+
+    case SPYSERVER_STREAM_FORMAT_INT16:
+    {
+        std::uniform_int_distribution<int> dist(-32768, 32767);
+        input.resize(numSamples * 2 * sizeof(int16_t));
+        auto *values = reinterpret_cast<int16_t*>(input.data());
+        for(size_t i = 0; i < (numSamples * 2); ++i) values[i] = static_cast<int16_t>(dist(rng));
+        break;
+    }
+
+    default:
+    {
+        std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+        input.resize(numSamples * 2 * sizeof(float));
+        auto *values = reinterpret_cast<float*>(input.data());
+        for(size_t i = 0; i < (numSamples * 2); ++i) values[i] = dist(rng);
+        break;
+    }
+    }
+
+    return input;
+}
+
+static double rawValue(const SpyServerStreamFormat format, const uint8_t *input, const size_t index)
+{
+    switch(format)
+    {
+    case SPYSERVER_STREAM_FORMAT_UINT8: return input[index];
+    case SPYSERVER_STREAM_FORMAT_INT16: return reinterpret_cast<const int16_t*>(input)[index];
+    default:                            return reinterpret_cast<const float*>(input)[index];
+    }
+}
+
+// Largest difference from a double-precision evaluation of the same transform.
+static double maxError(
+    const SpyServerStreamFormat format,
+    const uint8_t *input,
+    const AffineCoefficients &coeffs,
+    const volk::vector<dsp::complex_t> &output)
+{
+    double error = 0.0;
+    for(size_t i = 0; i < output.size(); ++i)
+    {
+        const double re = rawValue(format, input, 2*i);
+        const double im = rawValue(format, input, (2*i)+1);
+
+        const double expectedRe = (double(coeffs.a00) * re) + (double(coeffs.a01) * im) + coeffs.b0;
+        const double expectedIm = (double(coeffs.a10) * re) + (double(coeffs.a11) * im) + coeffs.b1;
+
+        error = std::max(error, std::abs(double(output[i].re) - expectedRe));
+        error = std::max(error, std::abs(double(output[i].im) - expectedIm));
+    }
+
+    return error;
+}
+
+// Repeats the kernel for at least the given time and returns ns/sample.
+template <typename Fcn>
+static double timeKernel(const Fcn &fcn, const size_t numSamples, const double minTime)
+{
+    // Warm up caches and VOLK's dispatcher.
+    fcn();
+
+    size_t iterations = 0;
+    const auto start = Clock::now();
+    double elapsed = 0.0;
+    do
+    {
+        for(size_t i = 0; i < 16; ++i) fcn();
+        iterations += 16;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    } while(elapsed < minTime);
+
+    return (elapsed * 1e9) / double(iterations * numSamples);
+}
+
+//
+// Benchmark
+//
+
+int main(int argc, char **argv)
+{
+    try
+    {
+        const auto options = parseOptions(argc, argv);
+
+        std::printf("VOLK machine: %s\n\n", volk_get_machine());
+        std::printf("%-8s %10s %-16s %12s %12s\n", "Format", "Samples", "Kernel", "ns/sample", "Max error");
+
+        bool allPassed = true;
+        for(const auto format: Formats)
+        {
+            auto decoder = IQDecoder::make(format);
+
+            // Every kernel is checked against the decoder's own mapping.
+            const auto scale = decoder->scale(Gain);
+            const auto offset = decoder->offset(Gain);
+            const AffineCoefficients plain{scale, 0.0f, 0.0f, scale, offset, offset};
+
+            const auto &m = CorrectionMatrix;
+            const AffineCoefficients corrected{
+                m.a00 * scale, m.a01 * scale,
+                m.a10 * scale, m.a11 * scale,
+                (m.a00 + m.a01) * offset + m.b0,
+                (m.a10 + m.a11) * offset + m.b1};
+
+            // An empty name lets VOLK dispatch.
+            auto kernels = decoder->implementations();
+            kernels.insert(kernels.begin(), "");
+
+            for(const auto numSamples: options.sizes)
+            {
+                if((numSamples * decoder->sampleSize()) > SPYSERVER_MAX_MESSAGE_BODY_SIZE)
+                    continue;
+
+                const auto input = makeInput(format, numSamples);
+                volk::vector<dsp::complex_t> output(numSamples);
+
+                const auto report = [&](const std::string &kernel, const double nsPerSample, const AffineCoefficients &coeffs)
+                {
+                    const double error = maxError(format, input.data(), coeffs, output);
+                    const bool passed = (error <= Tolerance);
+                    allPassed = allPassed and passed;
+
+                    std::printf(
+                        "%-8s %10zu %-16s %12.3f %12.2e%s\n",
+                        formatName(format).c_str(),
+                        numSamples,
+                        kernel.c_str(),
+                        nsPerSample,
+                        error,
+                        passed ? "" : "  FAIL");
+                };
+
+                for(const auto &kernel: kernels)
+                {
+                    decoder->setImplementation(kernel);
+                    const auto nsPerSample = timeKernel(
+                        [&](){ decoder->decode(input.data(), numSamples, Gain, output.data()); },
+                        numSamples,
+                        options.minTime);
+
+                    report(kernel.empty() ? "dispatch" : kernel, nsPerSample, plain);
+                }
+                decoder->setImplementation("");
+
+                const auto nsPerSample = timeKernel(
+                    [&](){ decoder->decodeAffine(input.data(), numSamples, corrected, output.data()); },
+                    numSamples,
+                    options.minTime);
+
+                report("affine", nsPerSample, corrected);
+            }
+        }
+
+        if(not allPassed)
+        {
+            std::fprintf(stderr, "\nSome kernels disagree with the scalar reference.\n");
+            return EXIT_FAILURE;
+        }
+    }
+    catch(const std::exception &ex)
+    {
+        std::fprintf(stderr, "Error: %s\n", ex.what());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
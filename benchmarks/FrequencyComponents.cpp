@@ -0,0 +1,86 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+//
+// Tunes a device on a loopback mock SpyServer through SoapySDR's default
+// setFrequency, which tunes RF, reads it back, and gives BB the remainder.
+// Every retune must land on RF, leaving BB at 0, whether or not the stream
+// is active. Exits nonzero on the first one that doesn't.
+//
+
+#include "MockSpyServer.hpp"
+
+#include "SoapySpyServerClient.hpp"
+
+#include <SoapySDR/Formats.hpp>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <stdexcept>
+#include <string>
+
+static void checkFrequency(SoapySDR::Device &device, const std::string &name, const double expected, const double frequency)
+{
+    const auto actual = (name.empty()) ? device.getFrequency(SOAPY_SDR_RX, 0)
+                                       : device.getFrequency(SOAPY_SDR_RX, 0, name);
+    if(std::abs(actual - expected) > 1e-3)
+    {
+        throw std::runtime_error(
+            "Tuned to "+std::to_string(frequency)+
+            ", "+((name.empty()) ? std::string("overall") : name)+
+            " is "+std::to_string(actual)+
+            " instead of "+std::to_string(expected));
+    }
+}
+
+// Each retune moves RF further than the mixer could make up for.
+static void runRetunes(SoapySDR::Device &device, const size_t count)
+{
+    for(size_t i = 0; i < count; ++i)
+    {
+        const double frequency = 100e6 + (((i % 2) == 0) ? 1.0 : -1.0) * ((i + 1) * 7e6);
+        device.setFrequency(SOAPY_SDR_RX, 0, frequency);
+
+        checkFrequency(device, SoapySpyServerClient::FrequencyName, frequency, frequency);
+        checkFrequency(device, SoapySpyServerClient::BasebandFrequencyName, 0.0, frequency);
+        checkFrequency(device, "", frequency, frequency);
+    }
+}
+
+int main(void)
+{
+    try
+    {
+        MockSpyServerConfig config;
+        config.maximumSampleRate = 2000000;
+        config.samplesPerMessage = 1024;
+        MockSpyServer server(config);
+
+        SoapySpyServerClient device(SoapySDR::Kwargs{
+            {"host", server.config().host},
+            {"port", std::to_string(server.config().port)}});
+
+        static constexpr size_t Retunes = 10;
+        runRetunes(device, Retunes);
+
+        auto *stream = device.setupStream(SOAPY_SDR_RX, SOAPY_SDR_CF32, {0}, SoapySDR::Kwargs());
+        if(device.activateStream(stream, 0, 0, 0) != 0)
+            throw std::runtime_error("activateStream failed");
+
+        runRetunes(device, Retunes);
+
+        device.deactivateStream(stream, 0, 0);
+        device.closeStream(stream);
+
+        std::printf("%zu default retunes landed on RF, with BB at 0\n", 2*Retunes);
+    }
+    catch(const std::exception &ex)
+    {
+        std::fprintf(stderr, "Error: %s\n", ex.what());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,389 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "MockSpyServer.hpp"
+
+#include "ThreadUtils.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+static constexpr uint32_t MockDeviceSerial = 0x5350591E;
+static constexpr uint32_t MockMinimumFrequency = 24000000;
+static constexpr uint32_t MockMaximumFrequency = 1800000000;
+static constexpr uint32_t MockDecimationStages = 8;
+static constexpr uint32_t MockMaximumGain = 21;
+
+//
+// Construction
+//
+
+MockSpyServer::MockSpyServer(const MockSpyServerConfig &config):
+    _config(config),
+    _maximumSampleRate(config.maximumSampleRate)
+{
+    const size_t numSamples = _config.samplesPerMessage;
+    if((numSamples == 0) or ((numSamples * 2 * sizeof(float)) > SPYSERVER_MAX_MESSAGE_BODY_SIZE))
+        throw std::invalid_argument("Invalid samples per message");
+
+    // A tone that completes a whole number of cycles per message, so
+    // repeating the same body keeps it continuous.
+    _uint8Body.resize(numSamples * 2);
+    _int16Body.resize(numSamples * 2 * sizeof(int16_t));
+    _floatBody.resize(numSamples * 2 * sizeof(float));
+
+    auto *int16Samples = reinterpret_cast<int16_t*>(_int16Body.data());
+    auto *floatSamples = reinterpret_cast<float*>(_floatBody.data());
+    const double cycles = std::max<double>(1.0, double(numSamples / 8));
+
+    for(size_t i = 0; i < (numSamples * 2); ++i)
+    {
+        const double phase = (2.0 * M_PI * cycles * double(i / 2)) / double(numSamples);
+        const double value = 0.5 * ((i % 2) ? std::sin(phase) : std::cos(phase));
+
+        _uint8Body[i] = static_cast<uint8_t>(std::lround((value * 127.0) + 128.0));
+        int16Samples[i] = static_cast<int16_t>(std::lround(value * 32767.0));
+        floatSamples[i] = static_cast<float>(value);
+    }
+
+    _listener = net::listen(_config.host, _config.port);
+    if(not _listener)
+        throw std::runtime_error("MockSpyServer: failed to listen on "+_config.host+":"+std::to_string(_config.port));
+
+    _listener->acceptAsync(acceptHandler, this);
+}
+
+MockSpyServer::~MockSpyServer(void)
+{
+    if(_listener)
+        _listener->close();
+
+    std::lock_guard<std::mutex> lock(_sessionsMutex);
+    for(auto &session: _sessions)
+    {
+        {
+            std::lock_guard<std::mutex> sessionLock(session->mutex);
+            session->running = false;
+        }
+        session->cond.notify_all();
+        session->conn->close();
+
+        if(session->commandThread.joinable())
+            session->commandThread.join();
+        if(session->streamThread.joinable())
+            session->streamThread.join();
+    }
+}
+
+//
+// Getters/setters
+//
+
+void MockSpyServer::setMaximumSampleRate(const uint32_t rate)
+{
+    _maximumSampleRate = rate;
+}
+
+uint64_t MockSpyServer::samplesSent(void) const
+{
+    return _samplesSent;
+}
+
+uint64_t MockSpyServer::messagesSent(void) const
+{
+    return _messagesSent;
+}
+
+double MockSpyServer::cpuSeconds(void) const
+{
+    std::lock_guard<std::mutex> lock(const_cast<std::mutex&>(_sessionsMutex));
+
+    uint64_t cpuNs = _reapedCPUNs;
+    for(const auto &session: _sessions)
+        cpuNs += session->commandCPUNs + session->streamCPUNs;
+
+    return double(cpuNs) / 1e9;
+}
+
+//
+// Sessions
+//
+
+void MockSpyServer::acceptHandler(net::Conn conn, void *ctx)
+{
+    auto *self = static_cast<MockSpyServer*>(ctx);
+
+    std::unique_ptr<Session> session(new Session);
+    session->conn = std::move(conn);
+    session->format = static_cast<uint32_t>(self->_config.format);
+
+    auto &sessionRef = *session;
+    {
+        std::lock_guard<std::mutex> lock(self->_sessionsMutex);
+        self->reapSessions();
+        self->_sessions.emplace_back(std::move(session));
+    }
+    sessionRef.commandThread = std::thread(&MockSpyServer::commandLoop, self, std::ref(sessionRef));
+    sessionRef.streamThread = std::thread(&MockSpyServer::streamLoop, self, std::ref(sessionRef));
+
+    // Keep accepting.
+    self->_listener->acceptAsync(acceptHandler, self);
+}
+
+void MockSpyServer::reapSessions(void)
+{
+    for(auto iter = _sessions.begin(); iter != _sessions.end();)
+    {
+        auto &session = **iter;
+        if(session.loopsDone < 2)
+        {
+            ++iter;
+            continue;
+        }
+
+        session.commandThread.join();
+        session.streamThread.join();
+        session.conn->close();
+        _reapedCPUNs += session.commandCPUNs + session.streamCPUNs;
+
+        iter = _sessions.erase(iter);
+    }
+}
+
+void MockSpyServer::commandLoop(Session &session)
+{
+    std::vector<uint8_t> body;
+
+    while(true)
+    {
+        SpyServerCommandHeader header;
+        if(session.conn->read(sizeof(header), reinterpret_cast<uint8_t*>(&header)) <= 0)
+            break;
+
+        body.resize(header.BodySize);
+        if((header.BodySize > 0) and (session.conn->read(header.BodySize, body.data()) <= 0))
+            break;
+
+        bool ok = true;
+        switch(header.CommandType)
+        {
+        case SPYSERVER_CMD_HELLO:
+            ok = sendDeviceInfo(session) and sendClientSync(session);
+            break;
+
+        case SPYSERVER_CMD_SET_SETTING:
+        {
+            if(body.size() < sizeof(SpyServerSettingTarget))
+                break;
+
+            SpyServerSettingTarget target;
+            std::memcpy(&target, body.data(), sizeof(target));
+
+            bool sync = false;
+            {
+                std::lock_guard<std::mutex> lock(session.mutex);
+                switch(target.Setting)
+                {
+                case SPYSERVER_SETTING_STREAMING_ENABLED:
+                    session.streaming = (target.Value != 0);
+                    break;
+
+                case SPYSERVER_SETTING_IQ_FORMAT:
+                    session.format = target.Value;
+                    break;
+
+                case SPYSERVER_SETTING_IQ_FREQUENCY:
+                    session.frequency = target.Value;
+                    sync = true;
+                    break;
+
+                case SPYSERVER_SETTING_IQ_DECIMATION:
+                    session.decimation = std::min(target.Value, MockDecimationStages);
+                    sync = true;
+                    break;
+
+                case SPYSERVER_SETTING_GAIN:
+                    session.gain = std::min(target.Value, MockMaximumGain);
+                    sync = true;
+                    break;
+
+                default:
+                    break;
+                }
+            }
+            session.cond.notify_all();
+
+            if(sync)
+                ok = sendClientSync(session);
+            break;
+        }
+
+        case SPYSERVER_CMD_PING:
+            ok = sendMessage(session, SPYSERVER_MSG_TYPE_PONG, nullptr, 0);
+            break;
+
+        default:
+            break;
+        }
+
+        session.commandCPUNs = currentThreadCPUTimeNs();
+        if(not ok)
+            break;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(session.mutex);
+        session.running = false;
+    }
+    session.cond.notify_all();
+    session.loopsDone++;
+}
+
+void MockSpyServer::streamLoop(Session &session)
+{
+    using Clock = std::chrono::steady_clock;
+
+    Clock::time_point paceStart;
+    uint64_t pacedSamples = 0;
+    double pacedRate = 0.0;
+
+    while(true)
+    {
+        uint32_t format, decimation;
+        {
+            std::unique_lock<std::mutex> lock(session.mutex);
+            if(not session.streaming)
+            {
+                // Restart pacing after every pause.
+                pacedRate = 0.0;
+                session.cond.wait(lock, [&session](){ return not session.running or session.streaming; });
+            }
+            if(not session.running)
+                break;
+
+            format = session.format;
+            decimation = session.decimation;
+        }
+
+        uint32_t messageType;
+        switch(format)
+        {
+        case SPYSERVER_STREAM_FORMAT_UINT8:
+            messageType = SPYSERVER_MSG_TYPE_UINT8_IQ;
+            break;
+
+        case SPYSERVER_STREAM_FORMAT_FLOAT:
+            messageType = SPYSERVER_MSG_TYPE_FLOAT_IQ;
+            break;
+
+        default:
+            messageType = SPYSERVER_MSG_TYPE_INT16_IQ;
+            break;
+        }
+
+        const auto &body = messageBody(format);
+        if(not sendMessage(session, messageType, body.data(), static_cast<uint32_t>(body.size())))
+            break;
+
+        const auto numSamples = _config.samplesPerMessage;
+        _samplesSent += numSamples;
+        _messagesSent++;
+        session.streamCPUNs = currentThreadCPUTimeNs();
+
+        if(_config.paced)
+        {
+            const double rate = double(_maximumSampleRate.load()) / double(1 << decimation);
+            if(rate != pacedRate)
+            {
+                paceStart = Clock::now();
+                pacedSamples = 0;
+                pacedRate = rate;
+            }
+
+            pacedSamples += numSamples;
+            std::this_thread::sleep_until(paceStart + std::chrono::nanoseconds(static_cast<int64_t>((pacedSamples * 1e9) / rate)));
+        }
+    }
+
+    session.loopsDone++;
+}
+
+bool MockSpyServer::sendMessage(Session &session, const uint32_t messageType, const void *body, const uint32_t bodySize)
+{
+    std::vector<uint8_t> message(sizeof(SpyServerMessageHeader) + bodySize);
+
+    SpyServerMessageHeader header;
+    header.ProtocolID = SPYSERVER_PROTOCOL_VERSION;
+    header.MessageType = messageType;
+    header.StreamType = (messageType >= SPYSERVER_MSG_TYPE_UINT8_IQ) ? SPYSERVER_STREAM_TYPE_IQ : SPYSERVER_STREAM_TYPE_STATUS;
+    header.BodySize = bodySize;
+    {
+        std::lock_guard<std::mutex> lock(session.mutex);
+        header.SequenceNumber = session.sequenceNumber++;
+    }
+
+    std::memcpy(message.data(), &header, sizeof(header));
+    if(bodySize > 0)
+        std::memcpy(message.data() + sizeof(header), body, bodySize);
+
+    return session.conn->write(static_cast<int>(message.size()), message.data());
+}
+
+bool MockSpyServer::sendDeviceInfo(Session &session)
+{
+    const auto maximumSampleRate = _maximumSampleRate.load();
+
+    SpyServerDeviceInfo devInfo;
+    devInfo.DeviceType = SPYSERVER_DEVICE_AIRSPY_ONE;
+    devInfo.DeviceSerial = MockDeviceSerial;
+    devInfo.MaximumSampleRate = maximumSampleRate;
+    devInfo.MaximumBandwidth = (maximumSampleRate * 4) / 5;
+    devInfo.DecimationStageCount = MockDecimationStages;
+    devInfo.GainStageCount = MockMaximumGain;
+    devInfo.MaximumGainIndex = MockMaximumGain;
+    devInfo.MinimumFrequency = MockMinimumFrequency;
+    devInfo.MaximumFrequency = MockMaximumFrequency;
+    devInfo.Resolution = 12;
+    devInfo.MinimumIQDecimation = 0;
+    devInfo.ForcedIQFormat = SPYSERVER_STREAM_FORMAT_INVALID;
+
+    return sendMessage(session, SPYSERVER_MSG_TYPE_DEVICE_INFO, &devInfo, sizeof(devInfo));
+}
+
+bool MockSpyServer::sendClientSync(Session &session)
+{
+    const auto halfRate = _maximumSampleRate.load() / 2;
+
+    SpyServerClientSync clientSync;
+    {
+        std::lock_guard<std::mutex> lock(session.mutex);
+        clientSync.CanControl = 1;
+        clientSync.Gain = session.gain;
+        clientSync.DeviceCenterFrequency = session.frequency;
+        clientSync.IQCenterFrequency = session.frequency;
+        clientSync.FFTCenterFrequency = session.frequency;
+    }
+    clientSync.MinimumIQCenterFrequency = MockMinimumFrequency + halfRate;
+    clientSync.MaximumIQCenterFrequency = MockMaximumFrequency - halfRate;
+    clientSync.MinimumFFTCenterFrequency = MockMinimumFrequency + halfRate;
+    clientSync.MaximumFFTCenterFrequency = MockMaximumFrequency - halfRate;
+
+    return sendMessage(session, SPYSERVER_MSG_TYPE_CLIENT_SYNC, &clientSync, sizeof(clientSync));
+}
+
+const std::vector<uint8_t> &MockSpyServer::messageBody(const uint32_t format) const
+{
+    switch(format)
+    {
+    case SPYSERVER_STREAM_FORMAT_UINT8:
+        return _uint8Body;
+
+    case SPYSERVER_STREAM_FORMAT_FLOAT:
+        return _floatBody;
+
+    default:
+        return _int16Body;
+    }
+}
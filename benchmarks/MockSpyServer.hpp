@@ -0,0 +1,116 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <utils/networking.h>
+#include <spyserver_protocol.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct MockSpyServerConfig
+{
+    std::string host{"127.0.0.1"};
+    uint16_t port{5555};
+
+    // Reported as the device's maximum rate. Streams are paced at this rate
+    // divided by the client's decimation, unless paced is false.
+    uint32_t maximumSampleRate{10000000};
+    bool paced{true};
+
+    size_t samplesPerMessage{16384};
+
+    // Used until the client requests a format.
+    SpyServerStreamFormat format{SPYSERVER_STREAM_FORMAT_INT16};
+};
+
+//
+// Loopback stand-in for a SpyServer, built on SDR++'s networking classes.
+// It answers the handshake, settings and pings like a real server, and
+// streams a synthetic tone while streaming is enabled.
+//
+class MockSpyServer
+{
+public:
+    MockSpyServer(const MockSpyServerConfig &config);
+    ~MockSpyServer(void);
+
+    inline const MockSpyServerConfig &config(void) const
+    {
+        return _config;
+    }
+
+    // Applies to current sessions too.
+    void setMaximumSampleRate(const uint32_t rate);
+
+    uint64_t samplesSent(void) const;
+
+    uint64_t messagesSent(void) const;
+
+    // CPU time used by the server's own threads, so callers can separate
+    // it from the client's.
+    double cpuSeconds(void) const;
+
+private:
+    struct Session
+    {
+        net::Conn conn;
+        std::thread commandThread;
+        std::thread streamThread;
+
+        std::mutex mutex;
+        std::condition_variable cond;
+        bool running{true};
+        bool streaming{false};
+
+        uint32_t format{0};
+        uint32_t decimation{0};
+        uint32_t frequency{100000000};
+        uint32_t gain{0};
+        uint32_t sequenceNumber{0};
+
+        std::atomic<uint64_t> commandCPUNs{0};
+        std::atomic<uint64_t> streamCPUNs{0};
+
+        // Both loops have returned, so the session can be reaped.
+        std::atomic<int> loopsDone{0};
+    };
+
+    static void acceptHandler(net::Conn conn, void *ctx);
+
+    // Joins and frees sessions whose client has gone. Call with
+    // _sessionsMutex held.
+    void reapSessions(void);
+
+    void commandLoop(Session &session);
+    void streamLoop(Session &session);
+
+    bool sendMessage(Session &session, const uint32_t messageType, const void *body, const uint32_t bodySize);
+    bool sendDeviceInfo(Session &session);
+    bool sendClientSync(Session &session);
+
+    const std::vector<uint8_t> &messageBody(const uint32_t format) const;
+
+    MockSpyServerConfig _config;
+    std::atomic<uint32_t> _maximumSampleRate;
+
+    // One message's worth of the same tone in each wire format.
+    std::vector<uint8_t> _uint8Body;
+    std::vector<uint8_t> _int16Body;
+    std::vector<uint8_t> _floatBody;
+
+    std::atomic<uint64_t> _samplesSent{0};
+    std::atomic<uint64_t> _messagesSent{0};
+
+    net::Listener _listener;
+    std::mutex _sessionsMutex;
+    std::vector<std::unique_ptr<Session>> _sessions;
+    uint64_t _reapedCPUNs{0};
+};
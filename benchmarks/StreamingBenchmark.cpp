@@ -0,0 +1,251 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+//
+// Streams from a loopback mock SpyServer through SoapySpyServerClient
+// and reports sustained throughput, client CPU cost and overflows.
+//
+
+#include "BenchmarkUtility.hpp"
+#include "MockSpyServer.hpp"
+
+#include "SoapySpyServerClient.hpp"
+
+#include <SoapySDR/Errors.hpp>
+#include <SoapySDR/Formats.hpp>
+#include <SoapySDR/Logger.hpp>
+
+#include <chrono>
+#include <complex>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static const std::vector<double> SweepRates{1e6, 2e6, 5e6, 10e6, 20e6, 50e6, 100e6};
+
+struct BenchmarkOptions
+{
+    std::vector<double> rates{10e6};
+    MockSpyServerConfig server;
+    double duration{5.0};
+    SoapySDR::Kwargs deviceArgs;
+};
+
+struct BenchmarkResult
+{
+    double rate{0.0};
+    double sentMSps{0.0};
+    double receivedMSps{0.0};
+    double clientCPUPercent{0.0};
+    size_t overflows{0};
+    double overflowOnset{-1.0};
+};
+
+//
+// Options
+//
+
+static void printUsage(const char *name)
+{
+    std::printf(
+        "Usage: %s [options]\n"
+        "  --rate <Hz>[,<Hz>...]  Server sample rate(s) to test (default: 10e6)\n"
+        "  --sweep                Test %zu rates from 1 to 100 MS/s\n"
+        "  --message-size <n>     Samples per server message (default: %zu)\n"
+        "  --format <fmt>         Wire format: uint8, int16, float (default: int16)\n"
+        "  --duration <s>         Seconds per rate (default: 5)\n"
+        "  --unpaced              Send as fast as the connection allows\n"
+        "  --port <n>             Loopback port (default: %u)\n"
+        "  --args <kwargs>        Extra device args, e.g. \"channels=4\"\n",
+        name,
+        SweepRates.size(),
+        MockSpyServerConfig().samplesPerMessage,
+        unsigned(MockSpyServerConfig().port));
+}
+
+static std::vector<double> parseRates(const std::string &str)
+{
+    std::vector<double> rates;
+
+    size_t start = 0;
+    while(start <= str.size())
+    {
+        const auto end = std::min(str.find(',', start), str.size());
+        rates.emplace_back(std::stod(str.substr(start, end - start)));
+        start = end + 1;
+    }
+
+    return rates;
+}
+
+static SpyServerStreamFormat parseFormat(const std::string &str)
+{
+    if(str == "uint8") return SPYSERVER_STREAM_FORMAT_UINT8;
+    if(str == "int16") return SPYSERVER_STREAM_FORMAT_INT16;
+    if(str == "float") return SPYSERVER_STREAM_FORMAT_FLOAT;
+
+    throw std::invalid_argument("Invalid format: "+str);
+}
+
+static BenchmarkOptions parseOptions(int argc, char **argv)
+{
+    BenchmarkOptions options;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        const std::string arg(argv[i]);
+        const auto next = [&]() -> std::string
+        {
+            if(++i >= argc)
+                throw std::invalid_argument("Missing value for "+arg);
+
+            return argv[i];
+        };
+
+        if(arg == "--rate")              options.rates = parseRates(next());
+        else if(arg == "--sweep")        options.rates = SweepRates;
+        else if(arg == "--message-size") options.server.samplesPerMessage = std::stoul(next());
+        else if(arg == "--format")       options.server.format = parseFormat(next());
+        else if(arg == "--duration")     options.duration = std::stod(next());
+        else if(arg == "--unpaced")      options.server.paced = false;
+        else if(arg == "--port")         options.server.port = static_cast<uint16_t>(std::stoul(next()));
+        else if(arg == "--args")         options.deviceArgs = SoapySDR::KwargsFromString(next());
+        else if((arg == "--help") or (arg == "-h"))
+        {
+            printUsage(argv[0]);
+            std::exit(EXIT_SUCCESS);
+        }
+        else throw std::invalid_argument("Unknown option: "+arg);
+    }
+
+    if(options.rates.empty() or (options.duration <= 0.0))
+        throw std::invalid_argument("Invalid rate or duration");
+
+    return options;
+}
+
+//
+// Benchmark
+//
+
+static BenchmarkResult runBenchmark(
+    MockSpyServer &server,
+    const BenchmarkOptions &options,
+    const double rate)
+{
+    BenchmarkResult result;
+    result.rate = rate;
+
+    server.setMaximumSampleRate(static_cast<uint32_t>(rate));
+
+    auto args = options.deviceArgs;
+    args["host"] = server.config().host;
+    args["port"] = std::to_string(server.config().port);
+
+    // The device starts at the server's maximum rate.
+    SoapySpyServerClient device(args);
+
+    std::vector<size_t> channels(device.getNumChannels(SOAPY_SDR_RX));
+    for(size_t i = 0; i < channels.size(); ++i) channels[i] = i;
+
+    static constexpr size_t BufferSize = 1 << 16;
+    std::vector<std::vector<std::complex<float>>> buffers(channels.size(), std::vector<std::complex<float>>(BufferSize));
+    std::vector<void*> buffPtrs;
+    for(auto &buffer: buffers) buffPtrs.emplace_back(buffer.data());
+
+    auto *stream = device.setupStream(SOAPY_SDR_RX, SOAPY_SDR_CF32, channels, SoapySDR::Kwargs());
+
+    const auto startSent = server.samplesSent();
+    const auto startServerCPU = server.cpuSeconds();
+    const auto startCPU = processCPUSeconds();
+    const auto start = Clock::now();
+    const auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.duration));
+
+    device.activateStream(stream, 0, 0, 0);
+
+    uint64_t numReceived = 0;
+    while(Clock::now() < end)
+    {
+        int flags = 0;
+        long long timeNs = 0;
+        const int ret = device.readStream(stream, buffPtrs.data(), BufferSize, flags, timeNs, 100000);
+
+        if(ret > 0)
+            numReceived += static_cast<uint64_t>(ret) * channels.size();
+        else if(ret == SOAPY_SDR_OVERFLOW)
+        {
+            if(result.overflows++ == 0)
+                result.overflowOnset = std::chrono::duration<double>(Clock::now() - start).count();
+        }
+        else if(ret != SOAPY_SDR_TIMEOUT)
+            throw std::runtime_error(std::string("readStream: ")+SoapySDR::errToStr(ret));
+    }
+
+    const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    const double serverCPU = server.cpuSeconds() - startServerCPU;
+    const double clientCPU = (processCPUSeconds() - startCPU) - serverCPU;
+    const auto numSent = server.samplesSent() - startSent;
+
+    device.deactivateStream(stream, 0, 0);
+    device.closeStream(stream);
+
+    result.sentMSps = (double(numSent) / elapsed) / 1e6;
+    result.receivedMSps = (double(numReceived) / elapsed) / 1e6;
+    result.clientCPUPercent = (100.0 * clientCPU) / elapsed;
+
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    try
+    {
+        const auto options = parseOptions(argc, argv);
+
+        // Keep per-run logging out of the results.
+        SoapySDR::setLogLevel(SOAPY_SDR_WARNING);
+
+        MockSpyServer server(options.server);
+
+        std::printf(
+            "%12s %12s %12s %10s %14s %10s %10s\n",
+            "Rate (MS/s)", "Sent (MS/s)", "Recv (MS/s)", "CPU (%)", "CPU/MS/s (%)", "Overflows", "Onset (s)");
+
+        double firstOverflowRate = -1.0;
+        for(const auto rate: options.rates)
+        {
+            const auto result = runBenchmark(server, options, rate);
+            const double cpuPerMSps = (result.receivedMSps > 0.0) ? (result.clientCPUPercent / result.receivedMSps) : 0.0;
+
+            std::printf(
+                "%12.3f %12.3f %12.3f %10.1f %14.3f %10zu %10.3f\n",
+                rate / 1e6,
+                result.sentMSps,
+                result.receivedMSps,
+                result.clientCPUPercent,
+                cpuPerMSps,
+                result.overflows,
+                result.overflowOnset);
+
+            if((result.overflows > 0) and (firstOverflowRate < 0.0))
+                firstOverflowRate = rate;
+        }
+
+        if(firstOverflowRate > 0.0)
+            std::printf("\nOverflows began at %.3f MS/s.\n", firstOverflowRate / 1e6);
+        else
+            std::printf("\nNo overflows.\n");
+    }
+    catch(const std::exception &ex)
+    {
+        std::fprintf(stderr, "Error: %s\n", ex.what());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,145 @@
+// Copyright (c) 2022 Nicholas Corgan
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+//
+// Repeatedly opens a device with several windows on a loopback mock
+// SpyServer, streams from every window, and destroys the device while its
+// poll engine is still servicing the windows not yet closed. Meant to be
+// run under a sanitizer; exits nonzero if any iteration fails.
+//
+
+#include "MockSpyServer.hpp"
+
+#include "SoapySpyServerClient.hpp"
+
+#include <SoapySDR/Errors.hpp>
+#include <SoapySDR/Formats.hpp>
+
+#include <chrono>
+#include <complex>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+struct StressOptions
+{
+    size_t windows{8};
+    size_t iterations{100};
+    MockSpyServerConfig server;
+};
+
+//
+// Options
+//
+
+static void printUsage(const char *name)
+{
+    std::printf(
+        "Usage: %s [options]\n"
+        "  --windows <n>     Windows per device (default: %zu)\n"
+        "  --iterations <n>  Devices to open and destroy (default: %zu)\n"
+        "  --port <n>        Loopback port (default: %u)\n",
+        name,
+        StressOptions().windows,
+        StressOptions().iterations,
+        unsigned(MockSpyServerConfig().port));
+}
+
+static StressOptions parseOptions(int argc, char **argv)
+{
+    StressOptions options;
+    options.server.maximumSampleRate = 2000000;
+    options.server.samplesPerMessage = 1024;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        const std::string arg(argv[i]);
+        const auto next = [&]() -> std::string
+        {
+            if(++i >= argc)
+                throw std::invalid_argument("Missing value for "+arg);
+
+            return argv[i];
+        };
+
+        if(arg == "--windows")         options.windows = std::stoul(next());
+        else if(arg == "--iterations") options.iterations = std::stoul(next());
+        else if(arg == "--port")       options.server.port = static_cast<uint16_t>(std::stoul(next()));
+        else if((arg == "--help") or (arg == "-h"))
+        {
+            printUsage(argv[0]);
+            std::exit(EXIT_SUCCESS);
+        }
+        else throw std::invalid_argument("Unknown option: "+arg);
+    }
+
+    if(options.windows < 2)
+        throw std::invalid_argument("Need at least two windows");
+
+    return options;
+}
+
+//
+// Stress
+//
+
+static void runIteration(const MockSpyServer &server, const StressOptions &options)
+{
+    SoapySpyServerClient device(SoapySDR::Kwargs{
+        {"host", server.config().host},
+        {"port", std::to_string(server.config().port)},
+        {"windows", std::to_string(options.windows)}});
+
+    static constexpr size_t BufferSize = 4096;
+    std::vector<std::complex<float>> buffer(BufferSize);
+    void *buffPtrs[] = {buffer.data()};
+
+    std::vector<SoapySDR::Stream*> streams;
+    for(size_t channel = 0; channel < device.getNumChannels(SOAPY_SDR_RX); ++channel)
+    {
+        streams.emplace_back(device.setupStream(SOAPY_SDR_RX, SOAPY_SDR_CF32, {channel}, SoapySDR::Kwargs()));
+        device.activateStream(streams.back(), 0, 0, 0);
+    }
+
+    for(auto *stream: streams)
+    {
+        int flags = 0;
+        long long timeNs = 0;
+        const int ret = device.readStream(stream, buffPtrs, BufferSize, flags, timeNs, 1000000);
+        if((ret < 0) and (ret != SOAPY_SDR_OVERFLOW))
+            throw std::runtime_error(std::string("readStream: ")+SoapySDR::errToStr(ret));
+    }
+
+    // The streams are left active, so every window still has data arriving
+    // as the device closes them one at a time.
+}
+
+int main(int argc, char **argv)
+{
+    try
+    {
+        const auto options = parseOptions(argc, argv);
+        MockSpyServer server(options.server);
+
+        const auto start = Clock::now();
+        for(size_t i = 0; i < options.iterations; ++i)
+            runIteration(server, options);
+
+        std::printf(
+            "%zu devices with %zu windows each opened and destroyed in %.2f s\n",
+            options.iterations,
+            options.windows,
+            std::chrono::duration<double>(Clock::now() - start).count());
+    }
+    catch(const std::exception &ex)
+    {
+        std::fprintf(stderr, "Error: %s\n", ex.what());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}